@@ -4,6 +4,27 @@
 
 #include "LC4.h"
 #include <stdio.h>
+#ifdef LC4_PROFILE
+#include "profile.h"
+#endif
+#ifdef LC4_COVERAGE
+#include "coverage.h"
+#endif
+#ifdef LC4_UNDO
+#include "undo.h"
+#endif
+
+#ifdef LC4_PAGED_MEMORY
+// Every page that was never written. Word 0 decodes to all zero fields, so the
+// decoded entries only need their valid flag set.
+#define ZERO_DECODED1   { 1, 0, 0, 0, 0, 0, 0 }
+#define ZERO_DECODED4   ZERO_DECODED1, ZERO_DECODED1, ZERO_DECODED1, ZERO_DECODED1
+#define ZERO_DECODED16  ZERO_DECODED4, ZERO_DECODED4, ZERO_DECODED4, ZERO_DECODED4
+#define ZERO_DECODED64  ZERO_DECODED16, ZERO_DECODED16, ZERO_DECODED16, ZERO_DECODED16
+#define ZERO_DECODED256 ZERO_DECODED64, ZERO_DECODED64, ZERO_DECODED64, ZERO_DECODED64
+
+static MemoryPage ZeroPage = { 2, { 0 }, { ZERO_DECODED256 } }; // refs is never 1, so it is never written
+#endif
 
 /*
  * Reset the machine state as Pennsim would do
@@ -34,9 +55,32 @@ void Reset(MachineState* CPU)
     CPU->dmemAddr = 0;
     CPU->dmemValue = 0;
 
+    CPU->traceFormat = TRACE_TEXT;
+    CPU->traceFilter = NULL;
+    CPU->instrCount = 0;
+    CPU->deviceBase = 65536;
+    CPU->deviceCount = 0;
+#ifdef LC4_PROFILE
+    CPU->profile = NULL;
+#endif
+#ifdef LC4_COVERAGE
+    CPU->coverage = NULL;
+    CPU->prevPC = 0;
+#endif
+#ifdef LC4_UNDO
+    CPU->undo = NULL;
+#endif
+
+#ifdef LC4_PAGED_MEMORY
+    for (i = 0; i < 65536 / PAGE_WORDS; i++) {
+        CPU->pages[i] = &ZeroPage;
+    }
+#else
     for (i = 0; i < 65536; i++) {
         CPU->memory[i] = 0;
+        CPU->decoded[i].valid = 0;
     }
+#endif
 }
 
 
@@ -55,52 +99,497 @@ void ClearSignals(MachineState* CPU)
 }
 
 
+#ifdef LC4_PAGED_MEMORY
 /*
- * This function should write out the current state of the CPU to the file output.
+ * Drop one reference to page, freeing it when it was the last.
  */
-void WriteOut(MachineState* CPU, FILE* output)
+static void ReleasePage(MemoryPage* page)
+{
+    if (page != NULL && page != &ZeroPage && __atomic_sub_fetch(&page->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(page);
+    }
+}
+
+
+/*
+ * Give CPU its own copy of the page holding addr so it can be written.
+ */
+MemoryPage* PrivatePage(MachineState* CPU, unsigned short int addr)
+{
+    MemoryPage* shared = CPU->pages[addr >> 8];
+    MemoryPage* page = malloc(sizeof(MemoryPage));
+
+    if (page == NULL) {
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    memcpy(page->words, shared->words, sizeof(page->words));
+    memcpy(page->decoded, shared->decoded, sizeof(page->decoded));
+    page->refs = 1;
+    CPU->pages[addr >> 8] = page;
+    ReleasePage(shared);
+    return page;
+}
+#endif
+
+
+/*
+ * Map a device's registers at start..end.
+ */
+int MapDevice(MachineState* CPU, unsigned short int start, unsigned short int end,
+              unsigned short int (*read)(void* device, unsigned short int addr),
+              void (*write)(void* device, unsigned short int addr, unsigned short int value), void* device)
 {
+    DeviceRange* range;
+
+    if (CPU->deviceCount == MAX_DEVICE_RANGES) {
+        return 1;
+    }
+    range = &CPU->devices[CPU->deviceCount++];
+    range->start = start;
+    range->end = end;
+    range->read = read;
+    range->write = write;
+    range->device = device;
+    if (start < CPU->deviceBase) {
+        CPU->deviceBase = start;
+    }
+    return 0;
+}
 
-    int bits[16];
+
+/*
+ * The device mapped at addr, or NULL.
+ */
+static DeviceRange* FindDevice(MachineState* CPU, unsigned short int addr)
+{
     int i;
-    int d; // Rd
 
-    unsigned short int n = CPU->memory[CPU->PC];
-    for (i = 15; i >= 0; i--) {
-        bits[i] = n % 2;
-        n = n / 2;
+    for (i = 0; i < CPU->deviceCount; i++) {
+        if (addr >= CPU->devices[i].start && addr <= CPU->devices[i].end) {
+            return &CPU->devices[i];
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Load through the device mapped at addr, or from memory if there is none.
+ */
+unsigned short int DeviceLoad(MachineState* CPU, unsigned short int addr)
+{
+    DeviceRange* range = FindDevice(CPU, addr);
+
+    return range != NULL ? range->read(range->device, addr) : ReadMemory(CPU, addr);
+}
+
+
+/*
+ * Store through the device mapped at addr, or to memory if there is none.
+ */
+void DeviceStore(MachineState* CPU, unsigned short int addr, unsigned short int value)
+{
+    DeviceRange* range = FindDevice(CPU, addr);
+
+    if (range != NULL) {
+        range->write(range->device, addr, value);
+    } else {
+        WriteMemory(CPU, addr, value);
+    }
+}
+
+
+/*
+ * Copy all 65536 words of memory into words.
+ */
+void DumpMemory(MachineState* CPU, unsigned short int* words)
+{
+#ifdef LC4_PAGED_MEMORY
+    int i;
+
+    for (i = 0; i < 65536 / PAGE_WORDS; i++) {
+        memcpy(words + i * PAGE_WORDS, CPU->pages[i]->words, sizeof(CPU->pages[i]->words));
+    }
+#else
+    memcpy(words, CPU->memory, sizeof(CPU->memory));
+#endif
+}
+
+
+/*
+ * Make dst's memory a copy of src's.
+ */
+void ShareMemory(MachineState* dst, MachineState* src)
+{
+#ifdef LC4_PAGED_MEMORY
+    MemoryPage* page;
+    int i;
+    int j;
+
+    for (i = 0; i < 65536 / PAGE_WORDS; i++) {
+        page = src->pages[i];
+        if (page == dst->pages[i]) { // already shared, e.g. when dst is reset to src between runs
+            continue;
+        }
+        if (page != &ZeroPage) {
+            // Shared pages are read without locks, so finish decoding this one first
+            for (j = 0; j < PAGE_WORDS; j++) {
+                if (!page->decoded[j].valid) {
+                    DecodeInstruction(src, i * PAGE_WORDS + j);
+                }
+            }
+            __atomic_add_fetch(&page->refs, 1, __ATOMIC_ACQ_REL);
+        }
+        ReleasePage(dst->pages[i]);
+        dst->pages[i] = page;
+    }
+#else
+    memcpy(dst->memory, src->memory, sizeof(dst->memory));
+    memcpy(dst->decoded, src->decoded, sizeof(dst->decoded));
+#endif
+}
+
+
+/*
+ * Free the memory pages CPU holds.
+ */
+void ReleaseMemory(MachineState* CPU)
+{
+#ifdef LC4_PAGED_MEMORY
+    int i;
+
+    for (i = 0; i < 65536 / PAGE_WORDS; i++) {
+        ReleasePage(CPU->pages[i]);
+        CPU->pages[i] = &ZeroPage;
+    }
+#endif
+}
+
+
+/*
+ * Sign extend the low n bits of value.
+ */
+static short int SignExtend(unsigned short int value, int n)
+{
+    short int v = 1U << (n - 1);
+    value = value & ((1U << n) - 1);
+    return (value ^ v) - v;
+}
+
+
+/*
+ * Decode the word at memory[addr] into decoded[addr].
+ */
+void DecodeInstruction(MachineState* CPU, unsigned short int addr)
+{
+    DecodeWord(ReadMemory(CPU, addr), DecodedAt(CPU, addr));
+}
+
+
+/*
+ * Decode the instruction word n into insn.
+ */
+void DecodeWord(unsigned short int n, DecodedInsn* insn)
+{
+    insn->opcode = n >> 12;
+    insn->d = (n >> 9) & 0x7;
+    insn->s = (n >> 6) & 0x7;
+    insn->t = n & 0x7;
+    insn->sub = 0;
+    insn->imm = 0;
+
+    switch (insn->opcode) {
+    case OP_BR:
+        insn->sub = (n >> 9) & 0x7; // nzp
+        insn->imm = SignExtend(n, 9);
+        break;
+    case OP_ARITH:
+        if (n & 0x20) {
+            insn->sub = SUB_IMM;
+            insn->imm = SignExtend(n, 5);
+        } else {
+            insn->sub = (n >> 3) & 0x3;
+        }
+        break;
+    case OP_CMP:
+        insn->s = (n >> 9) & 0x7;
+        insn->sub = (n >> 7) & 0x3;
+        if (insn->sub == 2) {
+            insn->imm = SignExtend(n, 7); // CMPI
+        } else {
+            insn->imm = n & 0x7F;         // CMPIU
+        }
+        break;
+    case OP_LOGIC:
+        if (n & 0x20) {
+            insn->sub = SUB_IMM;
+            insn->imm = n & 0x1F;
+        } else {
+            insn->sub = (n >> 3) & 0x3;
+        }
+        break;
+    case OP_LDR:
+    case OP_STR:
+        insn->imm = SignExtend(n, 6);
+        break;
+    case OP_CONST:
+        insn->imm = SignExtend(n, 9);
+        break;
+    case OP_SHIFT:
+        insn->sub = (n >> 4) & 0x3;
+        insn->imm = n & 0xF;
+        break;
+    case OP_JSR:
+    case OP_JMP:
+        insn->sub = (n >> 11) & 0x1;
+        insn->imm = SignExtend(n, 11);
+        break;
+    case OP_HICONST:
+        insn->sub = (n >> 8) & 0x1;
+        insn->imm = n & 0xFF;
+        break;
+    case OP_TRAP:
+        insn->imm = n & 0xFF;
+        break;
     }
-    d = bits[4] * 4 + bits[5] * 2 + bits[6];
 
-    fprintf(output, "%04X ", CPU->PC);
+    insn->valid = 1;
+}
+
 
-    for (i = 0; i < 16; i++) {
-        fprintf(output, "%d", bits[i]);
+/*
+ * Return the decoded instruction at the current PC, decoding it if needed.
+ */
+static DecodedInsn* FetchDecoded(MachineState* CPU)
+{
+    DecodedInsn* insn = DecodedAt(CPU, CPU->PC);
+    if (!insn->valid) {
+        DecodeInstruction(CPU, CPU->PC);
     }
+    return insn;
+}
+
+
+/*
+ * Fill rec with the trace line for the instruction at the current PC.
+ */
+void MakeTraceRecord(MachineState* CPU, TraceRecord* rec)
+{
+    DecodedInsn* insn = FetchDecoded(CPU);
+
+    rec->PC = CPU->PC;
+    rec->insn = ReadMemory(CPU, CPU->PC);
 
     if (CPU->regFile_WE == '1') {
-        if ((bits[0] == 1 && bits[1] == 1 && bits[2] == 1 && bits[3] == 1) || (bits[0] == 0 && bits[1] == 1 && bits[2] == 0 && bits[3] == 0)) { // if TRAP or JSR
-            fprintf(output, " %d %d %04X ", CPU->regFile_WE - '0', 7, CPU->regInputVal);
+        rec->regFile_WE = 1;
+        if (insn->opcode == OP_TRAP || insn->opcode == OP_JSR) {
+            rec->regNum = 7;
         } else {
-            fprintf(output, " %d %d %04X ", CPU->regFile_WE - '0', d, CPU->regInputVal);
+            rec->regNum = insn->d;
         }
+        rec->regInputVal = CPU->regInputVal;
     } else {
-        fprintf(output, " 0 0 0000 ");
+        rec->regFile_WE = 0;
+        rec->regNum = 0;
+        rec->regInputVal = 0;
     }
 
     if (CPU->NZP_WE == '1') {
-        fprintf(output, "%d %d ", CPU->NZP_WE - '0', CPU->NZPVal);
+        rec->NZP_WE = 1;
+        rec->NZPVal = CPU->NZPVal;
     } else {
-        fprintf(output, "0 0 ");
+        rec->NZP_WE = 0;
+        rec->NZPVal = 0;
     }
 
-    if ((bits[0] == 0 && bits[1] == 1 && bits[2] == 1 && bits[3] == 0) || (bits[0] == 0 && bits[1] == 1 && bits[2] == 1 && bits[3] == 1)) { // if LDR or STR
-        fprintf(output, "%d %04X %04X", CPU->DATA_WE - '0', CPU->dmemAddr, CPU->dmemValue);
+    if (insn->opcode == OP_LDR || insn->opcode == OP_STR) {
+        rec->DATA_WE = CPU->DATA_WE - '0';
+        rec->dmemAddr = CPU->dmemAddr;
+        rec->dmemValue = CPU->dmemValue;
     } else {
-        fprintf(output, "0 0000 0000");
+        rec->DATA_WE = 0;
+        rec->dmemAddr = 0;
+        rec->dmemValue = 0;
+    }
+}
+
+
+/*
+ * Whether the instruction at the current PC, about to be written out, passes
+ * filter. The cheap tests come first; sampling comes last so that it only
+ * counts instructions that passed the others.
+ */
+static int PassesFilter(TraceFilter* filter, MachineState* CPU)
+{
+    unsigned long long missed;
+
+    if ((filter->tests & TRACE_FILTER_PC) && !((filter->pcs[CPU->PC >> 6] >> (CPU->PC & 63)) & 1)) {
+        return 0;
+    }
+    if ((filter->tests & TRACE_FILTER_USER) && CPU->PSR >= 0x8000) {
+        return 0;
+    }
+    if ((filter->tests & TRACE_FILTER_OS) && CPU->PSR < 0x8000) {
+        return 0;
+    }
+    if ((filter->tests & TRACE_FILTER_WRITES) && CPU->DATA_WE != '1') {
+        return 0;
+    }
+    if (filter->tests & TRACE_FILTER_EVERY) {
+        if (CPU->instrCount == filter->next) {
+            filter->next += filter->every;
+            return 1;
+        }
+        if (CPU->instrCount > filter->next) { // the sample fell on an instruction that was not written
+            missed = CPU->instrCount - filter->next;
+            filter->next += (missed / filter->every + 1) * filter->every;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+
+/*
+ * This function should write out the current state of the CPU to the file output.
+ */
+void WriteOut(MachineState* CPU, FILE* output)
+{
+    TraceRecord rec;
+
+    if (output == NULL || (CPU->traceFilter != NULL && !PassesFilter(CPU->traceFilter, CPU))) {
+        return;
     }
 
-    fprintf(output, "\n");
+    MakeTraceRecord(CPU, &rec);
+    if (CPU->traceFormat == TRACE_BINARY) {
+        WriteBinaryRecord(output, &rec);
+    } else {
+        WriteTextRecord(output, &rec);
+    }
+}
+
+
+/*
+ * Returns 1 if the PC is outside of the code regions the current privilege level may execute.
+ */
+static int InvalidPC(MachineState* CPU)
+{
+    return (CPU->PSR < 32768 && CPU->PC >= 0x8000) || (CPU->PC >= 0x2000 && CPU->PC < 0x8000) || (CPU->PC >= 0xA000 && CPU->PC <= 0xFFFF);
+}
+
+
+#if defined(LC4_DISPATCH_TABLE) || defined(LC4_DISPATCH_THREADED)
+/*
+ * Opcodes 0011, 1011 and 1110 (and HICONST with bit 8 clear) do not update any state.
+ */
+static int IllegalOp(MachineState* CPU, FILE* output)
+{
+    return 0;
+}
+
+
+typedef int (*OpHandler)(MachineState* CPU, FILE* output);
+
+// Handlers indexed by opcode
+static const OpHandler OpTable[16] = {
+    BranchOp,     // 0000
+    ArithmeticOp, // 0001
+    ComparativeOp,// 0010
+    IllegalOp,    // 0011
+    JSROp,        // 0100
+    LogicalOp,    // 0101
+    LoadOp,       // 0110
+    StoreOp,      // 0111
+    RTIOp,        // 1000
+    ConstOp,      // 1001
+    ShiftModOp,   // 1010
+    IllegalOp,    // 1011
+    JumpOp,       // 1100
+    HiConstOp,    // 1101
+    IllegalOp,    // 1110
+    TrapOp        // 1111
+};
+#endif
+
+
+/*
+ * Run the hooks of the profile, coverage and undo builds on insn, which is
+ * about to run. Without them this is empty.
+ */
+static inline void BeforeInstruction(MachineState* CPU, DecodedInsn* insn)
+{
+#ifdef LC4_PROFILE
+    if (CPU->profile != NULL) {
+        ProfileInstruction(CPU->profile, CPU, insn);
+    }
+#endif
+#ifdef LC4_COVERAGE
+    if (CPU->coverage != NULL) {
+        CoverEdge(CPU->coverage, CPU);
+    }
+#endif
+#ifdef LC4_UNDO
+    if (CPU->undo != NULL) {
+        RecordUndo(CPU->undo, CPU, insn);
+    }
+#endif
+}
+
+
+/*
+ * Take back what BeforeInstruction recorded for an instruction that failed
+ * without running.
+ */
+static inline void InstructionFailed(MachineState* CPU)
+{
+#ifdef LC4_UNDO
+    if (CPU->undo != NULL) {
+        DropUndo(CPU->undo);
+    }
+#endif
+}
+
+
+/*
+ * Run the handler of insn, the instruction at the PC.
+ */
+static inline int ExecuteInstruction(MachineState* CPU, FILE* output, DecodedInsn* insn)
+{
+#if defined(LC4_DISPATCH_TABLE) || defined(LC4_DISPATCH_THREADED)
+    return OpTable[insn->opcode](CPU, output);
+#else
+    if (insn->opcode == OP_BR) {
+        return BranchOp(CPU, output); 
+    } else if (insn->opcode == OP_ARITH) {
+        return ArithmeticOp(CPU, output);
+    } else if (insn->opcode == OP_CMP) {
+        return ComparativeOp(CPU, output);
+    } else if (insn->opcode == OP_LOGIC) {
+        return LogicalOp(CPU, output);
+    } else if (insn->opcode == OP_JMP) {
+        return JumpOp(CPU, output);
+    } else if (insn->opcode == OP_JSR) {
+        return JSROp(CPU, output);
+    } else if (insn->opcode == OP_SHIFT) {
+        return ShiftModOp(CPU, output);
+    } else if (insn->opcode == OP_RTI) {
+        return RTIOp(CPU, output);
+    } else if (insn->opcode == OP_LDR) {
+        return LoadOp(CPU, output);
+    } else if (insn->opcode == OP_STR) {
+        return StoreOp(CPU, output);
+    } else if (insn->opcode == OP_CONST) {
+        return ConstOp(CPU, output);
+    } else if (insn->opcode == OP_HICONST) {
+        return HiConstOp(CPU, output);
+    } else if (insn->opcode == OP_TRAP) {
+        return TrapOp(CPU, output);
+    }
+
+    return 0;
+#endif
 }
 
 
@@ -109,205 +598,115 @@ void WriteOut(MachineState* CPU, FILE* output)
  */
 int UpdateMachineState(MachineState* CPU, FILE* output)
 {
-    char binary[16];
-    int bits[16];
-    int i;
-    int d; // Rd
-    int s; // Rs
-    int t; // Rt
-    unsigned short int u; // UIMM6/8/9
-    short int v;
-    unsigned short int n = CPU->memory[CPU->PC];
-    for (i = 15; i >= 0; i--) {
-        binary[i] = n % 2 + '0';
-        bits[i] = n % 2;
-        n = n / 2;
-    }
-
-    if ((CPU->PSR < 32768 && CPU->PC >= 0x8000) || (CPU->PC >= 0x2000 && CPU->PC < 0x8000) || (CPU->PC >= 0xA000 && CPU->PC <= 0xFFFF)) {
+    DecodedInsn* insn = FetchDecoded(CPU);
+
+    if (InvalidPC(CPU)) {
         printf("error occurred\n");
         return 1;
     }
-    
-    if (binary[0] == '0' && binary[1] == '0' && binary[2] == '0' && binary[3] == '0') {
-        BranchOp(CPU, output); 
-    } else if (binary[0] == '0' && binary[1] == '0' && binary[2] == '0' && binary[3] == '1') {
-        ArithmeticOp(CPU, output);
-    } else if (binary[0] == '0' && binary[1] == '0' && binary[2] == '1' && binary[3] == '0') {
-        ComparativeOp(CPU, output);
-    } else if (binary[0] == '0' && binary[1] == '1' && binary[2] == '0' && binary[3] == '1') {
-        LogicalOp(CPU, output);
-    } else if (binary[0] == '1' && binary[1] == '1' && binary[2] == '0' && binary[3] == '0') {
-        JumpOp(CPU, output);
-    } else if (binary[0] == '0' && binary[1] == '1' && binary[2] == '0' && binary[3] == '0') {
-        JSROp(CPU, output);
-    } else if (binary[0] == '1' && binary[1] == '0' && binary[2] == '1' && binary[3] == '0') {
-        ShiftModOp(CPU, output);
-    } else if (binary[0] == '1' && binary[1] == '0' && binary[2] == '0' && binary[3] == '0') { // RTI
-        CPU->rsMux_CTL = '1';
-        CPU->rtMux_CTL = '0';
-        CPU->rdMux_CTL = '0';
-
-        CPU->regFile_WE = '0';
-        CPU->NZP_WE = '0';
-        CPU->DATA_WE = '0';
-
-        WriteOut(CPU, output);
-        CPU->PC = CPU->R[7];
-        CPU->PSR = CPU->PSR << 1;
-        CPU->PSR = CPU->PSR >> 1;
-    } else if (binary[0] == '0' && binary[1] == '1' && binary[2] == '1' && binary[3] == '0') { // LDR
-        d = bits[4] * 4 + bits[5] * 2 + bits[6]; // check error handling
-        s = bits[7] * 4 + bits[8] * 2 + bits[9];
-        u = bits[10] * 32 + bits[11] * 16 + bits[12] * 8 + bits[13] * 4 + bits[14] * 2 + bits[15];
-        v = 1U << (5);
-        u = (u ^ v) - v;
-
-        CPU->rsMux_CTL = '0';
-        CPU->rtMux_CTL = '0';
-        CPU->rdMux_CTL = '0';
-
-        CPU->regFile_WE = '1';
-        CPU->NZP_WE = '1';
-        CPU->DATA_WE = '0';
-
-        
-
-        CPU->dmemAddr = CPU->R[s] + u;
-        if (CPU->PSR < 32768 && CPU->dmemAddr >= 0x8000) {
-            printf("error occurred\n");
-            return 1;
-        }
-        CPU->R[d] = CPU->memory[CPU->dmemAddr];
-        SetNZP(CPU, CPU->R[d]);
-        WriteOut(CPU, output);
-        CPU->PC += 1; 
-    } else if (binary[0] == '0' && binary[1] == '1' && binary[2] == '1' && binary[3] == '1') { // STR
-        t = bits[4] * 4 + bits[5] * 2 + bits[6];
-        s = bits[7] * 4 + bits[8] * 2 + bits[9];
-        u = bits[10] * 32 + bits[11] * 16 + bits[12] * 8 + bits[13] * 4 + bits[14] * 2 + bits[15];
-        v = 1U << (5);
-        u = (u ^ v) - v;
-
-        CPU->rsMux_CTL = '0';
-        CPU->rtMux_CTL = '1';
-        CPU->rdMux_CTL = '0';
-
-        CPU->regFile_WE = '0';
-        CPU->NZP_WE = '0';
-        CPU->DATA_WE = '1';
-
-        CPU->dmemAddr = CPU->R[s] + u;
-        if (CPU->PSR < 32768 && CPU->dmemAddr >= 0x8000) {
-            printf("error occurred\n");
-            return 1;
-        }
-        CPU->memory[CPU->dmemAddr] = CPU->R[t];
-        CPU->dmemValue = CPU->R[t];
-        WriteOut(CPU, output);
-        CPU->PC += 1; 
-    } else if (binary[0] == '1' && binary[1] == '0' && binary[2] == '0' && binary[3] == '1') { // CONST
-        d = bits[4] * 4 + bits[5] * 2 + bits[6];
-        u = bits[7] * 256 + bits[8] * 128 + bits[9] * 64 + bits[10] * 32 + 
-            bits[11] * 16 + bits[12] * 8 + bits[13] * 4 + bits[14] * 2 + bits[15];
-        v = 1U << (8);
-        u = (u ^ v) - v;
-
-        CPU->rsMux_CTL = '0';
-        CPU->rtMux_CTL = '0';
-        CPU->rdMux_CTL = '0';
-
-        CPU->regFile_WE = '1';
-        CPU->NZP_WE = '1';
-        CPU->DATA_WE = '0';
-
-        CPU->R[d] = u;
-        SetNZP(CPU, CPU->R[d]);
-        CPU->regInputVal = CPU->R[d];
-        WriteOut(CPU, output);
-        CPU->PC += 1; 
-    } else if (binary[0] == '1' && binary[1] == '1' && binary[2] == '0' && binary[3] == '1' && binary[7] == '1') { // HICONST
-        d = bits[4] * 4 + bits[5] * 2 + bits[6];
-        u = bits[8] * 128 + bits[9] * 64 + bits[10] * 32 + bits[11] * 16 + 
-            bits[12] * 8 + bits[13] * 4 + bits[14] * 2 + bits[15];
-
-        CPU->rsMux_CTL = '0';
-        CPU->rtMux_CTL = '0';
-        CPU->rdMux_CTL = '0';
-
-        CPU->regFile_WE = '1';
-        CPU->NZP_WE = '1';
-        CPU->DATA_WE = '0';
-
-        CPU->R[d] = (CPU->R[d] & 0xFF) | (u << 8);
-        SetNZP(CPU, CPU->R[d]);
-        CPU->regInputVal = CPU->R[d];
-        WriteOut(CPU, output);
-        CPU->PC += 1; 
-    } else if (binary[0] == '1' && binary[1] == '1' && binary[2] == '1' && binary[3] == '1') { // TRAP
-        // check error handling PSR
-        u = bits[8] * 128 + bits[9] * 64 + bits[10] * 32 + bits[11] * 16 + 
-            bits[12] * 8 + bits[13] * 4 + bits[14] * 2 + bits[15];
-
-        CPU->rsMux_CTL = '0';
-        CPU->rtMux_CTL = '0';
-        CPU->rdMux_CTL = '1';
-
-        CPU->regFile_WE = '1';
-        CPU->NZP_WE = '1';
-        CPU->DATA_WE = '0';
-
-        CPU->PSR = CPU->PSR | 0x8000;
-        CPU->R[7] = CPU->PC + 1;
-        SetNZP(CPU, CPU->R[7]);
-        CPU->regInputVal = CPU->R[7];
-        WriteOut(CPU, output);
-        CPU->PC = (0x8000 | u);
+    BeforeInstruction(CPU, insn);
+    if (ExecuteInstruction(CPU, output, insn) == 1) {
+        InstructionFailed(CPU);
+        return 1;
     }
-
     return 0;
 }
 
 
+/*
+ * Execute instructions until the PC reaches haltPC or an error occurs.
+ */
+int RunMachine(MachineState* CPU, FILE* output, unsigned short int haltPC)
+{
+    return RunMachineUntil(CPU, output, haltPC, ~0ULL);
+}
+
+
+/*
+ * Execute instructions until the PC reaches haltPC, an error occurs or
+ * instrCount reaches stopCount.
+ */
+int RunMachineUntil(MachineState* CPU, FILE* output, unsigned short int haltPC, unsigned long long stopCount)
+{
+#define AT_STOP() (CPU->PC == haltPC)
+#include "runloop.h"
+#undef AT_STOP
+}
+
+
+/*
+ * Execute instructions until the PC is at a breakpoint, an error occurs or
+ * instrCount reaches stopCount.
+ */
+int RunToBreakpoint(MachineState* CPU, FILE* output, const Breakpoints* breakpoints, unsigned long long stopCount)
+{
+#define AT_STOP() IsBreakpoint(breakpoints, CPU->PC)
+#include "runloop.h"
+#undef AT_STOP
+}
+
+
 
 //////////////// PARSING HELPER FUNCTIONS ///////////////////////////
 
 
 
+typedef unsigned short int (*AluOp)(MachineState* CPU, DecodedInsn* insn);
+
+static unsigned short int AddOp(MachineState* CPU, DecodedInsn* insn)  { return CPU->R[insn->s] + CPU->R[insn->t]; }
+static unsigned short int MulOp(MachineState* CPU, DecodedInsn* insn)  { return CPU->R[insn->s] * CPU->R[insn->t]; }
+static unsigned short int SubOp(MachineState* CPU, DecodedInsn* insn)  { return CPU->R[insn->s] - CPU->R[insn->t]; }
+static unsigned short int DivOp(MachineState* CPU, DecodedInsn* insn)  { return CPU->R[insn->s] / CPU->R[insn->t]; }
+static unsigned short int AddIOp(MachineState* CPU, DecodedInsn* insn) { return CPU->R[insn->s] + insn->imm; }
+
+static unsigned short int AndOp(MachineState* CPU, DecodedInsn* insn)  { return CPU->R[insn->s] & CPU->R[insn->t]; }
+static unsigned short int NotOp(MachineState* CPU, DecodedInsn* insn)  { return ~CPU->R[insn->s]; }
+static unsigned short int OrOp(MachineState* CPU, DecodedInsn* insn)   { return CPU->R[insn->s] | CPU->R[insn->t]; }
+static unsigned short int XorOp(MachineState* CPU, DecodedInsn* insn)  { return CPU->R[insn->s] ^ CPU->R[insn->t]; }
+static unsigned short int AndIOp(MachineState* CPU, DecodedInsn* insn) { return CPU->R[insn->s] & insn->imm; }
+
+static unsigned short int SllOp(MachineState* CPU, DecodedInsn* insn)  { return CPU->R[insn->s] << insn->imm; }
+static unsigned short int SraOp(MachineState* CPU, DecodedInsn* insn)  { return (signed short int)CPU->R[insn->s] >> insn->imm; }
+static unsigned short int SrlOp(MachineState* CPU, DecodedInsn* insn)  { return CPU->R[insn->s] >> insn->imm; }
+static unsigned short int ModOp(MachineState* CPU, DecodedInsn* insn)  { return CPU->R[insn->s] % CPU->R[insn->t]; }
+
+// Sub-opcodes of DIV and MOD in their groups
+#define SUB_DIV 3
+#define SUB_MOD 3
+
+// Sub-opcode tables for the ALU groups, indexed by DecodedInsn.sub
+static const AluOp ArithTable[5] = { AddOp, MulOp, SubOp, DivOp, AddIOp };
+static const AluOp LogicTable[5] = { AndOp, NotOp, OrOp, XorOp, AndIOp };
+static const AluOp ShiftTable[4] = { SllOp, SraOp, SrlOp, ModOp };
+
+
+typedef short int (*CmpOp)(MachineState* CPU, DecodedInsn* insn);
+
+static short int UnsignedCompare(unsigned short int a, unsigned short int b)
+{
+    if (a > b) {
+        return 1;
+    } else if (a < b) {
+        return -1;
+    }
+    return 0;
+}
+
+static short int CmpSOp(MachineState* CPU, DecodedInsn* insn)   { return (signed short)CPU->R[insn->s] - (signed short)CPU->R[insn->t]; }
+static short int CmpUOp(MachineState* CPU, DecodedInsn* insn)   { return UnsignedCompare(CPU->R[insn->s], CPU->R[insn->t]); }
+static short int CmpIOp(MachineState* CPU, DecodedInsn* insn)   { return CPU->R[insn->s] - (unsigned short int)insn->imm; }
+static short int CmpIUOp(MachineState* CPU, DecodedInsn* insn)  { return UnsignedCompare(CPU->R[insn->s], insn->imm); }
+
+static const CmpOp CmpTable[4] = { CmpSOp, CmpUOp, CmpIOp, CmpIUOp };
+
+
 /*
  * Parses rest of branch operation and updates state of machine.
  */
-void BranchOp(MachineState* CPU, FILE* output)
+int BranchOp(MachineState* CPU, FILE* output)
 {
-    char binary[16];
-    int bits[16];
-    unsigned short int PSRbits[16];
-    int i;
-    unsigned short int val = CPU->PSR;
-    short int u; // IMM9
-    short int v;
-    unsigned short int n = CPU->memory[CPU->PC];
-    for (i = 15; i >= 0; i--) {
-        binary[i] = n % 2 + '0';
-        bits[i] = n % 2;
-        n = n / 2;
-
-        PSRbits[i] = val % 2;
-        val = val / 2;
-    }
-
-    // if (bits[7] == 0) {
-    //     u = bits[8] * 128 + bits[9] * 64 + bits[10] * 32 + bits[11] * 16 + bits[12] * 8 + bits[13] * 4 + bits[14] * 2 + bits[15];
-    // } else {
-    //     for (i = 12; i < 16; i++) {
-    //         bits[i] = 1 - bits[i];
-    //     }
-    //     u = -1 * (bits[8] * 128 + bits[9] * 64 + bits[10] * 32 + bits[11] * 16 + bits[12] * 8 + bits[13] * 4 + bits[14] * 2 + bits[15]);
-    // }
-
-    u = bits[7] * 256 + bits[8] * 128 + bits[9] * 64 + bits[10] * 32 + bits[11] * 16 + bits[12] * 8 + bits[13] * 4 + bits[14] * 2 + bits[15];
-    v = 1U << (8);
-    u = (u ^ v) - v;
+    DecodedInsn* insn = DecodedAt(CPU, CPU->PC);
+    unsigned short int nzp = CPU->PSR & 0x7;
 
     CPU->rsMux_CTL = '0';
     CPU->rtMux_CTL = '0';
@@ -317,80 +716,29 @@ void BranchOp(MachineState* CPU, FILE* output)
     CPU->NZP_WE = '0';
     CPU->DATA_WE = '0';
 
-    if (binary[4] == '0' && binary[5] == '0' && binary[6] == '0') { // NOP
-        WriteOut(CPU, output);
+    WriteOut(CPU, output);
+    if (insn->sub & nzp) { // BRn, BRnz, ..., BRnzp; NOP never branches
+        CPU->PC = CPU->PC + 1 + insn->imm;
+    } else {
         CPU->PC += 1;
-    } else if (binary[4] == '1' && binary[5] == '0' && binary[6] == '0') { // BRn
-        WriteOut(CPU, output);
-        if (PSRbits[13] == 1) {
-            CPU->PC = CPU->PC + 1 + u;
-        } else {
-            CPU->PC += 1;
-        }
-    } else if (binary[4] == '1' && binary[5] == '1' && binary[6] == '0') { // BRnz
-        WriteOut(CPU, output);
-        if (PSRbits[13] == 1 || PSRbits[14] == 1) {
-            CPU->PC = CPU->PC + 1 + u;
-        } else {
-            CPU->PC += 1;
-        }
-    } else if (binary[4] == '1' && binary[5] == '0' && binary[6] == '1') { // BRnp
-        WriteOut(CPU, output);
-        if (PSRbits[13] == 1 || PSRbits[15] == 1) {
-            CPU->PC = CPU->PC + 1 + u;
-        } else {
-            CPU->PC += 1;
-        }
-    } else if (binary[4] == '0' && binary[5] == '1' && binary[6] == '0') { // BRz
-        WriteOut(CPU, output);
-        if (PSRbits[14] == 1) {
-            CPU->PC = CPU->PC + 1 + u;
-        } else {
-            CPU->PC += 1;
-        }
-    } else if (binary[4] == '0' && binary[5] == '1' && binary[6] == '1') { // BRzp
-        WriteOut(CPU, output);
-        if (PSRbits[14] == 1 || PSRbits[15] == 1) {
-            CPU->PC = CPU->PC + 1 + u;
-        } else {
-            CPU->PC += 1;
-        }
-    } else if (binary[4] == '0' && binary[5] == '0' && binary[6] == '1') { // BRp
-        WriteOut(CPU, output);
-        if (PSRbits[15] == 1) {
-            CPU->PC = CPU->PC + 1 + u;
-        } else {
-            CPU->PC += 1;
-        }
-    } else if (binary[4] == '1' && binary[5] == '1' && binary[6] == '1') { // BRnzp
-        WriteOut(CPU, output);
-        CPU->PC = CPU->PC + 1 + u;
     }
+    return 0;
 }
 
 /*
  * Parses rest of arithmetic operation and prints out.
  */
-void ArithmeticOp(MachineState* CPU, FILE* output)
+int ArithmeticOp(MachineState* CPU, FILE* output)
 {
-    char binary[16];
-    int bits[16];
-    int i;
-    int d; // Rd
-    int s; // Rs
-    int t; // Rt
-    unsigned short int u; // IMM5
-    short int x;
-    unsigned short int n = CPU->memory[CPU->PC];
-    for (i = 15; i >= 0; i--) {
-        binary[i] = n % 2 + '0';
-        bits[i] = n % 2;
-        n = n / 2;
-    }
-
-    d = bits[4] * 4 + bits[5] * 2 + bits[6];
-    s = bits[7] * 4 + bits[8] * 2 + bits[9];
-    t = bits[13] * 4 + bits[14] * 2 + bits[15];
+    DecodedInsn* insn = DecodedAt(CPU, CPU->PC);
+
+#ifdef LC4_COVERAGE
+    // The host traps on a zero divisor; the fuzzer reports it as a crash instead
+    if (insn->sub == SUB_DIV && CPU->R[insn->t] == 0) {
+        printf("error occurred\n");
+        return 1;
+    }
+#endif
 
     CPU->rsMux_CTL = '0';
     CPU->rtMux_CTL = '0';
@@ -400,64 +748,20 @@ void ArithmeticOp(MachineState* CPU, FILE* output)
     CPU->NZP_WE = '1';
     CPU->DATA_WE = '0';
 
-    if (binary[10] == '0' && binary[11] == '0' && binary[12] == '0') {
-        CPU->R[d] = CPU->R[s] + CPU->R[t];
-        SetNZP(CPU, CPU->R[d]);
-        CPU->regInputVal = CPU->R[d];
-    } else if (binary[10] == '0' && binary[11] == '0' && binary[12] == '1') {
-        CPU->R[d] = CPU->R[s] * CPU->R[t];
-        SetNZP(CPU, CPU->R[d]);
-        CPU->regInputVal = CPU->R[d];
-    } else if (binary[10] == '0' && binary[11] == '1' && binary[12] == '0') {
-        CPU->R[d] = CPU->R[s] - CPU->R[t];
-        SetNZP(CPU, CPU->R[d]);
-        CPU->regInputVal = CPU->R[d];
-    } else if (binary[10] == '0' && binary[11] == '1' && binary[12] == '1') {
-        CPU->R[d] = CPU->R[s] / CPU->R[t];
-        SetNZP(CPU, CPU->R[d]);
-        CPU->regInputVal = CPU->R[d];
-    } else if (binary[10] == '1') {
-        if (bits[11] == 0) {
-            u = bits[12] * 8 + bits[13] * 4 + bits[14] * 2 + bits[15];
-            CPU->R[d] = CPU->R[s] + u;
-        } else {
-            for (i = 12; i < 16; i++) {
-                bits[i] = 1 - bits[i];
-            }
-            u = bits[12] * 8 + bits[13] * 4 + bits[14] * 2 + bits[15] + 1;
-            CPU->R[d] = CPU->R[s] - u;
-        }
-        SetNZP(CPU, CPU->R[d]);
-        CPU->regInputVal = CPU->R[d];
-    }
+    CPU->R[insn->d] = ArithTable[insn->sub](CPU, insn);
+    SetNZP(CPU, CPU->R[insn->d]);
+    CPU->regInputVal = CPU->R[insn->d];
     WriteOut(CPU, output);
     CPU->PC += 1; 
+    return 0;
 }
 
 /*
  * Parses rest of comparative operation and prints out.
  */
-void ComparativeOp(MachineState* CPU, FILE* output)
+int ComparativeOp(MachineState* CPU, FILE* output)
 {
-    char binary[16];
-    int bits[16];
-    int i;
-    int s; // Rs
-    int t; // Rt
-    short signedS;
-    short signedT;
-    unsigned short int u; // UIMM7
-    unsigned short int w;
-    short int v;
-    unsigned short int n = CPU->memory[CPU->PC];
-    for (i = 15; i >= 0; i--) {
-        binary[i] = n % 2 + '0';
-        bits[i] = n % 2;
-        n = n / 2;
-    }
-
-    s = bits[4] * 4 + bits[5] * 2 + bits[6];
-    t = bits[13] * 4 + bits[14] * 2 + bits[15];
+    DecodedInsn* insn = DecodedAt(CPU, CPU->PC);
 
     CPU->rsMux_CTL = '1';
     CPU->rtMux_CTL = '0';
@@ -467,63 +771,18 @@ void ComparativeOp(MachineState* CPU, FILE* output)
     CPU->NZP_WE = '1';
     CPU->DATA_WE = '0';
 
-    if (binary[7] == '0' && binary[8] == '0') {
-        signedS = (signed short) CPU->R[s]; 
-        signedT = (signed short) CPU->R[t]; 
-        SetNZP(CPU, signedS - signedT);
-    } else if (binary[7] == '0' && binary[8] == '1') {
-        if ((unsigned short)CPU->R[s] > (unsigned short)CPU->R[t]) {
-            SetNZP(CPU, 1);
-        } else if ((unsigned short)CPU->R[s] < (unsigned short)CPU->R[t]) {
-            SetNZP(CPU, -1);
-        } else {
-            SetNZP(CPU, 0);
-        }
-        
-    } else if (binary[7] == '1' && binary[8] == '0') {
-        u = bits[9] * 64 + bits[10] * 32 + bits[11] * 16 + bits[12] * 8 + bits[13] * 4 + bits[14] * 2 + bits[15];
-        v = 1U << (6);
-        u = (u ^ v) - v;
-        SetNZP(CPU, CPU->R[s] - u);
-    } else if (binary[7] == '1' && binary[8] == '1') {
-        u = bits[9] * 64 + bits[10] * 32 + bits[11] * 16 + bits[12] * 8 + bits[13] * 4 + bits[14] * 2 + bits[15];
-        signedS = (signed short) (CPU->R[s] - u); 
-        SetNZP(CPU, signedS);
-        if ((unsigned short)CPU->R[s] > (unsigned short)u) {
-            SetNZP(CPU, 1);
-        } else if ((unsigned short)CPU->R[s] < (unsigned short)u) {
-            SetNZP(CPU, -1);
-        } else {
-            SetNZP(CPU, 0);
-        }
-    }
+    SetNZP(CPU, CmpTable[insn->sub](CPU, insn));
     WriteOut(CPU, output);
     CPU->PC += 1; 
+    return 0;
 }
 
 /*
  * Parses rest of logical operation and prints out.
  */
-void LogicalOp(MachineState* CPU, FILE* output)
+int LogicalOp(MachineState* CPU, FILE* output)
 {
-    char binary[16];
-    int bits[16];
-    int i;
-    int d; // Rd
-    int s; // Rs
-    int t; // Rt
-    short int u; // IMM5
-    unsigned short int n = CPU->memory[CPU->PC];
-    for (i = 15; i >= 0; i--) {
-        binary[i] = n % 2 + '0';
-        bits[i] = n % 2;
-        n = n / 2;
-    }
-
-    d = bits[4] * 4 + bits[5] * 2 + bits[6];
-    s = bits[7] * 4 + bits[8] * 2 + bits[9];
-    t = bits[13] * 4 + bits[14] * 2 + bits[15];
-    u = bits[11] * 16 + bits[12] * 8 + bits[13] * 4 + bits[14] * 2 + bits[15];
+    DecodedInsn* insn = DecodedAt(CPU, CPU->PC);
 
     CPU->rsMux_CTL = '0';
     CPU->rtMux_CTL = '0';
@@ -533,55 +792,20 @@ void LogicalOp(MachineState* CPU, FILE* output)
     CPU->NZP_WE = '1';
     CPU->DATA_WE = '0';
 
-    if (binary[10] == '0' && binary[11] == '0' && binary[12] == '0') {
-        CPU->R[d] = CPU->R[s] & CPU->R[t];
-        SetNZP(CPU, CPU->R[d]);
-        CPU->regInputVal = CPU->R[d];
-    } else if (binary[10] == '0' && binary[11] == '0' && binary[12] == '1') {
-        CPU->R[d] = ~CPU->R[s];
-        SetNZP(CPU, CPU->R[d]);
-        CPU->regInputVal = CPU->R[d];
-    } else if (binary[10] == '0' && binary[11] == '1' && binary[12] == '0') {
-        CPU->R[d] = CPU->R[s] | CPU->R[t];
-        SetNZP(CPU, CPU->R[d]);
-        CPU->regInputVal = CPU->R[d];
-    } else if (binary[10] == '0' && binary[11] == '1' && binary[12] == '1') {
-        CPU->R[d] = CPU->R[s] ^ CPU->R[t];
-        SetNZP(CPU, CPU->R[d]);
-        CPU->regInputVal = CPU->R[d];
-    } else if (binary[10] == '1') {
-        CPU->R[d] = CPU->R[s] & u;
-        SetNZP(CPU, CPU->R[d]);
-        CPU->regInputVal = CPU->R[d];
-    }
+    CPU->R[insn->d] = LogicTable[insn->sub](CPU, insn);
+    SetNZP(CPU, CPU->R[insn->d]);
+    CPU->regInputVal = CPU->R[insn->d];
     WriteOut(CPU, output);
     CPU->PC += 1; 
+    return 0;
 }
 
 /*
  * Parses rest of jump operation and prints out.
  */
-void JumpOp(MachineState* CPU, FILE* output)
+int JumpOp(MachineState* CPU, FILE* output)
 {
-    char binary[16];
-    int bits[16];
-    int i;
-    int s; // Rs
-    short int u; // IMM11
-    short int v;
-    unsigned short int n = CPU->memory[CPU->PC];
-    for (i = 15; i >= 0; i--) {
-        binary[i] = n % 2 + '0';
-        bits[i] = n % 2;
-        n = n / 2;
-    }
-
-    s = bits[7] * 4 + bits[8] * 2 + bits[9];
-    u = bits[5] * 1024 + bits[6] * 512 + bits[7] * 256 + bits[8] * 128 + bits[9] * 64 + 
-        bits[10] * 32 + bits[11] * 16 + bits[12] * 8 + bits[13] * 4 + bits[14] * 2 + bits[15];
-
-    v = 1U << (10);
-    u = (u ^ v) - v;
+    DecodedInsn* insn = DecodedAt(CPU, CPU->PC);
 
     CPU->rsMux_CTL = '0';
     CPU->rtMux_CTL = '0';
@@ -591,38 +815,23 @@ void JumpOp(MachineState* CPU, FILE* output)
     CPU->NZP_WE = '0';
     CPU->DATA_WE = '0';
 
-    if (binary[4] == '0') {
-        WriteOut(CPU, output);
-        CPU->PC = CPU->R[s];
-    } else if (binary[4] == '1') {
-        WriteOut(CPU, output);
-        CPU->PC = CPU->PC + 1 + u;
+    WriteOut(CPU, output);
+    if (insn->sub == 0) { // JMPR
+        CPU->PC = CPU->R[insn->s];
+    } else {              // JMP
+        CPU->PC = CPU->PC + 1 + insn->imm;
     }
+    return 0;
 }
 
 /*
  * Parses rest of JSR operation and prints out.
  */
-void JSROp(MachineState* CPU, FILE* output)
+int JSROp(MachineState* CPU, FILE* output)
 {
-    char binary[16];
-    int bits[16];
-    int i;
-    int s; // Rs
-    short int u; // IMM11
-    short int v;
-    unsigned short int n = CPU->memory[CPU->PC];
-    for (i = 15; i >= 0; i--) {
-        binary[i] = n % 2 + '0';
-        bits[i] = n % 2;
-        n = n / 2;
-    }
-
-    s = bits[7] * 4 + bits[8] * 2 + bits[9];
-    u = bits[5] * 1024 + bits[6] * 512 + bits[7] * 256 + bits[8] * 128 + bits[9] * 64 + 
-        bits[10] * 32 + bits[11] * 16 + bits[12] * 8 + bits[13] * 4 + bits[14] * 2 + bits[15];
-    v = 1U << (10);
-    u = (u ^ v) - v;
+    DecodedInsn* insn = DecodedAt(CPU, CPU->PC);
+    int s = insn->s;
+    short int u = insn->imm; // IMM11
 
     CPU->rsMux_CTL = '0';
     CPU->rtMux_CTL = '0';
@@ -632,45 +841,32 @@ void JSROp(MachineState* CPU, FILE* output)
     CPU->NZP_WE = '1';
     CPU->DATA_WE = '0';
 
-    if (binary[4] == '0') {
-        CPU->R[7] = CPU->PC + 1;
-        SetNZP(CPU, CPU->R[7]);
-        CPU->regInputVal = CPU->R[7];
-        WriteOut(CPU, output);
+    CPU->R[7] = CPU->PC + 1;
+    SetNZP(CPU, CPU->R[7]);
+    CPU->regInputVal = CPU->R[7];
+    WriteOut(CPU, output);
+    if (insn->sub == 0) { // JSRR
         CPU->PC = CPU->R[s];
-    } else if (binary[4] == '1') {
-        CPU->R[7] = CPU->PC + 1;
-        SetNZP(CPU, CPU->R[7]);
-        CPU->regInputVal = CPU->R[7];
-        WriteOut(CPU, output);
+    } else {              // JSR
         CPU->PC = (CPU->PC & 0x8000) | (u << 4);
     }
+    return 0;
 }
 
 /*
  * Parses rest of shift/mod operations and prints out.
  */
-void ShiftModOp(MachineState* CPU, FILE* output)
+int ShiftModOp(MachineState* CPU, FILE* output)
 {
-    char binary[16];
-    int bits[16];
-    int i;
-    int d; // Rd
-    int s; // Rs
-    int t; // Rt
-    unsigned short int u; // UIMM4
-    unsigned short int n = CPU->memory[CPU->PC];
-    signed short int sra;
-    for (i = 15; i >= 0; i--) {
-        binary[i] = n % 2 + '0';
-        bits[i] = n % 2;
-        n = n / 2;
-    }
-
-    d = bits[4] * 4 + bits[5] * 2 + bits[6];
-    s = bits[7] * 4 + bits[8] * 2 + bits[9];
-    t = bits[13] * 4 + bits[14] * 2 + bits[15];
-    u = bits[12] * 8 + bits[13] * 4 + bits[14] * 2 + bits[15];
+    DecodedInsn* insn = DecodedAt(CPU, CPU->PC);
+
+#ifdef LC4_COVERAGE
+    // The host traps on a zero divisor; the fuzzer reports it as a crash instead
+    if (insn->sub == SUB_MOD && CPU->R[insn->t] == 0) {
+        printf("error occurred\n");
+        return 1;
+    }
+#endif
 
     CPU->rsMux_CTL = '0';
     CPU->rtMux_CTL = '0';
@@ -680,27 +876,160 @@ void ShiftModOp(MachineState* CPU, FILE* output)
     CPU->NZP_WE = '1';
     CPU->DATA_WE = '0';
 
-    if (binary[10] == '0' && binary[11] == '0') {
-        CPU->R[d] = CPU->R[s] << u;
-        SetNZP(CPU, CPU->R[d]);
-        CPU->regInputVal = CPU->R[d];
-    } else if (binary[10] == '0' && binary[11] == '1') {
-        sra = (signed int)CPU->R[s];
-        sra = sra >> u;
-        CPU->R[d] = sra;
-        SetNZP(CPU, CPU->R[d]);
-        CPU->regInputVal = CPU->R[d];
-    } else if (binary[10] == '1' && binary[11] == '0') {
-        CPU->R[d] = CPU->R[s] >> u;
-        SetNZP(CPU, CPU->R[d]);
-        CPU->regInputVal = CPU->R[d];
-    } else if (binary[10] == '1' && binary[11] == '1') {
-        CPU->R[d] = CPU->R[s] % CPU->R[t];
-        SetNZP(CPU, CPU->R[d]);
-        CPU->regInputVal = CPU->R[d];
+    CPU->R[insn->d] = ShiftTable[insn->sub](CPU, insn);
+    SetNZP(CPU, CPU->R[insn->d]);
+    CPU->regInputVal = CPU->R[insn->d];
+    WriteOut(CPU, output);
+    CPU->PC += 1; 
+    return 0;
+}
+
+/*
+ * Handles RTI: return to R7 and drop back to user privilege.
+ */
+int RTIOp(MachineState* CPU, FILE* output)
+{
+    CPU->rsMux_CTL = '1';
+    CPU->rtMux_CTL = '0';
+    CPU->rdMux_CTL = '0';
+
+    CPU->regFile_WE = '0';
+    CPU->NZP_WE = '0';
+    CPU->DATA_WE = '0';
+
+    WriteOut(CPU, output);
+    CPU->PC = CPU->R[7];
+    CPU->PSR = CPU->PSR << 1;
+    CPU->PSR = CPU->PSR >> 1;
+    return 0;
+}
+
+/*
+ * Handles LDR. Returns 1 if user code tries to read OS memory.
+ */
+int LoadOp(MachineState* CPU, FILE* output)
+{
+    DecodedInsn* insn = DecodedAt(CPU, CPU->PC);
+
+    CPU->rsMux_CTL = '0';
+    CPU->rtMux_CTL = '0';
+    CPU->rdMux_CTL = '0';
+
+    CPU->regFile_WE = '1';
+    CPU->NZP_WE = '1';
+    CPU->DATA_WE = '0';
+
+    CPU->dmemAddr = CPU->R[insn->s] + insn->imm;
+    if (CPU->PSR < 32768 && CPU->dmemAddr >= 0x8000) {
+        printf("error occurred\n");
+        return 1;
+    }
+    CPU->R[insn->d] = LoadWord(CPU, CPU->dmemAddr);
+    SetNZP(CPU, CPU->R[insn->d]);
+    WriteOut(CPU, output);
+    CPU->PC += 1; 
+    return 0;
+}
+
+/*
+ * Handles STR. Returns 1 if user code tries to write OS memory.
+ */
+int StoreOp(MachineState* CPU, FILE* output)
+{
+    DecodedInsn* insn = DecodedAt(CPU, CPU->PC);
+
+    CPU->rsMux_CTL = '0';
+    CPU->rtMux_CTL = '1';
+    CPU->rdMux_CTL = '0';
+
+    CPU->regFile_WE = '0';
+    CPU->NZP_WE = '0';
+    CPU->DATA_WE = '1';
+
+    CPU->dmemAddr = CPU->R[insn->s] + insn->imm;
+    if (CPU->PSR < 32768 && CPU->dmemAddr >= 0x8000) {
+        printf("error occurred\n");
+        return 1;
+    }
+    StoreWord(CPU, CPU->dmemAddr, CPU->R[insn->d]);
+    CPU->dmemValue = CPU->R[insn->d];
+    WriteOut(CPU, output);
+    CPU->PC += 1; 
+    return 0;
+}
+
+/*
+ * Handles CONST.
+ */
+int ConstOp(MachineState* CPU, FILE* output)
+{
+    DecodedInsn* insn = DecodedAt(CPU, CPU->PC);
+
+    CPU->rsMux_CTL = '0';
+    CPU->rtMux_CTL = '0';
+    CPU->rdMux_CTL = '0';
+
+    CPU->regFile_WE = '1';
+    CPU->NZP_WE = '1';
+    CPU->DATA_WE = '0';
+
+    CPU->R[insn->d] = insn->imm;
+    SetNZP(CPU, CPU->R[insn->d]);
+    CPU->regInputVal = CPU->R[insn->d];
+    WriteOut(CPU, output);
+    CPU->PC += 1; 
+    return 0;
+}
+
+/*
+ * Handles HICONST. The word is ignored if bit 8 is clear.
+ */
+int HiConstOp(MachineState* CPU, FILE* output)
+{
+    DecodedInsn* insn = DecodedAt(CPU, CPU->PC);
+
+    if (insn->sub == 0) {
+        return 0;
     }
+
+    CPU->rsMux_CTL = '0';
+    CPU->rtMux_CTL = '0';
+    CPU->rdMux_CTL = '0';
+
+    CPU->regFile_WE = '1';
+    CPU->NZP_WE = '1';
+    CPU->DATA_WE = '0';
+
+    CPU->R[insn->d] = (CPU->R[insn->d] & 0xFF) | (insn->imm << 8);
+    SetNZP(CPU, CPU->R[insn->d]);
+    CPU->regInputVal = CPU->R[insn->d];
     WriteOut(CPU, output);
     CPU->PC += 1; 
+    return 0;
+}
+
+/*
+ * Handles TRAP: save the return address in R7 and enter the OS.
+ */
+int TrapOp(MachineState* CPU, FILE* output)
+{
+    DecodedInsn* insn = DecodedAt(CPU, CPU->PC);
+
+    CPU->rsMux_CTL = '0';
+    CPU->rtMux_CTL = '0';
+    CPU->rdMux_CTL = '1';
+
+    CPU->regFile_WE = '1';
+    CPU->NZP_WE = '1';
+    CPU->DATA_WE = '0';
+
+    CPU->R[7] = CPU->PC + 1;
+    SetNZP(CPU, CPU->R[7]);
+    CPU->regInputVal = CPU->R[7];
+    WriteOut(CPU, output); // before raising the privilege, so trace filters see what the TRAP ran as
+    CPU->PSR = CPU->PSR | 0x8000;
+    CPU->PC = (0x8000 | insn->imm);
+    return 0;
 }
 
 /*
@@ -720,4 +1049,4 @@ void SetNZP(MachineState* CPU, short result)
         CPU->PSR += 4;
         CPU->NZPVal = 4;
     }
-}
+}
\ No newline at end of file
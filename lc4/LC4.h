@@ -2,9 +2,94 @@
  * LC4.h: Declares simulator functions for executing instructions
  */
 
+#ifndef LC4_H
+#define LC4_H
+
 #include "string.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include "tracefmt.h"
+
+// Opcodes - bits [15:12] of an instruction
+#define OP_BR      0x0
+#define OP_ARITH   0x1
+#define OP_CMP     0x2
+#define OP_JSR     0x4
+#define OP_LOGIC   0x5
+#define OP_LDR     0x6
+#define OP_STR     0x7
+#define OP_RTI     0x8
+#define OP_CONST   0x9
+#define OP_SHIFT   0xA
+#define OP_JMP     0xC
+#define OP_HICONST 0xD
+#define OP_TRAP    0xF
+
+// Sub-opcode used by the ARITH and LOGIC groups for their immediate form
+#define SUB_IMM 4
+
+typedef struct {
+    unsigned char valid;   // 0 until the word at this address has been decoded
+    unsigned char opcode;  // bits [15:12]
+    unsigned char sub;     // sub-opcode (nzp for BR, bit 11 for JSR/JMP, etc.)
+    unsigned char d;       // Rd
+    unsigned char s;       // Rs (bits [11:9] for CMP)
+    unsigned char t;       // Rt
+    short int imm;         // immediate, already sign/zero extended
+} DecodedInsn;
+
+#ifdef LC4_PROFILE
+typedef struct Profile Profile; // see profile.h
+#endif
+
+#ifdef LC4_COVERAGE
+typedef struct Coverage Coverage; // see coverage.h
+#endif
+
+#ifdef LC4_UNDO
+typedef struct UndoLog UndoLog; // see undo.h
+#endif
+
+#ifdef LC4_PAGED_MEMORY
+#define PAGE_WORDS 256
+
+// One 256 word page of memory with the decoded form of each word. A page with
+// refs > 1 is shared between machines and is never written; shared pages are
+// always fully decoded. refs only changes atomically, so the machines may run
+// on different threads.
+typedef struct {
+    int refs;
+    unsigned short int words[PAGE_WORDS];
+    DecodedInsn decoded[PAGE_WORDS];
+} MemoryPage;
+#endif
+
+// Tests a TraceFilter applies
+#define TRACE_FILTER_PC     0x01  // only PCs set in pcs
+#define TRACE_FILTER_USER   0x02  // only instructions run with the privilege bit clear
+#define TRACE_FILTER_OS     0x04  // only instructions run with the privilege bit set
+#define TRACE_FILTER_WRITES 0x08  // only stores (DATA_WE set)
+#define TRACE_FILTER_EVERY  0x10  // only every every-th instruction, by instrCount
+
+// Decides which instructions WriteOut writes, before any formatting
+typedef struct {
+    unsigned int tests;                     // TRACE_FILTER_* bits
+    unsigned long long pcs[65536 / 64];     // bit per PC that may be written
+    unsigned long long every;
+    unsigned long long next;                // instrCount of the next sample
+} TraceFilter;
+
+// Registers of a memory-mapped device: loads and stores of start..end call
+// read and write with device instead of using memory
+typedef struct {
+    unsigned short int start;
+    unsigned short int end;
+    unsigned short int (*read)(void* device, unsigned short int addr);
+    void (*write)(void* device, unsigned short int addr, unsigned short int value);
+    void* device;
+} DeviceRange;
+
+#define MAX_DEVICE_RANGES 8
 
 typedef struct {
     // PC the current value of the Program Counter register
@@ -33,19 +118,265 @@ typedef struct {
     unsigned short int dmemAddr;
     unsigned short int dmemValue;
 
+    // Format WriteOut uses for the trace (TRACE_TEXT or TRACE_BINARY)
+    unsigned char traceFormat;
+
+    // Instructions WriteOut writes, or NULL for all of them
+    TraceFilter* traceFilter;
+
+    // Number of instructions RunMachine has completed since Reset
+    unsigned long long instrCount;
+
+#ifdef LC4_PAGED_MEMORY
+    // Machine memory as 256 pages. Pages that were never written all point at
+    // one shared zero page, and pages shared with other machines (see
+    // ShareMemory) are copied on their first write.
+    MemoryPage* pages[65536 / PAGE_WORDS];
+#else
     // Machine memory - all of it
     unsigned short int memory[65536];
+
+    // Decoded form of each memory word, filled by the loader and invalidated by STR
+    DecodedInsn decoded[65536];
+#endif
+
+    // Memory-mapped devices. Loads and stores at or above deviceBase, the
+    // lowest address of any of them (65536 when there are none), look them up.
+    unsigned int deviceBase;
+    int deviceCount;
+    DeviceRange devices[MAX_DEVICE_RANGES];
+
+#ifdef LC4_PROFILE
+    // Counters updated before every instruction the interpreter runs, or NULL
+    Profile* profile;
+#endif
+
+#ifdef LC4_COVERAGE
+    // Edge map marked before every instruction the interpreter runs, or NULL
+    Coverage* coverage;
+
+    // PC of the last instruction marked
+    unsigned short int prevPC;
+#endif
+
+#ifdef LC4_UNDO
+    // Log every instruction the interpreter runs is recorded in before it runs, or NULL
+    UndoLog* undo;
+#endif
 } MachineState;
 
 
+/*
+ * Memory accessors. Build with -DLC4_PAGED_MEMORY for paged memory; both
+ * layouts take O(1) time per access.
+ */
+#ifdef LC4_PAGED_MEMORY
+MemoryPage* PrivatePage(MachineState* CPU, unsigned short int addr);
+
+static inline unsigned short int ReadMemory(MachineState* CPU, unsigned short int addr)
+{
+    return CPU->pages[addr >> 8]->words[addr & 0xFF];
+}
+
+static inline DecodedInsn* DecodedAt(MachineState* CPU, unsigned short int addr)
+{
+    return &CPU->pages[addr >> 8]->decoded[addr & 0xFF];
+}
+
+// Store value and drop the decoded form of the word, which may be code
+static inline void WriteMemory(MachineState* CPU, unsigned short int addr, unsigned short int value)
+{
+    MemoryPage* page = CPU->pages[addr >> 8];
+
+    if (__atomic_load_n(&page->refs, __ATOMIC_ACQUIRE) != 1) {
+        page = PrivatePage(CPU, addr);
+    }
+    page->words[addr & 0xFF] = value;
+    page->decoded[addr & 0xFF].valid = 0;
+}
+
+// Pointer to the words starting at addr for bulk stores; count is set to how
+// many of them are contiguous. The caller must decode or invalidate each word
+// it stores.
+static inline unsigned short int* WritableRange(MachineState* CPU, unsigned short int addr, int* count)
+{
+    MemoryPage* page = CPU->pages[addr >> 8];
+
+    if (__atomic_load_n(&page->refs, __ATOMIC_ACQUIRE) != 1) {
+        page = PrivatePage(CPU, addr);
+    }
+    *count = PAGE_WORDS - (addr & 0xFF);
+    return &page->words[addr & 0xFF];
+}
+#else
+static inline unsigned short int ReadMemory(MachineState* CPU, unsigned short int addr)
+{
+    return CPU->memory[addr];
+}
+
+static inline DecodedInsn* DecodedAt(MachineState* CPU, unsigned short int addr)
+{
+    return &CPU->decoded[addr];
+}
+
+// Store value and drop the decoded form of the word, which may be code
+static inline void WriteMemory(MachineState* CPU, unsigned short int addr, unsigned short int value)
+{
+    CPU->memory[addr] = value;
+    CPU->decoded[addr].valid = 0;
+}
+
+// Pointer to the words starting at addr for bulk stores; count is set to how
+// many of them are contiguous. The caller must decode or invalidate each word
+// it stores.
+static inline unsigned short int* WritableRange(MachineState* CPU, unsigned short int addr, int* count)
+{
+    *count = 65536 - addr;
+    return &CPU->memory[addr];
+}
+#endif
+
+
+/*
+ * Map a device's registers at start..end. Returns 1 if there is no room for
+ * another range.
+ */
+int MapDevice(MachineState* CPU, unsigned short int start, unsigned short int end,
+              unsigned short int (*read)(void* device, unsigned short int addr),
+              void (*write)(void* device, unsigned short int addr, unsigned short int value), void* device);
+
+
+/*
+ * Load and store through the device mapped at addr, or memory if there is none.
+ */
+unsigned short int DeviceLoad(MachineState* CPU, unsigned short int addr);
+void DeviceStore(MachineState* CPU, unsigned short int addr, unsigned short int value);
+
+
+/*
+ * What LDR and STR use: one compare keeps memory accesses off the device path.
+ */
+static inline unsigned short int LoadWord(MachineState* CPU, unsigned short int addr)
+{
+    return addr >= CPU->deviceBase ? DeviceLoad(CPU, addr) : ReadMemory(CPU, addr);
+}
+
+static inline void StoreWord(MachineState* CPU, unsigned short int addr, unsigned short int value)
+{
+    if (addr >= CPU->deviceBase) {
+        DeviceStore(CPU, addr, value);
+    } else {
+        WriteMemory(CPU, addr, value);
+    }
+}
+
+
+/*
+ * Set of breakpoint addresses, one bit per address, so that checking the PC
+ * against any number of breakpoints is one bit test.
+ */
+typedef struct {
+    unsigned long long bits[65536 / 64];
+} Breakpoints;
+
+static inline int IsBreakpoint(const Breakpoints* breakpoints, unsigned short int addr)
+{
+    return (breakpoints->bits[addr >> 6] >> (addr & 63)) & 1;
+}
+
+static inline void SetBreakpoint(Breakpoints* breakpoints, unsigned short int addr)
+{
+    breakpoints->bits[addr >> 6] |= 1ULL << (addr & 63);
+}
+
+static inline void ClearBreakpoint(Breakpoints* breakpoints, unsigned short int addr)
+{
+    breakpoints->bits[addr >> 6] &= ~(1ULL << (addr & 63));
+}
+
+static inline void ClearBreakpoints(Breakpoints* breakpoints)
+{
+    memset(breakpoints->bits, 0, sizeof(breakpoints->bits));
+}
+
+
+/*
+ * Copy all 65536 words of memory into words.
+ */
+void DumpMemory(MachineState* CPU, unsigned short int* words);
+
+
+/*
+ * Make dst's memory a copy of src's. With paged memory the pages are shared
+ * copy-on-write, so this costs 256 pointer copies instead of 128 KB, and
+ * sharing again after dst has run only touches the pages dst wrote. Both
+ * machines must have been Reset.
+ */
+void ShareMemory(MachineState* dst, MachineState* src);
+
+
+/*
+ * Free the memory pages CPU holds. Call this before Reset on a machine that
+ * has been used before, and before freeing it; does nothing without paged memory.
+ */
+void ReleaseMemory(MachineState* CPU);
+
+
 /*
  * This function should execute one LC4 datapath cycle.
  */
 int UpdateMachineState(MachineState* CPU, FILE* output);
 
 
+/*
+ * Execute instructions until the PC is at one of breakpoints (checked before
+ * every instruction, including the first), an error occurs or instrCount
+ * reaches stopCount. Returns 0 at a breakpoint, 1 on an error and 2 at
+ * stopCount. If output is NULL no trace is written. A run with any number of
+ * breakpoints costs the same as one with a single one.
+ */
+int RunToBreakpoint(MachineState* CPU, FILE* output, const Breakpoints* breakpoints, unsigned long long stopCount);
+
+
+/*
+ * Execute instructions until the PC reaches haltPC. Returns 1 if an error occurred.
+ * If output is NULL no trace is written.
+ * Dispatch is an if-chain by default; build with -DLC4_DISPATCH_TABLE for an opcode
+ * handler table or -DLC4_DISPATCH_THREADED for computed-goto threaded code.
+ */
+int RunMachine(MachineState* CPU, FILE* output, unsigned short int haltPC);
+
+
+/*
+ * RunMachine that also stops as soon as instrCount reaches stopCount, before
+ * executing another instruction. Returns 2 when it stopped there, otherwise
+ * like RunMachine.
+ */
+int RunMachineUntil(MachineState* CPU, FILE* output, unsigned short int haltPC, unsigned long long stopCount);
+
+
+/*
+ * Decode the word at memory[addr] into decoded[addr].
+ */
+void DecodeInstruction(MachineState* CPU, unsigned short int addr);
+
+
+/*
+ * Decode the instruction word n into insn, for words that are not in a
+ * MachineState's memory.
+ */
+void DecodeWord(unsigned short int n, DecodedInsn* insn);
+
+
+/*
+ * Fill rec with the trace line for the instruction at the current PC.
+ */
+void MakeTraceRecord(MachineState* CPU, TraceRecord* rec);
+
+
 /*
  * This function should write out the current state of the CPU to the file output.
+ * Does nothing if output is NULL.
  */
 void WriteOut(MachineState* CPU, FILE* output);
 
@@ -53,43 +384,79 @@ void WriteOut(MachineState* CPU, FILE* output);
 /*
  * This handles BRANCH instructions.
  */
-void BranchOp(MachineState* CPU, FILE* output);
+int BranchOp(MachineState* CPU, FILE* output);
 
 
 /*
  * This handles ARITHMETIC instructions.
  */
-void ArithmeticOp(MachineState* CPU, FILE* output);
+int ArithmeticOp(MachineState* CPU, FILE* output);
 
 
 /*
  * This handles COMPARATIVE instructions.
  */
-void ComparativeOp(MachineState* CPU, FILE* output);
+int ComparativeOp(MachineState* CPU, FILE* output);
 
 
 /*
  * This handles LOGICAL instructions.
  */
-void LogicalOp(MachineState* CPU, FILE* output);
+int LogicalOp(MachineState* CPU, FILE* output);
 
 
 /*
  * This handles JUMP instructions.
  */
-void JumpOp(MachineState* CPU, FILE* output);
+int JumpOp(MachineState* CPU, FILE* output);
 
 
 /*
  * This handles JSR instructions.
  */
-void JSROp(MachineState* CPU, FILE* output);
+int JSROp(MachineState* CPU, FILE* output);
 
 
 /*
  * This handles SHIFT instructions.
  */
-void ShiftModOp(MachineState* CPU, FILE* output);
+int ShiftModOp(MachineState* CPU, FILE* output);
+
+
+/*
+ * This handles RTI instructions.
+ */
+int RTIOp(MachineState* CPU, FILE* output);
+
+
+/*
+ * This handles LDR instructions.
+ */
+int LoadOp(MachineState* CPU, FILE* output);
+
+
+/*
+ * This handles STR instructions.
+ */
+int StoreOp(MachineState* CPU, FILE* output);
+
+
+/*
+ * This handles CONST instructions.
+ */
+int ConstOp(MachineState* CPU, FILE* output);
+
+
+/*
+ * This handles HICONST instructions.
+ */
+int HiConstOp(MachineState* CPU, FILE* output);
+
+
+/*
+ * This handles TRAP instructions.
+ */
+int TrapOp(MachineState* CPU, FILE* output);
 
 
 /*
@@ -108,3 +475,5 @@ void Reset(MachineState* CPU);
  * Clear all of the internal values (set to 0)
  */
 void ClearSignals(MachineState* CPU);
+
+#endif
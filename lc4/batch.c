@@ -0,0 +1,586 @@
+/*
+ * batch.c: location of main() for trace-batch, which runs many independent
+ * simulations on a pool of threads
+ *
+ * usage: trace-batch [-j threads] [-b | --no-trace [--lockstep]] [--image-cache dir] manifest
+ *
+ * Each non-empty manifest line that does not start with '#' is one job, written
+ * like the arguments of trace: the output file followed by the object files.
+ * Every worker thread owns one MachineState and reuses it for all of its jobs.
+ * Jobs are dealt out to per-worker queues up front; a worker takes jobs from
+ * the back of its own queue and, when that is empty, steals from the front of
+ * the others. When all jobs are done one line per job is printed in manifest
+ * order with its status and instruction count.
+ *
+ * With --lockstep a worker takes up to 16 jobs at a time and runs them
+ * together on the lockstep engine, which suits many runs of one program over
+ * different input data.
+ *
+ * Built with -DLC4_PAGED_MEMORY (trace-batch-paged), jobs with the same
+ * object files load them once: the first such job loads a machine that is
+ * never run, and every job shares its pages copy-on-write.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "loader.h"
+#include "summary.h"
+#include "imagecache.h"
+#include "lockstep.h"
+
+#define MAX_LINE 4096
+
+// Job outcomes
+#define JOB_HALTED 0
+#define JOB_ERROR  1    // RunMachine reported an error
+#define JOB_FAILED 2    // the job could not be started
+
+typedef struct {
+    char** args;                    // output file, then object files
+    int argCount;
+    int status;
+    unsigned long long instructions;
+#ifdef LC4_PAGED_MEMORY
+    int image;                      // index of the loaded image it shares
+#endif
+} Job;
+
+#ifdef LC4_PAGED_MEMORY
+// Object files loaded once for every job that names them
+typedef struct {
+    pthread_mutex_t lock;
+    int loaded;
+    int failed;
+    MachineState* CPU;              // fully decoded and never run, so its pages are only read
+} SharedImage;
+#endif
+
+typedef struct {
+    pthread_mutex_t lock;
+    int* jobs;                      // job indices; the owner works from the back
+    int head;
+    int tail;
+} JobQueue;
+
+typedef struct {
+    Job* jobs;
+    JobQueue* queues;
+    int workerCount;
+    unsigned char traceFormat;
+    int traceOff;
+    int lockstep;                   // run jobs in groups on the lockstep engine
+    char* imageCache;               // directory of preprocessed images, or NULL
+#ifdef LC4_PAGED_MEMORY
+    SharedImage* images;
+    int imageCount;
+#endif
+} Batch;
+
+typedef struct {
+    Batch* batch;
+    int id;
+} Worker;
+
+
+/*
+ * Take the next job for worker id, stealing from another queue if its own is
+ * empty. Returns -1 when there is no work left anywhere.
+ */
+static int NextJob(Batch* batch, int id)
+{
+    JobQueue* queue;
+    int job = -1;
+    int i;
+
+    queue = &batch->queues[id];
+    pthread_mutex_lock(&queue->lock);
+    if (queue->head < queue->tail) {
+        job = queue->jobs[--queue->tail];
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    // Nothing is ever added to a queue, so one pass over the others is enough
+    for (i = 1; job < 0 && i < batch->workerCount; i++) {
+        queue = &batch->queues[(id + i) % batch->workerCount];
+        pthread_mutex_lock(&queue->lock);
+        if (queue->head < queue->tail) {
+            job = queue->jobs[queue->head++];
+        }
+        pthread_mutex_unlock(&queue->lock);
+    }
+    return job;
+}
+
+
+/*
+ * Load the object files of job into CPU, which must have been Reset.
+ * Returns 0 on success.
+ */
+static int LoadJob(Batch* batch, Job* job, MachineState* CPU)
+{
+#ifdef LC4_PAGED_MEMORY
+    SharedImage* shared = &batch->images[job->image];
+    int i;
+
+    pthread_mutex_lock(&shared->lock);
+    if (!shared->loaded) {
+        shared->loaded = 1;
+        shared->CPU = calloc(1, sizeof(MachineState));
+        if (shared->CPU == NULL) {
+            printf("error: out of memory\n");
+            shared->failed = 1;
+        } else {
+            Reset(shared->CPU);
+            shared->failed = LoadObjectFiles(job->args + 1, job->argCount - 1, shared->CPU, batch->imageCache) != 0;
+            // ShareMemory decodes what is left; do it now, before other threads read the pages
+            for (i = 0; i < 65536 && !shared->failed; i++) {
+                if (!DecodedAt(shared->CPU, i)->valid) {
+                    DecodeInstruction(shared->CPU, i);
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&shared->lock);
+    if (shared->failed) {
+        return 1;
+    }
+    ShareMemory(CPU, shared->CPU);
+    return 0;
+#else
+    return LoadObjectFiles(job->args + 1, job->argCount - 1, CPU, batch->imageCache);
+#endif
+}
+
+
+#ifdef LC4_PAGED_MEMORY
+/*
+ * Give jobs with the same object files the same image index, setting
+ * imageCount. Returns 0 on success.
+ */
+static int GroupImages(Batch* batch, int jobCount)
+{
+    int size = 1;
+    int* slots;
+    unsigned long long hash;
+    const char* name;
+    Job* job;
+    Job* other;
+    int i;
+    int j;
+    int h;
+
+    while (size < 2 * jobCount) {
+        size *= 2;
+    }
+    slots = malloc(size * sizeof(int)); // job that first named each hash slot's files, or -1
+    batch->images = calloc(jobCount, sizeof(SharedImage));
+    if (slots == NULL || batch->images == NULL) {
+        printf("error: out of memory\n");
+        free(slots);
+        return 1;
+    }
+    memset(slots, -1, size * sizeof(int));
+
+    batch->imageCount = 0;
+    for (i = 0; i < jobCount; i++) {
+        job = &batch->jobs[i];
+        hash = 14695981039346656037ULL; // FNV-1a over the object file names
+        for (j = 1; j < job->argCount; j++) {
+            for (name = job->args[j]; ; name++) {
+                hash = (hash ^ (unsigned char)*name) * 1099511628211ULL;
+                if (*name == '\0') {
+                    break;
+                }
+            }
+        }
+        for (h = hash & (size - 1); slots[h] >= 0; h = (h + 1) & (size - 1)) {
+            other = &batch->jobs[slots[h]];
+            if (other->argCount == job->argCount) {
+                for (j = 1; j < job->argCount && strcmp(other->args[j], job->args[j]) == 0; j++) {
+                }
+                if (j == job->argCount) {
+                    break;
+                }
+            }
+        }
+        if (slots[h] >= 0) {
+            job->image = batch->jobs[slots[h]].image;
+        } else {
+            slots[h] = i;
+            job->image = batch->imageCount;
+            pthread_mutex_init(&batch->images[batch->imageCount++].lock, NULL);
+        }
+    }
+    free(slots);
+    return 0;
+}
+#endif
+
+
+/*
+ * Run one job on CPU, the same way trace does.
+ */
+static void RunJob(Batch* batch, Job* job, MachineState* CPU, unsigned short int* image)
+{
+    FILE* file;
+
+    ReleaseMemory(CPU);
+    Reset(CPU);
+    CPU->traceFormat = batch->traceFormat;
+    if (LoadJob(batch, job, CPU) != 0) {
+        job->status = JOB_FAILED;
+        return;
+    }
+
+    file = fopen(job->args[0], CPU->traceFormat == TRACE_BINARY ? "wb" : "w");
+    if (file == NULL) {
+        job->status = JOB_FAILED;
+        return;
+    }
+
+    if (batch->traceOff) {
+        DumpMemory(CPU, image);
+        job->status = RunMachine(CPU, NULL, 0x80FF);
+        WriteSummary(file, CPU, image, job->status);
+    } else {
+        if (CPU->traceFormat == TRACE_BINARY) {
+            WriteTraceHeader(file);
+        }
+        job->status = RunMachine(CPU, file, 0x80FF);
+    }
+    job->instructions = CPU->instrCount;
+    fclose(file);
+}
+
+
+/*
+ * Run up to LOCKSTEP_LANES jobs together on machine, using CPU to load each
+ * one and to write its summary. images holds one image per lane.
+ */
+static void RunJobGroup(Batch* batch, int* group, int count, MachineState* CPU, unsigned short int** images,
+                        LockstepMachine* machine)
+{
+    FILE* files[LOCKSTEP_LANES];
+    int status[LOCKSTEP_LANES];
+    Job* job;
+    int lane;
+
+    LockstepClear(machine);
+    for (lane = 0; lane < count; lane++) {
+        job = &batch->jobs[group[lane]];
+        files[lane] = NULL;
+        ReleaseMemory(CPU);
+        Reset(CPU);
+        if (LoadJob(batch, job, CPU) != 0) {
+            job->status = JOB_FAILED;
+            continue;
+        }
+        files[lane] = fopen(job->args[0], "w");
+        if (files[lane] == NULL) {
+            job->status = JOB_FAILED;
+            continue;
+        }
+        DumpMemory(CPU, images[lane]);
+        LockstepLoadLane(machine, lane, CPU);
+    }
+
+    LockstepRun(machine, 0x80FF, ~0ULL, status);
+
+    for (lane = 0; lane < count; lane++) {
+        if (files[lane] == NULL) {
+            continue;
+        }
+        job = &batch->jobs[group[lane]];
+        LockstepStoreLane(machine, lane, CPU); // CPU's memory is made equal to the lane's
+        job->status = status[lane];
+        job->instructions = CPU->instrCount;
+        WriteSummary(files[lane], CPU, images[lane], job->status);
+        fclose(files[lane]);
+    }
+}
+
+
+/*
+ * Worker thread for --lockstep: take jobs in groups of up to LOCKSTEP_LANES.
+ */
+static void LockstepWorker(Worker* worker)
+{
+    MachineState* CPU = calloc(1, sizeof(MachineState));
+    LockstepMachine* machine = LockstepCreate();
+    unsigned short int* images[LOCKSTEP_LANES];
+    int group[LOCKSTEP_LANES];
+    int count;
+    int failed = CPU == NULL || machine == NULL;
+    int i;
+
+    for (i = 0; i < LOCKSTEP_LANES; i++) {
+        images[i] = malloc(65536 * sizeof(unsigned short int));
+        failed |= images[i] == NULL;
+    }
+    do {
+        for (count = 0; count < LOCKSTEP_LANES; count++) {
+            group[count] = NextJob(worker->batch, worker->id);
+            if (group[count] < 0) {
+                break;
+            }
+        }
+        if (failed) {
+            for (i = 0; i < count; i++) {
+                worker->batch->jobs[group[i]].status = JOB_FAILED;
+            }
+        } else if (count > 0) {
+            RunJobGroup(worker->batch, group, count, CPU, images, machine);
+        }
+    } while (count == LOCKSTEP_LANES);
+
+    if (CPU != NULL) {
+        ReleaseMemory(CPU);
+    }
+    free(CPU);
+    if (machine != NULL) {
+        LockstepDestroy(machine);
+    }
+    for (i = 0; i < LOCKSTEP_LANES; i++) {
+        free(images[i]);
+    }
+}
+
+
+static void* WorkerMain(void* arg)
+{
+    Worker* worker = arg;
+    MachineState* CPU;
+    unsigned short int* image;
+    int job;
+
+    if (worker->batch->lockstep) {
+        LockstepWorker(worker);
+        return NULL;
+    }
+    CPU = calloc(1, sizeof(MachineState)); // zeroed, so the first ReleaseMemory finds no pages
+    image = malloc(65536 * sizeof(unsigned short int));
+    while ((job = NextJob(worker->batch, worker->id)) >= 0) {
+        if (CPU == NULL || image == NULL) {
+            worker->batch->jobs[job].status = JOB_FAILED;
+        } else {
+            RunJob(worker->batch, &worker->batch->jobs[job], CPU, image);
+        }
+    }
+    if (CPU != NULL) {
+        ReleaseMemory(CPU);
+    }
+    free(CPU);
+    free(image);
+    return NULL;
+}
+
+
+/*
+ * Read the manifest into jobs. Returns the number of jobs, or -1 on error.
+ */
+static int ReadManifest(char* filename, Job** jobs)
+{
+    FILE* manifest;
+    char line[MAX_LINE];
+    char* token;
+    Job* job;
+    Job* grown;
+    size_t length;
+    int c;
+    int count = 0;
+    int capacity = 0;
+    int lineNumber = 0;
+
+    manifest = fopen(filename, "r");
+    if (manifest == NULL) {
+        printf("error: cannot open %s\n", filename);
+        return -1;
+    }
+
+    *jobs = NULL;
+    while (fgets(line, sizeof(line), manifest) != NULL) {
+        lineNumber++;
+        length = strlen(line);
+        if (length > 0 && line[length - 1] != '\n' && (c = getc(manifest)) != EOF) {
+            ungetc(c, manifest);
+            printf("error: manifest line %d is longer than %d characters\n", lineNumber, MAX_LINE - 2);
+            fclose(manifest);
+            return -1;
+        }
+        token = strtok(line, " \t\r\n");
+        if (token == NULL || token[0] == '#') {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            grown = realloc(*jobs, capacity * sizeof(Job));
+            if (grown == NULL) {
+                printf("error: out of memory\n");
+                fclose(manifest);
+                return -1;
+            }
+            *jobs = grown;
+        }
+        job = &(*jobs)[count];
+        memset(job, 0, sizeof(Job));
+        job->args = malloc((length / 2 + 1) * sizeof(char*)); // at most this many tokens
+        if (job->args == NULL) {
+            printf("error: out of memory\n");
+            fclose(manifest);
+            return -1;
+        }
+        while (token != NULL) {
+            job->args[job->argCount] = strdup(token);
+            if (job->args[job->argCount] == NULL) {
+                printf("error: out of memory\n");
+                fclose(manifest);
+                return -1;
+            }
+            job->argCount++;
+            token = strtok(NULL, " \t\r\n");
+        }
+        if (job->argCount < 2) {
+            printf("error: manifest line %d needs an output file and at least one object file\n", lineNumber);
+            fclose(manifest);
+            return -1;
+        }
+        count++;
+    }
+    fclose(manifest);
+    return count;
+}
+
+
+int main(int argc, char** argv) {
+    Batch batch;
+    Job* jobs;
+    Worker* workers;
+    pthread_t* threads;
+    int jobCount;
+    int workerCount = 0;
+    int started;
+    int first = 1;
+    int failures = 0;
+    unsigned long long total = 0;
+    int i;
+    int w;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.traceFormat = TRACE_TEXT;
+    while (first < argc && argv[first][0] == '-') {
+        if (strcmp(argv[first], "-j") == 0 && first + 1 < argc) { // number of worker threads
+            workerCount = atoi(argv[++first]);
+        } else if (strcmp(argv[first], "-b") == 0) {
+            batch.traceFormat = TRACE_BINARY;
+        } else if (strcmp(argv[first], "--no-trace") == 0) {
+            batch.traceOff = 1;
+        } else if (strcmp(argv[first], "--lockstep") == 0) {
+            batch.lockstep = 1;
+        } else if (strcmp(argv[first], "--image-cache") == 0 && first + 1 < argc) {
+            batch.imageCache = argv[++first];
+        } else {
+            printf("invalid arguments\n");
+            return -1;
+        }
+        first++;
+    }
+    if (argc - first != 1 || (batch.lockstep && !batch.traceOff)) { // the lockstep engine writes no trace
+        printf("usage: trace-batch [-j threads] [-b | --no-trace [--lockstep]] [--image-cache dir] manifest\n");
+        return -1;
+    }
+    if (batch.traceOff) {
+        batch.traceFormat = TRACE_TEXT;
+    }
+
+    jobCount = ReadManifest(argv[first], &jobs);
+    if (jobCount <= 0) {
+        return jobCount;
+    }
+
+    if (workerCount <= 0) {
+        workerCount = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (workerCount <= 0) {
+        workerCount = 1;
+    }
+    if (workerCount > jobCount) {
+        workerCount = jobCount;
+    }
+
+    // Deal the jobs out in contiguous runs, one queue per worker
+    batch.jobs = jobs;
+#ifdef LC4_PAGED_MEMORY
+    if (GroupImages(&batch, jobCount) != 0) {
+        return -1;
+    }
+#endif
+    batch.workerCount = workerCount;
+    batch.queues = calloc(workerCount, sizeof(JobQueue));
+    workers = calloc(workerCount, sizeof(Worker));
+    threads = calloc(workerCount, sizeof(pthread_t));
+    if (batch.queues == NULL || workers == NULL || threads == NULL) {
+        printf("error: out of memory\n");
+        return -1;
+    }
+    for (w = 0; w < workerCount; w++) {
+        pthread_mutex_init(&batch.queues[w].lock, NULL);
+        batch.queues[w].jobs = malloc(jobCount * sizeof(int));
+        if (batch.queues[w].jobs == NULL) {
+            printf("error: out of memory\n");
+            return -1;
+        }
+        batch.queues[w].head = 0;
+        batch.queues[w].tail = 0;
+    }
+    for (i = 0; i < jobCount; i++) {
+        w = (long long)i * workerCount / jobCount;
+        batch.queues[w].jobs[batch.queues[w].tail++] = i;
+    }
+    // Reverse each run so owners start at the front and thieves take the far end
+    for (w = 0; w < workerCount; w++) {
+        JobQueue* queue = &batch.queues[w];
+        for (i = 0; i < queue->tail / 2; i++) {
+            int tmp = queue->jobs[i];
+            queue->jobs[i] = queue->jobs[queue->tail - 1 - i];
+            queue->jobs[queue->tail - 1 - i] = tmp;
+        }
+    }
+
+    // If a thread cannot be started, this one runs as that worker; it steals
+    // every job left, including those of workers that were never started
+    for (started = 0; started < workerCount; started++) {
+        workers[started].batch = &batch;
+        workers[started].id = started;
+        if (pthread_create(&threads[started], NULL, WorkerMain, &workers[started]) != 0) {
+            WorkerMain(&workers[started]);
+            break;
+        }
+    }
+    for (w = 0; w < started; w++) {
+        pthread_join(threads[w], NULL);
+    }
+    if (started < workerCount) {
+        workerCount = started + 1;
+    }
+#ifdef LC4_PAGED_MEMORY
+    for (i = 0; i < batch.imageCount; i++) {
+        if (batch.images[i].CPU != NULL) {
+            ReleaseMemory(batch.images[i].CPU);
+            free(batch.images[i].CPU);
+        }
+    }
+#endif
+
+    for (i = 0; i < jobCount; i++) {
+        static const char* const statusNames[3] = { "halted", "error", "failed" };
+        printf("%s %s %llu\n", jobs[i].args[0], statusNames[jobs[i].status], jobs[i].instructions);
+        total += jobs[i].instructions;
+        if (jobs[i].status != JOB_HALTED) {
+            failures++;
+        }
+    }
+    printf("%d jobs, %d not halted, %llu instructions, %d threads\n", jobCount, failures, total, workerCount);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,39 @@
+;; alu.asm: tight register-only arithmetic loop, 250 x 8000 iterations
+
+.CODE
+.ADDR 0x0000
+
+MAIN
+    CONST R0 #1
+    CONST R1 #3
+    CONST R5 #250       ; outer iterations
+OUTER
+    CONST R4 x40
+    HICONST R4 x1F      ; 8000 inner iterations
+INNER
+    ADD R0 R0 R1
+    MUL R2 R0 R1
+    XOR R3 R2 R0
+    SLL R3 R3 #3
+    SRA R2 R3 #1
+    SUB R1 R2 R3
+    AND R1 R1 #7
+    ADD R1 R1 #1        ; keep R1 nonzero
+    ADD R4 R4 #-1
+    BRp INNER
+    ADD R5 R5 #-1
+    BRp OUTER
+END
+TRAP xFF		; HALT
+
+.OS
+.CODE
+
+.ADDR x80FF
+HALT
+	NOP
+
+.ADDR x8200
+.FALIGN
+CONST R7, #0
+RTI
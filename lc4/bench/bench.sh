@@ -0,0 +1,87 @@
+#!/bin/bash
+#
+# bench.sh: run every benchmark workload under each simulator configuration
+# and print a table of MIPS (millions of LC4 instructions per second)
+#
+# usage: bench/bench.sh [bin directory] [workload.obj ...]
+#
+# The bin directory holds trace, trace-table, trace-threaded and trace-paged
+# (make bench builds optimized ones into bench/bin). Each cell is the best of
+# REPEAT runs (default 3) of the whole process, so loading is included; the
+# workloads run long enough for that not to matter. Traces are written to
+# /dev/null. A configuration whose final state differs from plain --no-trace
+# is reported as "wrong" instead of a speed.
+
+BIN=${1:-.}
+shift
+WORKLOADS=${@:-$(dirname "$0")/*.obj}
+REPEAT=${REPEAT:-3}
+SUMMARY=$(mktemp)
+EXPECTED=$(mktemp)
+trap 'rm -f "$SUMMARY" "$EXPECTED"' EXIT
+
+# name, binary and options of each configuration; the output file comes next
+CONFIGS=(
+    "trace       trace"
+    "trace-b     trace -b"
+    "no-trace    trace --no-trace"
+    "table       trace-table --no-trace"
+    "threaded    trace-threaded --no-trace"
+    "paged       trace-paged --no-trace"
+    "superblock  trace --superblock --no-trace"
+    "jit         trace --jit --no-trace"
+)
+
+# Nanoseconds since the epoch
+now() {
+    date +%s%N
+}
+
+printf "%-10s %12s" "workload" "instructions"
+for config in "${CONFIGS[@]}"; do
+    set -- $config
+    printf " %10s" "$1"
+done
+printf "\n"
+
+for obj in $WORKLOADS; do
+    name=$(basename "$obj" .obj)
+    if ! "$BIN/trace" --no-trace "$EXPECTED" "$obj" > /dev/null; then
+        printf "%-10s cannot run\n" "$name"
+        continue
+    fi
+    count=$(awk '$1 == "instructions" { print $2 }' "$EXPECTED")
+    printf "%-10s %12s" "$name" "$count"
+
+    for config in "${CONFIGS[@]}"; do
+        set -- $config
+        shift
+        binary=$BIN/$1
+        shift
+        if [ ! -x "$binary" ]; then
+            printf " %10s" "-"
+            continue
+        fi
+        case " $* " in
+            *" --no-trace "*) out=$SUMMARY ;;
+            *) out=/dev/null ;;
+        esac
+
+        best=
+        for i in $(seq "$REPEAT"); do
+            start=$(now)
+            "$binary" "$@" "$out" "$obj" > /dev/null
+            elapsed=$(( $(now) - start ))
+            if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+                best=$elapsed
+            fi
+        done
+
+        if [ "$out" = "$SUMMARY" ] && ! cmp -s "$SUMMARY" "$EXPECTED"; then
+            printf " %10s" "wrong"
+        else
+            awk -v n="$count" -v t="$best" 'BEGIN { printf " %10.1f", n / (t / 1000.0) }'
+        fi
+    done
+    printf "\n"
+done
@@ -0,0 +1,51 @@
+;; branch.asm: data dependent branches on a pseudo-random sequence, 250 x 4096 iterations
+
+.CODE
+.ADDR 0x0000
+
+MAIN
+    CONST R0 #1         ; generator state
+    CONST R1 x45
+    HICONST R1 x62      ; multiplier
+    CONST R2 #13        ; increment
+    CONST R6 #0
+    CONST R7 #0
+    CONST R5 #250       ; outer iterations
+OUTER
+    CONST R4 x00
+    HICONST R4 x10      ; 4096 inner iterations
+LOOP
+    MUL R0 R0 R1
+    ADD R0 R0 R2
+    SRL R3 R0 #9
+    AND R3 R3 #1
+    BRz SKIP1
+    ADD R6 R6 #1
+SKIP1
+    CMPI R0 #0
+    BRzp SKIP2
+    ADD R6 R6 #-1
+SKIP2
+    SRL R3 R0 #12
+    CMPIU R3 #5
+    BRnz SKIP3
+    ADD R7 R7 #1
+SKIP3
+    ADD R4 R4 #-1
+    BRp LOOP
+    ADD R5 R5 #-1
+    BRp OUTER
+END
+TRAP xFF		; HALT
+
+.OS
+.CODE
+
+.ADDR x80FF
+HALT
+	NOP
+
+.ADDR x8200
+.FALIGN
+CONST R7, #0
+RTI
@@ -0,0 +1,56 @@
+;; memcopy.asm: copy 2048 words from x4000 to x5000 with LDR/STR, 3000 times
+
+.CODE
+.ADDR 0x0000
+
+MAIN
+    CONST R0 x00
+    HICONST R0 x40      ; fill the source with 7 * i
+    CONST R1 #0
+    CONST R4 x00
+    HICONST R4 x08      ; 2048 words
+FILL
+    STR R1 R0 #0
+    ADD R1 R1 #7
+    ADD R0 R0 #1
+    ADD R4 R4 #-1
+    BRp FILL
+
+    CONST R5 xB8
+    HICONST R5 x0B      ; 3000 passes
+PASS
+    CONST R0 x00
+    HICONST R0 x40      ; source
+    CONST R1 x00
+    HICONST R1 x50      ; destination
+    CONST R4 x00
+    HICONST R4 x02      ; 512 x 4 words
+COPY
+    LDR R2 R0 #0
+    LDR R3 R0 #1
+    STR R2 R1 #0
+    STR R3 R1 #1
+    LDR R2 R0 #2
+    LDR R3 R0 #3
+    STR R2 R1 #2
+    STR R3 R1 #3
+    ADD R0 R0 #4
+    ADD R1 R1 #4
+    ADD R4 R4 #-1
+    BRp COPY
+    ADD R5 R5 #-1
+    BRp PASS
+END
+TRAP xFF		; HALT
+
+.OS
+.CODE
+
+.ADDR x80FF
+HALT
+	NOP
+
+.ADDR x8200
+.FALIGN
+CONST R7, #0
+RTI
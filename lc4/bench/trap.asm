@@ -0,0 +1,40 @@
+;; trap.asm: a user loop calling an OS service through TRAP, 500 x 4096 calls
+
+.CODE
+.ADDR 0x0000
+
+MAIN
+    CONST R5 xF4
+    HICONST R5 x01      ; 500 outer iterations
+OUTER
+    CONST R4 x00
+    HICONST R4 x10      ; 4096 calls
+LOOP
+    TRAP x10
+    ADD R4 R4 #-1
+    BRp LOOP
+    ADD R5 R5 #-1
+    BRp OUTER
+END
+TRAP xFF		; HALT
+
+.OS
+.CODE
+
+.ADDR x8010
+COUNT           ; count the call in OS memory
+    CONST R6 x00
+    HICONST R6 xA0
+    LDR R0 R6 #0
+    ADD R0 R0 #1
+    STR R0 R6 #0
+    RTI
+
+.ADDR x80FF
+HALT
+	NOP
+
+.ADDR x8200
+.FALIGN
+CONST R7, #0
+RTI
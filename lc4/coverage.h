@@ -0,0 +1,38 @@
+/*
+ * coverage.h: Declares the edge coverage map used by trace-fuzz (built with
+ * -DLC4_COVERAGE)
+ */
+
+#ifndef COVERAGE_H
+#define COVERAGE_H
+
+#include "LC4.h"
+
+// One bit per edge; an edge from one instruction to the next is hashed
+// from both PCs into 16 bits
+#define COVERAGE_EDGES 65536
+
+struct Coverage {
+    unsigned char seen[COVERAGE_EDGES / 8];
+    unsigned long long edges;           // bits set in seen
+};
+
+
+/*
+ * Mark the edge from the previous instruction to the one at the current PC,
+ * which is about to execute. The previous PC is shifted so that A -> B and
+ * B -> A are different edges.
+ */
+static inline void CoverEdge(Coverage* coverage, MachineState* CPU)
+{
+    unsigned int edge = (CPU->prevPC >> 1) ^ CPU->PC;
+    unsigned char bit = 1 << (edge & 7);
+
+    if ((coverage->seen[edge >> 3] & bit) == 0) {
+        coverage->seen[edge >> 3] |= bit;
+        coverage->edges++;
+    }
+    CPU->prevPC = CPU->PC;
+}
+
+#endif
@@ -0,0 +1,271 @@
+/*
+ * devices.c: Defines the device event queue and the standard LC4 devices
+ */
+
+#include "devices.h"
+
+#define DISPLAY_BUFFER (1 << 16)
+
+typedef struct {
+    unsigned long long when;
+    DeviceEvent handler;
+    void* device;
+} Event;
+
+typedef struct {
+    FILE* input;
+} Keyboard;
+
+typedef struct {
+    FILE* output;
+} Display;
+
+typedef struct {
+    DeviceBus* bus;
+    MachineState* CPU;
+    unsigned short int interval;    // TIR
+    unsigned short int status;      // TSR
+    unsigned long long due;         // instrCount of the pending tick, if interval is not 0
+} Timer;
+
+struct DeviceBus {
+    Event* events;                  // binary min-heap on when
+    int eventCount;
+    int eventCapacity;
+
+    Keyboard keyboard;
+    Display display;
+    Timer timer;
+};
+
+
+/*
+ * Allocate a bus with no devices and no events.
+ */
+DeviceBus* DeviceBusCreate(void)
+{
+    return calloc(1, sizeof(DeviceBus));
+}
+
+
+/*
+ * Free the bus and its devices.
+ */
+void DeviceBusDestroy(DeviceBus* bus)
+{
+    if (bus->display.output != NULL) {
+        fflush(bus->display.output);
+    }
+    free(bus->events);
+    free(bus);
+}
+
+
+/*
+ * Call handler with device once instrCount reaches when.
+ */
+int ScheduleEvent(DeviceBus* bus, unsigned long long when, DeviceEvent handler, void* device)
+{
+    Event* events;
+    Event event = { when, handler, device };
+    int i;
+
+    if (bus->eventCount == bus->eventCapacity) {
+        events = realloc(bus->events, 2 * (bus->eventCapacity + 4) * sizeof(Event));
+        if (events == NULL) {
+            return 1;
+        }
+        bus->events = events;
+        bus->eventCapacity = 2 * (bus->eventCapacity + 4);
+    }
+    for (i = bus->eventCount++; i > 0 && bus->events[(i - 1) / 2].when > when; i = (i - 1) / 2) {
+        bus->events[i] = bus->events[(i - 1) / 2];
+    }
+    bus->events[i] = event;
+    return 0;
+}
+
+
+/*
+ * Remove the earliest event from the heap.
+ */
+static Event TakeEvent(DeviceBus* bus)
+{
+    Event first = bus->events[0];
+    Event last = bus->events[--bus->eventCount];
+    int i = 0;
+    int child;
+
+    while ((child = 2 * i + 1) < bus->eventCount) {
+        if (child + 1 < bus->eventCount && bus->events[child + 1].when < bus->events[child].when) {
+            child++;
+        }
+        if (bus->events[child].when >= last.when) {
+            break;
+        }
+        bus->events[i] = bus->events[child];
+        i = child;
+    }
+    bus->events[i] = last;
+    return first;
+}
+
+
+/*
+ * RunMachineUntil that fires the bus's events on time.
+ */
+int RunWithDevices(DeviceBus* bus, MachineState* CPU, FILE* output, unsigned short int haltPC,
+                   unsigned long long stopCount)
+{
+    unsigned long long until;
+    Event event;
+    int status;
+
+    for (;;) {
+        while (bus->eventCount > 0 && bus->events[0].when <= CPU->instrCount) {
+            event = TakeEvent(bus);
+            event.handler(event.device, CPU);
+        }
+        // A device may schedule an event while the machine runs, never
+        // sooner than DEVICE_HORIZON ahead, so no run may go further than that
+        until = CPU->instrCount + DEVICE_HORIZON;
+        if (bus->eventCount > 0 && bus->events[0].when < until) {
+            until = bus->events[0].when;
+        }
+        if (stopCount < until) {
+            until = stopCount;
+        }
+        status = RunMachineUntil(CPU, output, haltPC, until);
+        if (status != 2 || until == stopCount) {
+            return status;
+        }
+    }
+}
+
+
+/*
+ * KBSR and KBDR. Reading KBDR takes the next character of the input.
+ */
+static unsigned short int KeyboardRead(void* device, unsigned short int addr)
+{
+    Keyboard* keyboard = device;
+    int c;
+
+    if (keyboard->input == NULL) {
+        return 0;
+    }
+    if (addr == KBSR) {
+        c = getc(keyboard->input);
+        if (c == EOF) {
+            return 0;
+        }
+        ungetc(c, keyboard->input);
+        return 0x8000;
+    }
+    if (addr == KBDR) {
+        c = getc(keyboard->input);
+        return c == EOF ? 0 : c & 0xFF;
+    }
+    return 0;
+}
+
+
+static void KeyboardWrite(void* device, unsigned short int addr, unsigned short int value)
+{
+}
+
+
+/*
+ * ADSR and ADDR. The display is always ready.
+ */
+static unsigned short int DisplayRead(void* device, unsigned short int addr)
+{
+    return addr == ADSR ? 0x8000 : 0;
+}
+
+
+static void DisplayWrite(void* device, unsigned short int addr, unsigned short int value)
+{
+    Display* display = device;
+
+    if (addr == ADDR && display->output != NULL) {
+        putc(value & 0xFF, display->output);
+    }
+}
+
+
+/*
+ * Timer tick event. Ticks left over from an interval that has since been
+ * changed are ignored.
+ */
+static void TimerTick(void* device, MachineState* CPU)
+{
+    Timer* timer = device;
+
+    if (timer->interval == 0 || CPU->instrCount != timer->due) {
+        return;
+    }
+    timer->status = 0x8000;
+    timer->due += (unsigned long long)timer->interval * TIMER_TICK;
+    ScheduleEvent(timer->bus, timer->due, TimerTick, timer);
+}
+
+
+/*
+ * TSR and TIR. Reading TSR clears it.
+ */
+static unsigned short int TimerRead(void* device, unsigned short int addr)
+{
+    Timer* timer = device;
+    unsigned short int status;
+
+    if (addr == TSR) {
+        status = timer->status;
+        timer->status = 0;
+        return status;
+    }
+    return addr == TIR ? timer->interval : 0;
+}
+
+
+/*
+ * Writing TIR restarts the timer with the new interval.
+ */
+static void TimerWrite(void* device, unsigned short int addr, unsigned short int value)
+{
+    Timer* timer = device;
+
+    if (addr != TIR) {
+        return;
+    }
+    timer->interval = value;
+    timer->status = 0;
+    if (value != 0) {
+        // The store is still running, so count from the next instruction
+        timer->due = timer->CPU->instrCount + 1 + (unsigned long long)value * TIMER_TICK;
+        ScheduleEvent(timer->bus, timer->due, TimerTick, timer);
+    }
+}
+
+
+/*
+ * Map the keyboard, display and timer into CPU.
+ */
+int AddStandardDevices(DeviceBus* bus, MachineState* CPU, FILE* keyboard, FILE* display)
+{
+    bus->keyboard.input = keyboard;
+    bus->display.output = display;
+    if (display != NULL) {
+        setvbuf(display, NULL, _IOFBF, DISPLAY_BUFFER);
+    }
+    bus->timer.bus = bus;
+    bus->timer.CPU = CPU;
+
+    if (MapDevice(CPU, KBSR, KBDR + 1, KeyboardRead, KeyboardWrite, &bus->keyboard) != 0 ||
+        MapDevice(CPU, ADSR, ADDR + 1, DisplayRead, DisplayWrite, &bus->display) != 0 ||
+        MapDevice(CPU, TSR, TIR + 1, TimerRead, TimerWrite, &bus->timer) != 0) {
+        printf("error: too many devices\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,68 @@
+/*
+ * devices.h: Declares the device event queue and the standard LC4 devices
+ */
+
+#ifndef DEVICES_H
+#define DEVICES_H
+
+#include <stdio.h>
+#include "LC4.h"
+
+// Registers of the standard devices, as in PennSim
+#define KBSR 0xFE00  // keyboard status: bit 15 set when a character is ready
+#define KBDR 0xFE02  // keyboard data: reading takes the character
+#define ADSR 0xFE04  // display status: bit 15 set when it can take a character
+#define ADDR 0xFE06  // display data: writing prints the low byte
+#define TSR  0xFE08  // timer status: bit 15 set once the interval has passed, cleared by reading
+#define TIR  0xFE0A  // timer interval in milliseconds, 0 to stop the timer
+
+// Instructions per millisecond of timer interval; time is counted in
+// instructions so that runs are reproducible
+#define TIMER_TICK 1000
+
+// Events scheduled from a device's read or write handler must be at least
+// this many instructions ahead
+#define DEVICE_HORIZON TIMER_TICK
+
+typedef struct DeviceBus DeviceBus;
+
+// Called when the instruction count reaches the time an event was scheduled for
+typedef void (*DeviceEvent)(void* device, MachineState* CPU);
+
+/*
+ * Allocate a bus with no devices and no events. Returns NULL if out of memory.
+ */
+DeviceBus* DeviceBusCreate(void);
+
+
+/*
+ * Free the bus and its devices. The files given to AddStandardDevices are
+ * flushed but not closed.
+ */
+void DeviceBusDestroy(DeviceBus* bus);
+
+
+/*
+ * Call handler with device once CPU's instrCount reaches when, before the
+ * instruction there runs. Returns 1 if out of memory.
+ */
+int ScheduleEvent(DeviceBus* bus, unsigned long long when, DeviceEvent handler, void* device);
+
+
+/*
+ * Map the keyboard, display and timer into CPU. The keyboard reads
+ * characters from keyboard (never ready if NULL) and the display writes
+ * them to display through a large buffer. Returns 1 on failure.
+ */
+int AddStandardDevices(DeviceBus* bus, MachineState* CPU, FILE* keyboard, FILE* display);
+
+
+/*
+ * RunMachineUntil that fires the bus's events on time. The machine runs
+ * uninterrupted up to the next event or DEVICE_HORIZON instructions, so
+ * there is no per-instruction cost.
+ */
+int RunWithDevices(DeviceBus* bus, MachineState* CPU, FILE* output, unsigned short int haltPC,
+                   unsigned long long stopCount);
+
+#endif
@@ -0,0 +1,426 @@
+/*
+ * fuzz.c: location of main() for trace-fuzz, a coverage guided fuzzer
+ *
+ * usage: trace-fuzz [-n runs] [-b budget] [-s seed] [-o dir] -i start:length [-i start:length ...] object files
+ *
+ * The object files are loaded once into a base machine. Every run forks a
+ * copy of it, overwrites the input ranges given with -i (start is a hex
+ * address, length a number of words) with a mutated input and runs it until
+ * it halts, fails or has executed budget instructions (default 10000).
+ * Forking is cheap with paged memory: the copy shares every page of the base
+ * copy-on-write, and resetting it for the next run only touches the pages
+ * the last run wrote.
+ *
+ * Every instruction marks the edge it was reached by in a coverage map; an
+ * input that marks a new edge joins the corpus the next inputs are mutated
+ * from, starting from the input ranges as loaded. A run that fails is a
+ * crash: "error occurred" for a PC outside the code it may run or user code
+ * reading or writing OS memory, or a DIV or MOD by zero, which this build
+ * reports the same way instead of letting the host trap. Crashes are told
+ * apart by the instruction that failed or jumped to where it may not run;
+ * the first crash of each is saved to dir/crash-<its PC>.obj (dir defaults
+ * to crashes), an object file holding just the input ranges, so that
+ *     trace output.txt <object files> dir/crash-<PC>.obj
+ * reproduces it (a zero divisor kills trace with SIGFPE). The simulator's
+ * own "error occurred" lines are discarded; saved crashes and a summary are
+ * printed instead. The random seed (default 1) makes a session repeatable;
+ * run one process per core with different seeds to use more cores.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "loader.h"
+#include "coverage.h"
+
+#ifndef LC4_COVERAGE
+#error trace-fuzz needs -DLC4_COVERAGE
+#endif
+
+#define MAX_RANGES     16
+#define DEFAULT_RUNS   1000000
+#define DEFAULT_BUDGET 10000
+#define HALT_PC        0x80FF
+#define MAX_STACKED    4       // mutations applied to one input at most
+
+typedef struct {
+    unsigned short int start;
+    int length;
+} InputRange;
+
+typedef struct {
+    InputRange ranges[MAX_RANGES];
+    int rangeCount;
+    int inputWords;                 // words in all ranges together
+
+    unsigned short int** corpus;    // inputs that found new edges
+    int corpusCount;
+    int corpusCapacity;
+
+    unsigned long long rng;
+    unsigned char crashed[65536 / 8]; // bit per crashing instruction saved
+    const char* crashDir;
+    FILE* report;
+
+    unsigned long long runs;
+    unsigned long long crashes;
+    unsigned long long savedCrashes;
+    unsigned long long hangs;
+} Fuzzer;
+
+// Values that tend to sit on boundaries: zero, signs, bytes, the OS regions
+static const unsigned short int InterestingWords[] = {
+    0x0000, 0x0001, 0x0002, 0x0010, 0x007F, 0x0080, 0x00FF, 0x0100,
+    0x1FFF, 0x2000, 0x7FFF, 0x8000, 0x80FF, 0xA000, 0xFFFE, 0xFFFF
+};
+
+
+/*
+ * Next pseudo random number (xorshift64*).
+ */
+static unsigned long long Random(Fuzzer* fuzzer)
+{
+    fuzzer->rng ^= fuzzer->rng >> 12;
+    fuzzer->rng ^= fuzzer->rng << 25;
+    fuzzer->rng ^= fuzzer->rng >> 27;
+    return fuzzer->rng * 0x2545F4914F6CDD1DULL;
+}
+
+
+/*
+ * Parse start:length, start in hex with an optional leading x. Returns 0 on success.
+ */
+static int ParseRange(const char* arg, InputRange* range)
+{
+    char* end;
+    unsigned long start;
+    long length;
+
+    if (arg[0] == 'x' || arg[0] == 'X') {
+        arg++;
+    }
+    start = strtoul(arg, &end, 16);
+    if (end == arg || *end != ':' || start > 0xFFFF) {
+        return 1;
+    }
+    arg = end + 1;
+    length = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || length <= 0 || start + length > 0x10000) {
+        return 1;
+    }
+    range->start = start;
+    range->length = length;
+    return 0;
+}
+
+
+/*
+ * Add a copy of words to the corpus. Returns 0 on success.
+ */
+static int AddToCorpus(Fuzzer* fuzzer, const unsigned short int* words)
+{
+    unsigned short int** corpus;
+    unsigned short int* copy;
+
+    if (fuzzer->corpusCount == fuzzer->corpusCapacity) {
+        corpus = realloc(fuzzer->corpus, 2 * (fuzzer->corpusCapacity + 1) * sizeof(*corpus));
+        if (corpus == NULL) {
+            return 1;
+        }
+        fuzzer->corpus = corpus;
+        fuzzer->corpusCapacity = 2 * (fuzzer->corpusCapacity + 1);
+    }
+    copy = malloc(fuzzer->inputWords * sizeof(*copy));
+    if (copy == NULL) {
+        return 1;
+    }
+    memcpy(copy, words, fuzzer->inputWords * sizeof(*copy));
+    fuzzer->corpus[fuzzer->corpusCount++] = copy;
+    return 0;
+}
+
+
+/*
+ * Copy the input ranges of CPU's memory into words.
+ */
+static void ReadInput(Fuzzer* fuzzer, MachineState* CPU, unsigned short int* words)
+{
+    int r;
+    int i;
+
+    for (r = 0; r < fuzzer->rangeCount; r++) {
+        for (i = 0; i < fuzzer->ranges[r].length; i++) {
+            *words++ = ReadMemory(CPU, fuzzer->ranges[r].start + i);
+        }
+    }
+}
+
+
+/*
+ * Store words into the input ranges of CPU's memory. Words that are already
+ * there are not written, so their pages stay shared.
+ */
+static void WriteInput(Fuzzer* fuzzer, MachineState* CPU, const unsigned short int* words)
+{
+    unsigned short int addr;
+    int r;
+    int i;
+
+    for (r = 0; r < fuzzer->rangeCount; r++) {
+        for (i = 0; i < fuzzer->ranges[r].length; i++, words++) {
+            addr = fuzzer->ranges[r].start + i;
+            if (ReadMemory(CPU, addr) != *words) {
+                WriteMemory(CPU, addr, *words);
+            }
+        }
+    }
+}
+
+
+/*
+ * Replace words with a random corpus entry changed by a few random mutations.
+ */
+static void Mutate(Fuzzer* fuzzer, unsigned short int* words)
+{
+    int n = fuzzer->inputWords;
+    int stacked = 1 + Random(fuzzer) % MAX_STACKED;
+    int at;
+    int delta;
+
+    memcpy(words, fuzzer->corpus[Random(fuzzer) % fuzzer->corpusCount], n * sizeof(*words));
+    while (stacked-- > 0) {
+        at = Random(fuzzer) % n;
+        switch (Random(fuzzer) % 6) {
+        case 0: // flip a bit
+            words[at] ^= 1 << (Random(fuzzer) % 16);
+            break;
+        case 1: // a boundary value
+            words[at] = InterestingWords[Random(fuzzer) % (sizeof(InterestingWords) / sizeof(InterestingWords[0]))];
+            break;
+        case 2: // add or subtract a little
+            delta = 1 + Random(fuzzer) % 16;
+            words[at] += (Random(fuzzer) & 1) ? delta : -delta;
+            break;
+        case 3: // anything
+            words[at] = Random(fuzzer);
+            break;
+        case 4: // the same word of another input
+            words[at] = fuzzer->corpus[Random(fuzzer) % fuzzer->corpusCount][at];
+            break;
+        default: // another word of this input
+            words[at] = words[Random(fuzzer) % n];
+            break;
+        }
+    }
+}
+
+
+/*
+ * Make child a copy of base, ready to run. Only what a run without a trace
+ * reads is copied; child must have been forked from base before or Reset.
+ */
+static void ForkCase(MachineState* child, MachineState* base)
+{
+    ShareMemory(child, base);
+    child->PC = base->PC;
+    child->PSR = base->PSR;
+    memcpy(child->R, base->R, sizeof(child->R));
+    child->instrCount = base->instrCount;
+    child->prevPC = base->prevPC;
+}
+
+
+/*
+ * Write words as an object file of one data section per input range.
+ * Returns 0 on success.
+ */
+static int WriteInputObject(Fuzzer* fuzzer, const char* filename, const unsigned short int* words)
+{
+    FILE* file = fopen(filename, "wb");
+    unsigned short int header[3];
+    int r;
+    int i;
+    int j;
+
+    if (file == NULL) {
+        return 1;
+    }
+    for (r = 0; r < fuzzer->rangeCount; r++) {
+        header[0] = 0xDADA;
+        header[1] = fuzzer->ranges[r].start;
+        header[2] = fuzzer->ranges[r].length;
+        for (j = 0; j < 3; j++) {
+            fputc(header[j] >> 8, file);
+            fputc(header[j] & 0xFF, file);
+        }
+        for (i = 0; i < fuzzer->ranges[r].length; i++, words++) {
+            fputc(*words >> 8, file);
+            fputc(*words & 0xFF, file);
+        }
+    }
+    return fclose(file) != 0;
+}
+
+
+/*
+ * Count a crash caused by the instruction at pc and save its input if it is
+ * the first there.
+ */
+static void SaveCrash(Fuzzer* fuzzer, unsigned short int pc, const unsigned short int* words)
+{
+    char filename[FILENAME_MAX];
+
+    fuzzer->crashes++;
+    if (fuzzer->crashed[pc >> 3] & (1 << (pc & 7))) {
+        return;
+    }
+    fuzzer->crashed[pc >> 3] |= 1 << (pc & 7);
+    snprintf(filename, sizeof(filename), "%s/crash-%04X.obj", fuzzer->crashDir, pc);
+    if (WriteInputObject(fuzzer, filename, words) != 0) {
+        fprintf(fuzzer->report, "error: cannot write %s\n", filename);
+        return;
+    }
+    fuzzer->savedCrashes++;
+    fprintf(fuzzer->report, "run %llu: crash at instruction %04X saved to %s\n", fuzzer->runs, pc, filename);
+    fflush(fuzzer->report);
+}
+
+
+/*
+ * Seconds since an arbitrary fixed point.
+ */
+static double Now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+int main(int argc, char** argv) {
+    static MachineState base;
+    static MachineState child;
+    Fuzzer fuzzer;
+    Coverage* coverage;
+    unsigned short int* words;
+    unsigned long long runs = DEFAULT_RUNS;
+    unsigned long long budget = DEFAULT_BUDGET;
+    unsigned long long edges;
+    double start;
+    double elapsed;
+    int first = 1;
+    int status;
+    int i;
+
+    memset(&fuzzer, 0, sizeof(fuzzer));
+    fuzzer.rng = 1;
+    fuzzer.crashDir = "crashes";
+    while (first < argc && argv[first][0] == '-') {
+        if (strcmp(argv[first], "-n") == 0 && first + 1 < argc) { // number of runs
+            runs = strtoull(argv[++first], NULL, 10);
+        } else if (strcmp(argv[first], "-b") == 0 && first + 1 < argc) { // instructions per run
+            budget = strtoull(argv[++first], NULL, 10);
+        } else if (strcmp(argv[first], "-s") == 0 && first + 1 < argc) { // random seed
+            fuzzer.rng = strtoull(argv[++first], NULL, 10);
+        } else if (strcmp(argv[first], "-o") == 0 && first + 1 < argc) { // where crashes are saved
+            fuzzer.crashDir = argv[++first];
+        } else if (strcmp(argv[first], "-i") == 0 && first + 1 < argc && fuzzer.rangeCount < MAX_RANGES) {
+            if (ParseRange(argv[++first], &fuzzer.ranges[fuzzer.rangeCount]) != 0) {
+                printf("error: invalid input range %s\n", argv[first]);
+                return -1;
+            }
+            fuzzer.inputWords += fuzzer.ranges[fuzzer.rangeCount++].length;
+        } else {
+            printf("invalid arguments\n");
+            return -1;
+        }
+        first++;
+    }
+    if (first == argc || fuzzer.rangeCount == 0 || budget == 0) {
+        printf("usage: trace-fuzz [-n runs] [-b budget] [-s seed] [-o dir] -i start:length [-i start:length ...] object files\n");
+        return -1;
+    }
+    if (fuzzer.rng == 0) { // xorshift never leaves 0
+        fuzzer.rng = 1;
+    }
+
+    Reset(&base);
+    Reset(&child);
+    for (i = first; i < argc; i++) {
+        if (ReadObjectFile(argv[i], &base) != 0) {
+            return 1;
+        }
+    }
+    if (mkdir(fuzzer.crashDir, 0755) != 0 && access(fuzzer.crashDir, W_OK) != 0) {
+        printf("error: cannot create %s\n", fuzzer.crashDir);
+        return 1;
+    }
+
+    coverage = calloc(1, sizeof(Coverage));
+    words = malloc(fuzzer.inputWords * sizeof(*words));
+    if (coverage == NULL || words == NULL) {
+        printf("error: out of memory\n");
+        return 1;
+    }
+    ReadInput(&fuzzer, &base, words);
+    if (AddToCorpus(&fuzzer, words) != 0) {
+        printf("error: out of memory\n");
+        return 1;
+    }
+
+    // Keep reporting on stdout but send the simulator's "error occurred" lines, one per crashing run, nowhere
+    fflush(stdout);
+    fuzzer.report = fdopen(dup(fileno(stdout)), "w");
+    if (fuzzer.report == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        printf("error: cannot redirect the simulator output\n");
+        return 1;
+    }
+
+    child.coverage = coverage;
+    start = Now();
+    for (fuzzer.runs = 0; fuzzer.runs < runs; fuzzer.runs++) {
+        if (fuzzer.runs > 0) { // the first run is the loaded input as is
+            Mutate(&fuzzer, words);
+        }
+        ForkCase(&child, &base);
+        WriteInput(&fuzzer, &child, words);
+
+        edges = coverage->edges;
+        status = RunMachineUntil(&child, NULL, HALT_PC, budget);
+        if (status == 1) {
+            // A load or store that failed is the last instruction marked, and
+            // so is one that jumped to a PC that failed
+            SaveCrash(&fuzzer, child.prevPC, words);
+        } else {
+            if (status == 2) {
+                fuzzer.hangs++;
+            }
+            if (coverage->edges != edges && AddToCorpus(&fuzzer, words) != 0) {
+                fprintf(fuzzer.report, "error: out of memory\n");
+                break;
+            }
+        }
+    }
+    elapsed = Now() - start;
+
+    fprintf(fuzzer.report, "runs %llu\n", fuzzer.runs);
+    fprintf(fuzzer.report, "runs per second %.0f\n", elapsed > 0 ? fuzzer.runs / elapsed : 0.0);
+    fprintf(fuzzer.report, "edges %llu\n", coverage->edges);
+    fprintf(fuzzer.report, "corpus %d\n", fuzzer.corpusCount);
+    fprintf(fuzzer.report, "crashes %llu (%llu saved)\n", fuzzer.crashes, fuzzer.savedCrashes);
+    fprintf(fuzzer.report, "hangs %llu\n", fuzzer.hangs);
+    fclose(fuzzer.report);
+
+    ReleaseMemory(&child);
+    ReleaseMemory(&base);
+    for (i = 0; i < fuzzer.corpusCount; i++) {
+        free(fuzzer.corpus[i]);
+    }
+    free(fuzzer.corpus);
+    free(words);
+    free(coverage);
+    return fuzzer.savedCrashes > 0;
+}
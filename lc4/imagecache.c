@@ -0,0 +1,287 @@
+/*
+ * imagecache.c: Defines the cache of preprocessed memory images
+ *
+ * An image holds every range of nonzero memory left by loading a list of
+ * object files, which is all that loading changes in a freshly Reset machine.
+ * Images are named by a 64 bit FNV-1a hash over each file's contents and
+ * length, so changing, reordering or adding a file gives a different image.
+ * Images are written under a temporary name and renamed into place, so
+ * concurrent runs never see a partial one.
+ */
+
+#include "imagecache.h"
+#include "loader.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Zero words between two nonzero runs are stored anyway if that is no bigger than a range header
+#define RANGE_HEADER_WORDS 2
+
+#define RANGE_HEADER_SIZE 4
+
+static void PutShort(unsigned char* p, unsigned short int value)
+{
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+static unsigned short int GetShort(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned long long Fnv1a(unsigned long long hash, const unsigned char* data, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+
+/*
+ * Hash the contents of the object files. Returns 1 if one can't be read.
+ */
+static int HashObjectFiles(char** filenames, int count, unsigned long long* key)
+{
+    const unsigned char* data;
+    unsigned char length[8];
+    size_t size;
+    int i;
+    int j;
+
+    *key = Fnv1a(0xCBF29CE484222325ULL, (const unsigned char*)IMAGE_MAGIC, 8);
+    for (i = 0; i < count; i++) {
+        data = MapFile(filenames[i], &size);
+        if (data == NULL) {
+            return 1;
+        }
+        *key = Fnv1a(*key, data, size);
+        for (j = 0; j < 8; j++) { // separates the files
+            length[j] = ((unsigned long long)size >> (8 * j)) & 0xFF;
+        }
+        *key = Fnv1a(*key, length, sizeof(length));
+        UnmapFile(data, size);
+    }
+    return 0;
+}
+
+
+/*
+ * Copy a cached image into CPU, decoding each word as the loader does. Only
+ * words are stored, so a damaged image can give wrong memory but never a
+ * decoded instruction the interpreter could not have made itself. Returns 1,
+ * without touching CPU, if the image is damaged or belongs to another key.
+ */
+static int ReadImage(const unsigned char* data, size_t size, unsigned long long key, MachineState* CPU)
+{
+    const unsigned char* p;
+    const unsigned char* words;
+    unsigned short int* dest;
+    unsigned long long stored = 0;
+    unsigned short int start;
+    unsigned short int length;
+    unsigned long ranges;
+    unsigned long r;
+    int count;
+    int pass;
+    int i;
+
+    if (size < IMAGE_HEADER_SIZE || memcmp(data, IMAGE_MAGIC, 8) != 0 || GetShort(data + 8) != IMAGE_VERSION) {
+        return 1;
+    }
+    for (i = 7; i >= 0; i--) {
+        stored = (stored << 8) | data[16 + i];
+    }
+    if (stored != key) {
+        return 1;
+    }
+    ranges = GetShort(data + 12) | ((unsigned long)GetShort(data + 14) << 16);
+
+    // Pass 0 checks every range lies inside the file and memory, pass 1 copies them
+    for (pass = 0; pass < 2; pass++) {
+        p = data + IMAGE_HEADER_SIZE;
+        for (r = 0; r < ranges; r++) {
+            if ((size_t)(data + size - p) < RANGE_HEADER_SIZE) {
+                return 1;
+            }
+            start = GetShort(p);
+            length = GetShort(p + 2);
+            p += RANGE_HEADER_SIZE;
+            if (start + length > 65536 || (size_t)(data + size - p) < (size_t)length * 2) {
+                return 1;
+            }
+            words = p;
+            p += (size_t)length * 2;
+
+            while (pass == 1 && length > 0) {
+                dest = WritableRange(CPU, start, &count);
+                if (count > length) {
+                    count = length;
+                }
+                for (i = 0; i < count; i++) {
+                    dest[i] = GetShort(words + 2 * i);
+                    DecodeInstruction(CPU, start + i);
+                }
+                start += count;
+                length -= count;
+                words += 2 * count;
+            }
+        }
+        if (p != data + size) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Write one range of memory to the image.
+ */
+static void WriteRange(FILE* output, const unsigned short int* memory, int start, int length)
+{
+    unsigned char header[RANGE_HEADER_SIZE];
+    unsigned char word[2];
+    int i;
+
+    PutShort(header, start);
+    PutShort(header + 2, length);
+    fwrite(header, 1, sizeof(header), output);
+    for (i = start; i < start + length; i++) {
+        PutShort(word, memory[i]);
+        fwrite(word, 1, sizeof(word), output);
+    }
+}
+
+
+/*
+ * Store the loaded memory of CPU as the image for key. Failures are ignored;
+ * the next run just parses the object files again.
+ */
+static void WriteImage(const char* path, unsigned long long key, MachineState* CPU)
+{
+    unsigned short int* memory = malloc(65536 * sizeof(unsigned short int));
+    unsigned char header[IMAGE_HEADER_SIZE];
+    char temp[FILENAME_MAX];
+    FILE* output;
+    unsigned long ranges = 0;
+    int start;
+    int end;
+    int gap;
+    int fd;
+    int pass;
+    int i;
+
+    if (memory == NULL) {
+        return;
+    }
+    DumpMemory(CPU, memory);
+
+    if (snprintf(temp, sizeof(temp), "%s.XXXXXX", path) >= (int)sizeof(temp)) {
+        free(memory);
+        return;
+    }
+    fd = mkstemp(temp);
+    if (fd < 0) {
+        free(memory);
+        return;
+    }
+    fchmod(fd, 0644); // mkstemp makes it private to this user
+    output = fdopen(fd, "wb");
+    if (output == NULL) {
+        close(fd);
+        unlink(temp);
+        free(memory);
+        return;
+    }
+
+    // Pass 0 counts the ranges for the header, pass 1 writes them
+    for (pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            memset(header, 0, sizeof(header));
+            memcpy(header, IMAGE_MAGIC, 8);
+            PutShort(header + 8, IMAGE_VERSION);
+            PutShort(header + 12, ranges & 0xFFFF);
+            PutShort(header + 14, ranges >> 16);
+            for (i = 0; i < 8; i++) {
+                header[16 + i] = (key >> (8 * i)) & 0xFF;
+            }
+            fwrite(header, 1, sizeof(header), output);
+        }
+        for (start = 0; start < 65536; start = end) {
+            if (memory[start] == 0) {
+                end = start + 1;
+                continue;
+            }
+            end = start + 1;
+            for (;;) {
+                while (end < 65536 && end - start < 0xFFFF && memory[end] != 0) {
+                    end++;
+                }
+                for (gap = 0; end + gap < 65536 && gap <= RANGE_HEADER_WORDS && memory[end + gap] == 0; gap++) {
+                }
+                if (end + gap >= 65536 || gap > RANGE_HEADER_WORDS || end + gap - start >= 0xFFFF) {
+                    break;
+                }
+                end += gap;
+            }
+            if (pass == 0) {
+                ranges++;
+            } else {
+                WriteRange(output, memory, start, end - start);
+            }
+        }
+    }
+    free(memory);
+
+    if (ferror(output) | fclose(output)) {
+        unlink(temp);
+        return;
+    }
+    if (rename(temp, path) != 0) {
+        unlink(temp);
+    }
+}
+
+
+/*
+ * Load the object files into CPU, through the image cache if cacheDir is set.
+ */
+int LoadObjectFiles(char** filenames, int count, MachineState* CPU, const char* cacheDir)
+{
+    char path[FILENAME_MAX];
+    const unsigned char* data;
+    unsigned long long key;
+    size_t size;
+    int i;
+
+    if (cacheDir != NULL && HashObjectFiles(filenames, count, &key) == 0) {
+        snprintf(path, sizeof(path), "%s/%016llx.lc4img", cacheDir, key);
+        data = MapFile(path, &size);
+        if (data != NULL) {
+            i = ReadImage(data, size, key, CPU);
+            UnmapFile(data, size);
+            if (i == 0) {
+                return 0;
+            }
+        }
+    } else {
+        cacheDir = NULL; // unreadable file; ReadObjectFile reports it below
+    }
+
+    for (i = 0; i < count; i++) {
+        if (ReadObjectFile(filenames[i], CPU) != 0) {
+            return 1;
+        }
+    }
+    if (cacheDir != NULL) {
+        WriteImage(path, key, CPU);
+    }
+    return 0;
+}
@@ -0,0 +1,27 @@
+/*
+ * imagecache.h: Declares the cache of preprocessed memory images
+ */
+
+#ifndef IMAGECACHE_H
+#define IMAGECACHE_H
+
+#include "LC4.h"
+
+// Image file layout, all little endian: a 32 byte header (magic, version,
+// range count, key) followed by ranges of memory. A range is its start
+// address and length, then the words; they are decoded again when loaded.
+#define IMAGE_MAGIC       "LC4IMAGE"
+#define IMAGE_VERSION     2
+#define IMAGE_HEADER_SIZE 32
+
+/*
+ * Load the object files, in order, into CPU, which must be freshly Reset.
+ * If cacheDir is not NULL the result is looked up in cacheDir under a hash
+ * of the files' contents: on a hit the stored image is copied into memory
+ * and decoded, and the object files are not parsed; on a miss they are
+ * loaded as usual and the image is stored for next time.
+ * Returns 0 on success, 1 if an object file could not be loaded.
+ */
+int LoadObjectFiles(char** filenames, int count, MachineState* CPU, const char* cacheDir);
+
+#endif
@@ -0,0 +1,666 @@
+/*
+ * jit.c: Defines the x86-64 basic block translator
+ *
+ * A block is a straight-line run of instructions starting at some PC, ending
+ * after the first branch, JMP or JSR, before any TRAP or RTI, before the halt
+ * PC, or after BLOCK_LIMIT instructions. Blocks are translated separately for
+ * user and OS privilege, which is what lets the per-step PC range check be done
+ * once at translation time. Translated code keeps all machine state in the
+ * MachineState (rbx points at it) except the value the last NZP-setting
+ * instruction produced, which lives in r12w until the block exits.
+ *
+ * A direct branch whose target has not been translated yet jumps to the exit
+ * stub; the jump is patched to go straight to the target once it exists.
+ * A store into a page holding translated code makes the block exit and the
+ * whole cache is flushed before the next block runs.
+ */
+
+#include "jit.h"
+#include <stddef.h>
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(LC4_PAGED_MEMORY)
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define CODE_SIZE     (16 << 20)
+#define BLOCK_LIMIT   64
+#define BLOCK_RESERVE (BLOCK_LIMIT * 256)   // worst case bytes for one block
+#define MAX_SITES     65536
+
+// Offsets into MachineState used by the generated code
+#define OFF_PC     ((int)offsetof(MachineState, PC))
+#define OFF_PSR    ((int)offsetof(MachineState, PSR))
+#define OFF_R(r)   ((int)offsetof(MachineState, R) + 2 * (r))
+#define OFF_COUNT  ((int)offsetof(MachineState, instrCount))
+#define OFF_MEMORY ((int)offsetof(MachineState, memory))
+#define OFF_DECODE ((int)offsetof(MachineState, decoded))
+
+// Stores clear decoded[addr].valid with a scaled index, so entries must be 8 bytes
+typedef char JitDecodedSizeCheck[sizeof(DecodedInsn) == 8 ? 1 : -1];
+
+// x86 condition codes for jcc rel32 (0F 80+cc)
+#define CC_B  0x2
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_L  0xC
+#define CC_GE 0xD
+#define CC_LE 0xE
+#define CC_G  0xF
+
+typedef void (*JitEntry)(MachineState* CPU, JitState* jit, unsigned char* code);
+
+// A jump at rel that should go to the block for (priv, target) once it exists
+typedef struct {
+    unsigned char* rel;
+    int next;               // next site waiting on the same block, 0 ends the list
+} ChainSite;
+
+struct JitState {
+    unsigned char* code;
+    size_t used;
+    size_t stubEnd;         // the entry and exit stubs are never flushed
+    JitEntry enter;
+    unsigned char* exitStub;
+    unsigned short int haltPC;
+
+    unsigned char flushPending;   // set by generated code when a store hits translated code
+    unsigned char stepPending;    // set by generated code when the next instruction must be interpreted
+    unsigned char codePages[256]; // 1 for every 256 word page holding translated code
+
+    unsigned char* blocks[2][65536];  // native entry by [privilege][PC]
+    int chainHead[2][65536];          // first ChainSite waiting on the block, 0 if none
+    ChainSite sites[MAX_SITES];       // sites[0] is unused
+    int siteCount;
+};
+
+#define OFF_FLUSH ((int)offsetof(JitState, flushPending))
+#define OFF_STEP  ((int)offsetof(JitState, stepPending))
+#define OFF_PAGES ((int)offsetof(JitState, codePages))
+
+
+//////////////// CODE EMISSION ///////////////////////////
+
+
+static void Emit1(JitState* jit, int b)
+{
+    jit->code[jit->used++] = (unsigned char)b;
+}
+
+static void Emit2(JitState* jit, int w)
+{
+    Emit1(jit, w & 0xFF);
+    Emit1(jit, (w >> 8) & 0xFF);
+}
+
+static void Emit4(JitState* jit, int d)
+{
+    Emit2(jit, d & 0xFFFF);
+    Emit2(jit, (d >> 16) & 0xFFFF);
+}
+
+static unsigned char* Here(JitState* jit)
+{
+    return jit->code + jit->used;
+}
+
+/*
+ * ModRM for [rbx + disp32] with the given reg field.
+ */
+static void EmitRbxDisp(JitState* jit, int reg, int disp)
+{
+    Emit1(jit, 0x80 | (reg << 3) | 3);
+    Emit4(jit, disp);
+}
+
+/*
+ * Point the rel32 at site to target.
+ */
+static void PatchRel32(unsigned char* site, unsigned char* target)
+{
+    int rel = (int)(target - (site + 4));
+    site[0] = rel & 0xFF;
+    site[1] = (rel >> 8) & 0xFF;
+    site[2] = (rel >> 16) & 0xFF;
+    site[3] = (rel >> 24) & 0xFF;
+}
+
+/*
+ * jcc rel32 with the target filled in later. Returns the rel32 to patch.
+ */
+static unsigned char* EmitJcc(JitState* jit, int cc)
+{
+    unsigned char* rel;
+    Emit1(jit, 0x0F);
+    Emit1(jit, 0x80 | cc);
+    rel = Here(jit);
+    Emit4(jit, 0);
+    return rel;
+}
+
+// movzx eax, word [R(r)]
+static void LoadReg(JitState* jit, int r)
+{
+    Emit1(jit, 0x0F); Emit1(jit, 0xB7); EmitRbxDisp(jit, 0, OFF_R(r));
+}
+
+// movzx ecx, word [R(r)]
+static void LoadRegEcx(JitState* jit, int r)
+{
+    Emit1(jit, 0x0F); Emit1(jit, 0xB7); EmitRbxDisp(jit, 1, OFF_R(r));
+}
+
+// mov word [R(r)], ax
+static void StoreReg(JitState* jit, int r)
+{
+    Emit1(jit, 0x66); Emit1(jit, 0x89); EmitRbxDisp(jit, 0, OFF_R(r));
+}
+
+// <op> ax, word [R(r)] for the 66 <op> /r forms (add 03, sub 2B, and 23, or 0B, xor 33, cmp 3B)
+static void AluReg(JitState* jit, int op, int r)
+{
+    Emit1(jit, 0x66); Emit1(jit, op); EmitRbxDisp(jit, 0, OFF_R(r));
+}
+
+// <op> ax, imm16 for the 66 <op> iw forms (add 05, sub 2D, and 25, cmp 3D)
+static void AluImm(JitState* jit, int op, int imm)
+{
+    Emit1(jit, 0x66); Emit1(jit, op); Emit2(jit, imm);
+}
+
+// mov r12d, eax: remember the value NZP is derived from
+static void SetNZPFromEax(JitState* jit)
+{
+    Emit1(jit, 0x41); Emit1(jit, 0x89); Emit1(jit, 0xC4);
+}
+
+// mov r12d, imm32
+static void SetNZPFromImm(JitState* jit, int imm)
+{
+    Emit1(jit, 0x41); Emit1(jit, 0xBC); Emit4(jit, imm);
+}
+
+// test r12w, r12w
+static void TestNZP(JitState* jit)
+{
+    Emit1(jit, 0x66); Emit1(jit, 0x45); Emit1(jit, 0x85); Emit1(jit, 0xE4);
+}
+
+/*
+ * Write the NZP bits for the value in r12w into the PSR (SetNZP).
+ */
+static void MaterializeNZP(JitState* jit)
+{
+    TestNZP(jit);
+    Emit1(jit, 0xB9); Emit4(jit, 1);                        // mov ecx, 1
+    Emit1(jit, 0xBA); Emit4(jit, 2);                        // mov edx, 2
+    Emit1(jit, 0x0F); Emit1(jit, 0x44); Emit1(jit, 0xCA);   // cmove ecx, edx
+    Emit1(jit, 0xBA); Emit4(jit, 4);                        // mov edx, 4
+    Emit1(jit, 0x0F); Emit1(jit, 0x4C); Emit1(jit, 0xCA);   // cmovl ecx, edx
+    Emit1(jit, 0x66); Emit1(jit, 0x83); EmitRbxDisp(jit, 4, OFF_PSR); Emit1(jit, 0xF8); // and word [PSR], ~7
+    Emit1(jit, 0x66); Emit1(jit, 0x09); EmitRbxDisp(jit, 1, OFF_PSR);                   // or word [PSR], cx
+}
+
+/*
+ * Leave the block: commit NZP and the instruction count, then go to the exit stub.
+ * If setPC is set the PC becomes pc, otherwise the caller already stored it.
+ * Returns the rel32 of the final jmp so it can be chained.
+ */
+static unsigned char* EmitExit(JitState* jit, int nzpPending, int count, int setPC, unsigned short int pc)
+{
+    unsigned char* rel;
+
+    if (nzpPending) {
+        MaterializeNZP(jit);
+    }
+    if (count > 0) {
+        Emit1(jit, 0x48); Emit1(jit, 0x81); EmitRbxDisp(jit, 0, OFF_COUNT); Emit4(jit, count); // add qword [count], imm32
+    }
+    if (setPC) {
+        Emit1(jit, 0x66); Emit1(jit, 0xC7); EmitRbxDisp(jit, 0, OFF_PC); Emit2(jit, pc);      // mov word [PC], imm16
+    }
+    Emit1(jit, 0xE9);
+    rel = Here(jit);
+    Emit4(jit, 0);
+    PatchRel32(rel, jit->exitStub);
+    return rel;
+}
+
+/*
+ * Exit to a known PC, chaining straight to its block when possible.
+ */
+static void EmitChainExit(JitState* jit, int priv, int nzpPending, int count, unsigned short int target)
+{
+    unsigned char* rel = EmitExit(jit, nzpPending, count, 1, target);
+
+    if (target == jit->haltPC) {
+        return; // the dispatcher has to see the halt PC
+    }
+    if (jit->blocks[priv][target] != NULL) {
+        PatchRel32(rel, jit->blocks[priv][target]);
+    } else if (jit->siteCount < MAX_SITES - 1) {
+        jit->siteCount++;
+        jit->sites[jit->siteCount].rel = rel;
+        jit->sites[jit->siteCount].next = jit->chainHead[priv][target];
+        jit->chainHead[priv][target] = jit->siteCount;
+    }
+}
+
+/*
+ * Compute R[s] + imm into eax and exit to the interpreter at pc if user code
+ * addresses OS memory, so the interpreter reports the error.
+ */
+static void EmitDataAddress(JitState* jit, DecodedInsn* insn, int priv, int nzpPending, int count, unsigned short int pc)
+{
+    unsigned char* ok;
+
+    LoadReg(jit, insn->s);
+    AluImm(jit, 0x05, (unsigned short int)insn->imm);       // add ax, imm
+    Emit1(jit, 0x0F); Emit1(jit, 0xB7); Emit1(jit, 0xC0);   // movzx eax, ax
+    if (priv == 0) {
+        AluImm(jit, 0x3D, 0x8000);                          // cmp ax, 0x8000
+        ok = EmitJcc(jit, CC_B);
+        Emit1(jit, 0x41); Emit1(jit, 0xC6); Emit1(jit, 0x85); Emit4(jit, OFF_STEP); Emit1(jit, 1); // mov byte [r13+step], 1
+        EmitExit(jit, nzpPending, count, 1, pc);
+        PatchRel32(ok, Here(jit));
+    }
+}
+
+
+//////////////// TRANSLATION ///////////////////////////
+
+
+/*
+ * Returns 1 if the PC may be executed at privilege priv (see InvalidPC in LC4.c).
+ */
+static int ValidPC(unsigned short int pc, int priv)
+{
+    if (pc >= 0x2000 && pc < 0x8000) {
+        return 0;
+    }
+    if (pc >= 0xA000) {
+        return 0;
+    }
+    return priv || pc < 0x8000;
+}
+
+/*
+ * Returns 1 for instructions a block can contain.
+ */
+static int Translatable(DecodedInsn* insn)
+{
+    switch (insn->opcode) {
+    case OP_BR: case OP_ARITH: case OP_CMP: case OP_JSR: case OP_LOGIC:
+    case OP_LDR: case OP_STR: case OP_CONST: case OP_SHIFT: case OP_JMP:
+        return 1;
+    case OP_HICONST:
+        return insn->sub == 1;
+    }
+    return 0; // TRAP, RTI and the unused opcodes
+}
+
+/*
+ * Emit a conditional branch on the NZP mask, then both exits.
+ */
+static void EmitBranch(JitState* jit, DecodedInsn* insn, int priv, int nzpPending, int count, unsigned short int pc)
+{
+    static const int pendingCC[8] = { 0, CC_G, CC_E, CC_GE, CC_L, CC_NE, CC_LE, 0 };
+    unsigned short int target = pc + 1 + insn->imm;
+    unsigned char* taken;
+
+    if (insn->sub == 7 && nzpPending) { // a pending result always sets one of the bits
+        EmitChainExit(jit, priv, nzpPending, count, target);
+        return;
+    }
+    if (nzpPending) {
+        TestNZP(jit);
+        taken = EmitJcc(jit, pendingCC[insn->sub]);
+    } else {
+        Emit1(jit, 0xF6); EmitRbxDisp(jit, 0, OFF_PSR); Emit1(jit, insn->sub); // test byte [PSR], nzp
+        taken = EmitJcc(jit, CC_NE);
+    }
+    EmitChainExit(jit, priv, nzpPending, count, pc + 1);
+    PatchRel32(taken, Here(jit));
+    EmitChainExit(jit, priv, nzpPending, count, target);
+}
+
+/*
+ * Translate the block starting at the current PC. Returns NULL if its first
+ * instruction has to run in the interpreter.
+ */
+static unsigned char* Translate(JitState* jit, MachineState* CPU)
+{
+    int priv = CPU->PSR >> 15;
+    unsigned short int start = CPU->PC;
+    unsigned short int pc = start;
+    unsigned char* entry;
+    unsigned char* done;
+    DecodedInsn* insn;
+    int nzpPending = 0;
+    int count = 0;
+    int site;
+
+    if (!CPU->decoded[pc].valid) {
+        DecodeInstruction(CPU, pc);
+    }
+    if (!ValidPC(pc, priv) || !Translatable(&CPU->decoded[pc])) {
+        return NULL;
+    }
+
+    if (jit->used + BLOCK_RESERVE > CODE_SIZE || jit->siteCount + 4 > MAX_SITES) {
+        JitFlush(jit);
+    }
+
+    // Register the entry first so branches back to the start chain to it
+    entry = Here(jit);
+    jit->blocks[priv][start] = entry;
+    for (site = jit->chainHead[priv][start]; site != 0; site = jit->sites[site].next) {
+        PatchRel32(jit->sites[site].rel, entry);
+    }
+    jit->chainHead[priv][start] = 0;
+
+    for (;;) {
+        if (count > 0 && (pc == jit->haltPC || !ValidPC(pc, priv) || count == BLOCK_LIMIT)) {
+            EmitChainExit(jit, priv, nzpPending, count, pc);
+            break;
+        }
+        if (!CPU->decoded[pc].valid) {
+            DecodeInstruction(CPU, pc);
+        }
+        insn = &CPU->decoded[pc];
+        if (!Translatable(insn)) {
+            EmitChainExit(jit, priv, nzpPending, count, pc);
+            break;
+        }
+        jit->codePages[pc >> 8] = 1;
+
+        switch (insn->opcode) {
+        case OP_BR:
+            if (insn->sub == 0) { // NOP
+                count++;
+                pc++;
+                continue;
+            }
+            EmitBranch(jit, insn, priv, nzpPending, count + 1, pc);
+            return entry;
+
+        case OP_ARITH:
+            LoadReg(jit, insn->s);
+            if (insn->sub == 0) {
+                AluReg(jit, 0x03, insn->t);
+            } else if (insn->sub == 1) {
+                Emit1(jit, 0x66); Emit1(jit, 0x0F); Emit1(jit, 0xAF); EmitRbxDisp(jit, 0, OFF_R(insn->t)); // imul ax, [Rt]
+            } else if (insn->sub == 2) {
+                AluReg(jit, 0x2B, insn->t);
+            } else if (insn->sub == 3) {
+                LoadRegEcx(jit, insn->t);
+                Emit1(jit, 0x31); Emit1(jit, 0xD2);             // xor edx, edx
+                Emit1(jit, 0xF7); Emit1(jit, 0xF1);             // div ecx
+            } else {
+                AluImm(jit, 0x05, (unsigned short int)insn->imm);
+            }
+            StoreReg(jit, insn->d);
+            SetNZPFromEax(jit);
+            nzpPending = 1;
+            break;
+
+        case OP_CMP:
+            LoadReg(jit, insn->s);
+            if (insn->sub == 0) {        // CMP: the wrapped 16 bit difference
+                AluReg(jit, 0x2B, insn->t);
+                SetNZPFromEax(jit);
+            } else if (insn->sub == 2) { // CMPI
+                AluImm(jit, 0x2D, (unsigned short int)insn->imm);
+                SetNZPFromEax(jit);
+            } else {                     // CMPU, CMPIU: -1, 0 or 1
+                if (insn->sub == 1) {
+                    AluReg(jit, 0x3B, insn->t);
+                } else {
+                    AluImm(jit, 0x3D, insn->imm);
+                }
+                Emit1(jit, 0x0F); Emit1(jit, 0x97); Emit1(jit, 0xC1);   // seta cl
+                Emit1(jit, 0x0F); Emit1(jit, 0x92); Emit1(jit, 0xC2);   // setb dl
+                Emit1(jit, 0x0F); Emit1(jit, 0xB6); Emit1(jit, 0xC9);   // movzx ecx, cl
+                Emit1(jit, 0x0F); Emit1(jit, 0xB6); Emit1(jit, 0xD2);   // movzx edx, dl
+                Emit1(jit, 0x29); Emit1(jit, 0xD1);                     // sub ecx, edx
+                Emit1(jit, 0x41); Emit1(jit, 0x89); Emit1(jit, 0xCC);   // mov r12d, ecx
+            }
+            nzpPending = 1;
+            break;
+
+        case OP_LOGIC:
+            LoadReg(jit, insn->s);
+            if (insn->sub == 0) {
+                AluReg(jit, 0x23, insn->t);
+            } else if (insn->sub == 1) {
+                Emit1(jit, 0xF7); Emit1(jit, 0xD0);             // not eax
+            } else if (insn->sub == 2) {
+                AluReg(jit, 0x0B, insn->t);
+            } else if (insn->sub == 3) {
+                AluReg(jit, 0x33, insn->t);
+            } else {
+                AluImm(jit, 0x25, insn->imm);
+            }
+            StoreReg(jit, insn->d);
+            SetNZPFromEax(jit);
+            nzpPending = 1;
+            break;
+
+        case OP_SHIFT:
+            LoadReg(jit, insn->s);
+            if (insn->sub == 0) {
+                Emit1(jit, 0x66); Emit1(jit, 0xC1); Emit1(jit, 0xE0); Emit1(jit, insn->imm); // shl ax, imm
+            } else if (insn->sub == 1) {
+                Emit1(jit, 0x66); Emit1(jit, 0xC1); Emit1(jit, 0xF8); Emit1(jit, insn->imm); // sar ax, imm
+            } else if (insn->sub == 2) {
+                Emit1(jit, 0x66); Emit1(jit, 0xC1); Emit1(jit, 0xE8); Emit1(jit, insn->imm); // shr ax, imm
+            } else {
+                LoadRegEcx(jit, insn->t);
+                Emit1(jit, 0x31); Emit1(jit, 0xD2);             // xor edx, edx
+                Emit1(jit, 0xF7); Emit1(jit, 0xF1);             // div ecx
+                Emit1(jit, 0x89); Emit1(jit, 0xD0);             // mov eax, edx
+            }
+            StoreReg(jit, insn->d);
+            SetNZPFromEax(jit);
+            nzpPending = 1;
+            break;
+
+        case OP_LDR:
+            EmitDataAddress(jit, insn, priv, nzpPending, count, pc);
+            Emit1(jit, 0x0F); Emit1(jit, 0xB7); Emit1(jit, 0x8C); Emit1(jit, 0x43); Emit4(jit, OFF_MEMORY); // movzx ecx, word [rbx+rax*2+memory]
+            Emit1(jit, 0x66); Emit1(jit, 0x89); EmitRbxDisp(jit, 1, OFF_R(insn->d));                      // mov [Rd], cx
+            Emit1(jit, 0x41); Emit1(jit, 0x89); Emit1(jit, 0xCC);                                         // mov r12d, ecx
+            nzpPending = 1;
+            break;
+
+        case OP_STR:
+            EmitDataAddress(jit, insn, priv, nzpPending, count, pc);
+            LoadRegEcx(jit, insn->d);
+            Emit1(jit, 0x66); Emit1(jit, 0x89); Emit1(jit, 0x8C); Emit1(jit, 0x43); Emit4(jit, OFF_MEMORY); // mov word [rbx+rax*2+memory], cx
+            Emit1(jit, 0xC6); Emit1(jit, 0x84); Emit1(jit, 0xC3); Emit4(jit, OFF_DECODE); Emit1(jit, 0);    // mov byte [rbx+rax*8+decoded], 0
+            Emit1(jit, 0x89); Emit1(jit, 0xC1);                                                           // mov ecx, eax
+            Emit1(jit, 0xC1); Emit1(jit, 0xE9); Emit1(jit, 0x08);                                         // shr ecx, 8
+            Emit1(jit, 0x41); Emit1(jit, 0x80); Emit1(jit, 0xBC); Emit1(jit, 0x0D); Emit4(jit, OFF_PAGES); Emit1(jit, 0); // cmp byte [r13+rcx+pages], 0
+            done = EmitJcc(jit, CC_E);
+            Emit1(jit, 0x41); Emit1(jit, 0xC6); Emit1(jit, 0x85); Emit4(jit, OFF_FLUSH); Emit1(jit, 1);  // mov byte [r13+flush], 1
+            EmitExit(jit, nzpPending, count + 1, 1, pc + 1);
+            PatchRel32(done, Here(jit));
+            break;
+
+        case OP_CONST:
+            Emit1(jit, 0x66); Emit1(jit, 0xC7); EmitRbxDisp(jit, 0, OFF_R(insn->d)); Emit2(jit, (unsigned short int)insn->imm);
+            SetNZPFromImm(jit, (unsigned short int)insn->imm);
+            nzpPending = 1;
+            break;
+
+        case OP_HICONST:
+            LoadReg(jit, insn->d);
+            Emit1(jit, 0x25); Emit4(jit, 0xFF);                 // and eax, 0xFF
+            Emit1(jit, 0x0D); Emit4(jit, insn->imm << 8);       // or eax, imm << 8
+            StoreReg(jit, insn->d);
+            SetNZPFromEax(jit);
+            nzpPending = 1;
+            break;
+
+        case OP_JSR:
+            // R7 is written before Rs is read, so JSRR R7 jumps to PC + 1
+            Emit1(jit, 0x66); Emit1(jit, 0xC7); EmitRbxDisp(jit, 0, OFF_R(7)); Emit2(jit, (unsigned short int)(pc + 1));
+            SetNZPFromImm(jit, (unsigned short int)(pc + 1));
+            if (insn->sub == 1) {
+                EmitChainExit(jit, priv, 1, count + 1, (unsigned short int)((pc & 0x8000) | (insn->imm << 4)));
+            } else {
+                LoadReg(jit, insn->s);
+                Emit1(jit, 0x66); Emit1(jit, 0x89); EmitRbxDisp(jit, 0, OFF_PC); // mov [PC], ax
+                EmitExit(jit, 1, count + 1, 0, 0);
+            }
+            return entry;
+
+        case OP_JMP:
+            if (insn->sub == 1) {
+                EmitChainExit(jit, priv, nzpPending, count + 1, pc + 1 + insn->imm);
+            } else {
+                LoadReg(jit, insn->s);
+                Emit1(jit, 0x66); Emit1(jit, 0x89); EmitRbxDisp(jit, 0, OFF_PC); // mov [PC], ax
+                EmitExit(jit, nzpPending, count + 1, 0, 0);
+            }
+            return entry;
+        }
+
+        count++;
+        pc++;
+    }
+    return entry;
+}
+
+
+//////////////// PUBLIC INTERFACE ///////////////////////////
+
+
+/*
+ * Allocate a translator and its executable code cache.
+ */
+JitState* JitCreate(void)
+{
+    JitState* jit = calloc(1, sizeof(JitState));
+
+    if (jit == NULL) {
+        return NULL;
+    }
+    jit->code = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        free(jit);
+        return NULL;
+    }
+
+    // enter(CPU, jit, code): save callee-saved registers, rbx = CPU, r13 = jit, jump to code
+    jit->enter = (JitEntry)Here(jit);
+    Emit1(jit, 0x53);                                   // push rbx
+    Emit1(jit, 0x55);                                   // push rbp
+    Emit1(jit, 0x41); Emit1(jit, 0x54);                 // push r12
+    Emit1(jit, 0x41); Emit1(jit, 0x55);                 // push r13
+    Emit1(jit, 0x41); Emit1(jit, 0x56);                 // push r14
+    Emit1(jit, 0x41); Emit1(jit, 0x57);                 // push r15
+    Emit1(jit, 0x48); Emit1(jit, 0x89); Emit1(jit, 0xFB); // mov rbx, rdi
+    Emit1(jit, 0x49); Emit1(jit, 0x89); Emit1(jit, 0xF5); // mov r13, rsi
+    Emit1(jit, 0xFF); Emit1(jit, 0xE2);                 // jmp rdx
+
+    jit->exitStub = Here(jit);
+    Emit1(jit, 0x41); Emit1(jit, 0x5F);                 // pop r15
+    Emit1(jit, 0x41); Emit1(jit, 0x5E);                 // pop r14
+    Emit1(jit, 0x41); Emit1(jit, 0x5D);                 // pop r13
+    Emit1(jit, 0x41); Emit1(jit, 0x5C);                 // pop r12
+    Emit1(jit, 0x5D);                                   // pop rbp
+    Emit1(jit, 0x5B);                                   // pop rbx
+    Emit1(jit, 0xC3);                                   // ret
+
+    jit->stubEnd = jit->used;
+    return jit;
+}
+
+
+/*
+ * Free the translator and its code cache.
+ */
+void JitDestroy(JitState* jit)
+{
+    munmap(jit->code, CODE_SIZE);
+    free(jit);
+}
+
+
+/*
+ * Drop every translation.
+ */
+void JitFlush(JitState* jit)
+{
+    jit->used = jit->stubEnd;
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+    memset(jit->chainHead, 0, sizeof(jit->chainHead));
+    memset(jit->codePages, 0, sizeof(jit->codePages));
+    jit->siteCount = 0;
+    jit->flushPending = 0;
+    jit->stepPending = 0;
+}
+
+
+/*
+ * Execute instructions until the PC reaches haltPC.
+ */
+int JitRun(JitState* jit, MachineState* CPU, unsigned short int haltPC)
+{
+    unsigned char* entry;
+
+    if (jit->haltPC != haltPC) { // blocks are cut at the halt PC they were translated for
+        JitFlush(jit);
+        jit->haltPC = haltPC;
+    }
+
+    while (CPU->PC != haltPC) {
+        if (jit->flushPending) {
+            JitFlush(jit);
+        }
+        entry = NULL;
+        if (jit->stepPending) {
+            jit->stepPending = 0;
+        } else {
+            entry = jit->blocks[CPU->PSR >> 15][CPU->PC];
+            if (entry == NULL) {
+                entry = Translate(jit, CPU);
+            }
+        }
+        if (entry == NULL) {
+            // TRAP, RTI, unused opcodes, invalid PCs and faulting loads and stores run in the interpreter
+            if (UpdateMachineState(CPU, NULL) == 1) {
+                return 1;
+            }
+            CPU->instrCount++;
+            continue;
+        }
+        jit->enter(CPU, jit, entry);
+    }
+    return 0;
+}
+
+#else
+
+JitState* JitCreate(void)
+{
+    return NULL;
+}
+
+void JitDestroy(JitState* jit)
+{
+}
+
+void JitFlush(JitState* jit)
+{
+}
+
+int JitRun(JitState* jit, MachineState* CPU, unsigned short int haltPC)
+{
+    return RunMachine(CPU, NULL, haltPC);
+}
+
+#endif
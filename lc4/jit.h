@@ -0,0 +1,43 @@
+/*
+ * jit.h: Declares the x86-64 basic block translator
+ */
+
+#ifndef JIT_H
+#define JIT_H
+
+#include "LC4.h"
+
+typedef struct JitState JitState;
+
+/*
+ * Allocate a translator and its executable code cache. Returns NULL when the
+ * host is not x86-64 Linux, memory is paged (LC4_PAGED_MEMORY) or executable
+ * memory cannot be mapped; callers then run the interpreter instead.
+ */
+JitState* JitCreate(void);
+
+
+/*
+ * Free the translator and its code cache.
+ */
+void JitDestroy(JitState* jit);
+
+
+/*
+ * Drop every translation, e.g. after memory was changed behind the translator's back.
+ */
+void JitFlush(JitState* jit);
+
+
+/*
+ * Execute instructions until the PC reaches haltPC, like RunMachine without a
+ * trace. Basic blocks are translated to native code on first use; TRAP, RTI and
+ * faulting instructions run in the interpreter so errors are reported exactly
+ * as before. Registers, PSR, PC, memory and instrCount match the interpreter;
+ * the trace-only fields (control signals, regInputVal, NZPVal, dmemAddr,
+ * dmemValue) are only updated by instructions that run in the interpreter.
+ * Returns 1 if an error occurred.
+ */
+int JitRun(JitState* jit, MachineState* CPU, unsigned short int haltPC);
+
+#endif
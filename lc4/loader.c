@@ -6,47 +6,215 @@
 #include "loader.h"
 #include <string.h>
 
-// memory array location
-unsigned short memoryAddress;
+#if defined(__unix__) || defined(__APPLE__)
+#define LOADER_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Section headers
+#define SECTION_CODE   0xCADE
+#define SECTION_DATA   0xDADA
+#define SECTION_SYMBOL 0xC3B7
+#define SECTION_FILE   0xF17E
+#define SECTION_LINE   0x715E
+
+/*
+ * Read the big endian word at p.
+ */
+static unsigned short int GetWord(const unsigned char* p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+/*
+ * Store n big endian words from src into dest in host order.
+ */
+static void SwapWords(unsigned short int* dest, const unsigned char* src, int n)
+{
+  int i = 0;
+
+#ifdef __SSE2__
+  for (; i + 8 <= n; i += 8) { // 8 words at a time: swap the bytes of each 16 bit lane
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + 2 * i));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    _mm_storeu_si128((__m128i*)(dest + i), v);
+  }
+#endif
+  for (; i < n; i++) {
+    dest[i] = GetWord(src + 2 * i);
+  }
+}
+
+/*
+ * Copy a code or data section body into memory. Code is decoded right away;
+ * data words are only marked as not decoded.
+ */
+static void LoadSection(MachineState* CPU, int code, unsigned short int address, const unsigned char* body, int n)
+{
+  unsigned short int* dest;
+  int count;
+  int i;
+
+  while (n > 0) {
+    dest = WritableRange(CPU, address, &count);
+    if (count > n) {
+      count = n;
+    }
+    SwapWords(dest, body, count);
+    for (i = 0; i < count; i++) {
+      if (code) {
+        DecodeInstruction(CPU, address + i);
+      } else {
+        DecodedAt(CPU, address + i)->valid = 0;
+      }
+    }
+    address += count;
+    body += 2 * count;
+    n -= count;
+  }
+}
+
+/*
+ * Map (or, without mmap, read) the whole file.
+ */
+const unsigned char* MapFile(const char* filename, size_t* size)
+{
+  static const unsigned char empty[1];
+  unsigned char* data;
+#ifdef LOADER_MMAP
+  struct stat info;
+  int fd = open(filename, O_RDONLY);
+
+  if (fd < 0) {
+    return NULL;
+  }
+  if (fstat(fd, &info) != 0) {
+    close(fd);
+    return NULL;
+  }
+  *size = info.st_size;
+  if (*size == 0) {
+    close(fd);
+    return empty;
+  }
+  data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  return data == MAP_FAILED ? NULL : data;
+#else
+  FILE* file = fopen(filename, "rb");
+  long length;
+
+  if (file == NULL) {
+    return NULL;
+  }
+  fseek(file, 0, SEEK_END);
+  length = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  *size = length > 0 ? length : 0;
+  if (*size == 0) {
+    fclose(file);
+    return empty;
+  }
+  data = malloc(*size);
+  if (data != NULL && fread(data, 1, *size, file) != *size) {
+    free(data);
+    data = NULL;
+  }
+  fclose(file);
+  return data;
+#endif
+}
+
+/*
+ * Release a file mapped by MapFile.
+ */
+void UnmapFile(const unsigned char* data, size_t size)
+{
+  if (size == 0) {
+    return;
+  }
+#ifdef LOADER_MMAP
+  munmap((void*)data, size);
+#else
+  free((void*)data);
+#endif
+}
 
 /*
  * Read an object file and modify the machine state as described in the writeup
  */
 int ReadObjectFile(char* filename, MachineState* CPU) {
-  FILE *my_file;
+  return ReadObjectFileWithSymbols(filename, CPU, NULL, NULL);
+}
+
+/*
+ * Read an object file into CPU, passing each symbol to symbol if not NULL
+ */
+int ReadObjectFileWithSymbols(char* filename, MachineState* CPU, SymbolCallback symbol, void* context) {
+  const unsigned char* data;
+  size_t size;
+  size_t pos = 0;
+  size_t length;
+  unsigned short int type;
+  unsigned short int address;
   unsigned short int n;
-  unsigned short int hex [1];
-  
-  my_file = fopen(filename, "rb");
-  if (my_file == NULL) { // return error if invalid file name
+  int status = 0;
+
+  data = MapFile(filename, &size);
+  if (data == NULL) { // return error if invalid file name
     printf("error: ReadObjectFile() failed\n");
     return 1;
   }
 
-  while (fread(hex, sizeof(unsigned short int), 1, my_file)) {
-    if (hex[0] == 0xDECA) { // check if word is header
-      fread(hex, sizeof(unsigned short int), 1, my_file);
-      memoryAddress = (hex[0]>>8) | (hex[0]<<8); // get memory address
-      fread(hex, sizeof(unsigned short int), 1, my_file);
-      n = (hex[0]>>8) | (hex[0]<<8); // get n-word body
-      while (n > 0) { // write instructions in memory
-        fread(hex, sizeof(unsigned short int), 1, my_file);
-        CPU->memory[memoryAddress] = (hex[0]>>8) | (hex[0]<<8);
-        memoryAddress++;
-        n--;
+  // Each section is a header word, its fields and a body
+  while (pos < size && status == 0) {
+    if (size - pos < 2) {
+      printf("error: %s: stray byte at offset %lu\n", filename, (unsigned long)pos);
+      status = 1;
+      break;
+    }
+    type = GetWord(data + pos);
+    if (type == SECTION_CODE || type == SECTION_DATA || type == SECTION_SYMBOL) {
+      if (size - pos < 6) {
+        length = 6;
+      } else {
+        address = GetWord(data + pos + 2);
+        n = GetWord(data + pos + 4);
+        length = 6 + (type == SECTION_SYMBOL ? n : 2 * (size_t)n); // symbol names are n bytes
       }
-    } else if (hex[0] == 0xDADA) { // check if word is header
-      fread(hex, sizeof(unsigned short int), 1, my_file);
-      memoryAddress = (hex[0]>>8) | (hex[0]<<8); // get memory address
-      fread(hex, sizeof(unsigned short int), 1, my_file);
-      n = (hex[0]>>8) | (hex[0]<<8); // get n-word body
-      while (n > 0) { // write instructions in memory
-        fread(hex, sizeof(unsigned short int), 1, my_file);
-        CPU->memory[memoryAddress] = (hex[0]>>8) | (hex[0]<<8);
-        memoryAddress++;
-        n--;
+    } else if (type == SECTION_FILE) {
+      length = size - pos < 4 ? 4 : 4 + (size_t)GetWord(data + pos + 2);
+    } else if (type == SECTION_LINE) {
+      length = 8;
+    } else {
+      printf("error: %s: unknown section %04X at offset %lu\n", filename, type, (unsigned long)pos);
+      status = 1;
+      break;
+    }
+
+    if (length > size - pos) {
+      printf("error: %s: section at offset %lu is truncated\n", filename, (unsigned long)pos);
+      status = 1;
+    } else if (type == SECTION_CODE || type == SECTION_DATA) {
+      if (address + n > 65536) {
+        printf("error: %s: section at offset %lu runs past address FFFF\n", filename, (unsigned long)pos);
+        status = 1;
+      } else {
+        LoadSection(CPU, type == SECTION_CODE, address, data + pos + 6, n);
       }
-    } 
+    } else if (type == SECTION_SYMBOL && symbol != NULL) {
+      symbol(context, (const char*)data + pos + 6, n, address);
+    }
+    pos += length;
   }
-  return 0;
+
+  UnmapFile(data, size);
+  return status;
 }
@@ -5,5 +5,25 @@
 #include <stdio.h>
 #include "LC4.h"
 
-// Read an object file and modify the machine state as described in the writeup
-int ReadObjectFile(char* filename, MachineState* CPU);
\ No newline at end of file
+// Read an object file and modify the machine state as described in the writeup.
+// Returns 1 if the file can't be read or a section is truncated, runs past
+// address FFFF or has an unknown header.
+int ReadObjectFile(char* filename, MachineState* CPU);
+
+
+// Called with each symbol of an object file; name is length bytes and not
+// NUL terminated.
+typedef void (*SymbolCallback)(void* context, const char* name, int length, unsigned short int address);
+
+
+// ReadObjectFile that also passes every symbol section to symbol.
+int ReadObjectFileWithSymbols(char* filename, MachineState* CPU, SymbolCallback symbol, void* context);
+
+
+// Map (or, without mmap, read) the whole file read-only. Returns NULL on
+// failure; an empty file gives a non-NULL pointer and a size of 0.
+const unsigned char* MapFile(const char* filename, size_t* size);
+
+
+// Release a file mapped by MapFile.
+void UnmapFile(const unsigned char* data, size_t size);
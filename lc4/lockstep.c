@@ -0,0 +1,507 @@
+/*
+ * lockstep.c: Defines the lockstep engine that runs up to 16 machines on one
+ * instruction stream
+ *
+ * The machine is a structure of arrays: every register, the PC, the PSR and
+ * every memory word is a Lanes vector with one 16 bit element per lane, so
+ * memory[addr] holds the word at addr of all 16 machines. A step picks the
+ * lowest PC of the running lanes and runs that instruction for the group of
+ * lanes at it, with every write blended in under the group's mask. Lanes at a
+ * higher PC wait for the others, which is where lanes that took different
+ * branch directions meet again.
+ *
+ * Lanes is a 32 byte GCC/clang vector, the width of an AVX2 register. The
+ * run loop is cloned for AVX2 and the baseline ISA where the toolchain can
+ * pick between them at load time; elsewhere the compiler lowers the same
+ * vector code to whatever the target has.
+ */
+
+#include "lockstep.h"
+#include <string.h>
+
+#if defined(__GNUC__) && !defined(__clang__)
+// Every function taking or returning Lanes is inlined, so no call passes one
+// with the baseline ABI
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+
+typedef unsigned short int Lanes __attribute__((vector_size(2 * LOCKSTEP_LANES)));
+typedef short int SignedLanes __attribute__((vector_size(2 * LOCKSTEP_LANES)));
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__linux__) && \
+    (defined(__clang__) ? __clang_major__ >= 14 : __GNUC__ >= 6)
+#define LOCKSTEP_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define LOCKSTEP_CLONES
+#endif
+
+// Helpers are forced inline so the AVX2 clone of the run loop compiles them for AVX2 too
+#define LANE_INLINE static inline __attribute__((always_inline))
+
+// Bit i set in lane i
+static const Lanes LaneBits = {
+    0x0001, 0x0002, 0x0004, 0x0008, 0x0010, 0x0020, 0x0040, 0x0080,
+    0x0100, 0x0200, 0x0400, 0x0800, 0x1000, 0x2000, 0x4000, 0x8000
+};
+
+struct LockstepMachine {
+    Lanes memory[65536];                    // memory[addr][lane]
+    Lanes R[8];
+    Lanes PC;
+    Lanes PSR;
+    unsigned long long instrCount[LOCKSTEP_LANES];
+    unsigned int loaded;                    // bit per lane holding a machine
+
+    // Decoded form of decodedWord[addr], the word last run at addr
+    DecodedInsn decoded[65536];
+    unsigned short int decodedWord[65536];
+};
+
+
+LANE_INLINE Lanes Splat(unsigned short int value)
+{
+    Lanes v = { 0 };
+    return v + value;
+}
+
+// a where mask is set, b elsewhere
+LANE_INLINE Lanes Select(Lanes mask, Lanes a, Lanes b)
+{
+    return (a & mask) | (b & ~mask);
+}
+
+// Mask with the lanes in bits set
+LANE_INLINE Lanes MaskOf(unsigned int bits)
+{
+    return (Lanes)((Splat(bits) & LaneBits) != Splat(0));
+}
+
+// Bit per lane of a mask: each lane contributes a distinct bit, so OR-ing the
+// four 64 bit quarters and folding the result collects them
+LANE_INLINE unsigned int BitsOf(Lanes mask)
+{
+    unsigned long long quarters[4];
+    unsigned long long bits;
+
+    mask &= LaneBits;
+    memcpy(quarters, &mask, sizeof(quarters));
+    bits = quarters[0] | quarters[1] | quarters[2] | quarters[3];
+    bits |= bits >> 32;
+    return (bits | bits >> 16) & 0xFFFF;
+}
+
+
+/*
+ * Set the NZP bits of the masked lanes from the signed value of result.
+ */
+LANE_INLINE void SetLaneNZP(LockstepMachine* machine, Lanes mask, Lanes result)
+{
+    SignedLanes value = (SignedLanes)result;
+    Lanes nzp = Select((Lanes)(value > (SignedLanes)Splat(0)), Splat(1),
+                       Select((Lanes)(value == (SignedLanes)Splat(0)), Splat(2), Splat(4)));
+
+    machine->PSR = Select(mask, (machine->PSR & Splat(0xFFF8)) | nzp, machine->PSR);
+}
+
+
+/*
+ * Set the NZP bits of the masked lanes from an unsigned comparison of a and b.
+ */
+LANE_INLINE void SetLaneNZPUnsigned(LockstepMachine* machine, Lanes mask, Lanes a, Lanes b)
+{
+    Lanes nzp = Select((Lanes)(a > b), Splat(1), Select((Lanes)(a == b), Splat(2), Splat(4)));
+
+    machine->PSR = Select(mask, (machine->PSR & Splat(0xFFF8)) | nzp, machine->PSR);
+}
+
+
+/*
+ * Write value to R[d] of the masked lanes and set their NZP bits from it.
+ */
+LANE_INLINE void WriteRegister(LockstepMachine* machine, Lanes mask, int d, Lanes value)
+{
+    machine->R[d] = Select(mask, value, machine->R[d]);
+    SetLaneNZP(machine, mask, value);
+}
+
+
+/*
+ * R[s] / R[t] (or % for mod) of the lanes in group; there is no vector divide.
+ */
+LANE_INLINE Lanes DivideLanes(LockstepMachine* machine, unsigned int group, DecodedInsn* insn, int mod)
+{
+    Lanes result = machine->R[insn->d];
+    int lane;
+
+    for (; group != 0; group &= group - 1) {
+        lane = __builtin_ctz(group);
+        if (mod) {
+            result[lane] = machine->R[insn->s][lane] % machine->R[insn->t][lane];
+        } else {
+            result[lane] = machine->R[insn->s][lane] / machine->R[insn->t][lane];
+        }
+    }
+    return result;
+}
+
+
+/*
+ * Lanes of group where user code touches OS memory at addr.
+ */
+LANE_INLINE unsigned int AccessFaults(LockstepMachine* machine, unsigned int group, Lanes addr)
+{
+    return group & BitsOf((Lanes)(machine->PSR < Splat(0x8000)) & (Lanes)(addr >= Splat(0x8000)));
+}
+
+
+/*
+ * Run the LDR or STR insn for the lanes in group. When they all use the same
+ * address that is a single vector access to memory[addr].
+ * Returns the lanes that faulted, which are left untouched.
+ */
+LANE_INLINE unsigned int MemoryOp(LockstepMachine* machine, unsigned int group, DecodedInsn* insn, unsigned short int pc)
+{
+    Lanes addr = machine->R[insn->s] + Splat(insn->imm);
+    unsigned int faults = AccessFaults(machine, group, addr);
+    unsigned short int first;
+    Lanes mask;
+    Lanes value;
+    int lane;
+    unsigned int bits;
+
+    group &= ~faults;
+    if (group == 0) {
+        return faults;
+    }
+    mask = MaskOf(group);
+    first = addr[__builtin_ctz(group)];
+
+    if ((BitsOf((Lanes)(addr == Splat(first))) & group) == group) {
+        if (insn->opcode == OP_LDR) {
+            WriteRegister(machine, mask, insn->d, machine->memory[first]);
+        } else {
+            machine->memory[first] = Select(mask, machine->R[insn->d], machine->memory[first]);
+        }
+    } else if (insn->opcode == OP_LDR) {
+        value = machine->R[insn->d];
+        for (bits = group; bits != 0; bits &= bits - 1) {
+            lane = __builtin_ctz(bits);
+            value[lane] = machine->memory[addr[lane]][lane];
+        }
+        WriteRegister(machine, mask, insn->d, value);
+    } else {
+        for (bits = group; bits != 0; bits &= bits - 1) {
+            lane = __builtin_ctz(bits);
+            machine->memory[addr[lane]][lane] = machine->R[insn->d][lane];
+        }
+    }
+    machine->PC = Select(mask, Splat(pc + 1), machine->PC);
+    return faults;
+}
+
+
+/*
+ * Run insn, the instruction at pc, for the lanes in group.
+ * Returns the lanes that faulted.
+ */
+LANE_INLINE unsigned int Execute(LockstepMachine* machine, unsigned int group, DecodedInsn* insn, unsigned short int pc)
+{
+    Lanes mask = MaskOf(group);
+    Lanes* R = machine->R;
+    Lanes imm = Splat(insn->imm);
+    Lanes next = Splat(pc + 1);
+    Lanes value;
+
+    switch (insn->opcode) {
+    case OP_BR:
+        value = (Lanes)((machine->PSR & Splat(insn->sub)) != Splat(0));
+        machine->PC = Select(mask, Select(value, Splat(pc + 1 + insn->imm), next), machine->PC);
+        return 0;
+    case OP_ARITH:
+        switch (insn->sub) {
+        case 0:  value = R[insn->s] + R[insn->t]; break;
+        case 1:  value = R[insn->s] * R[insn->t]; break;
+        case 2:  value = R[insn->s] - R[insn->t]; break;
+        case 3:  value = DivideLanes(machine, group, insn, 0); break;
+        default: value = R[insn->s] + imm; break;
+        }
+        WriteRegister(machine, mask, insn->d, value);
+        break;
+    case OP_CMP:
+        switch (insn->sub) {
+        case 0:  SetLaneNZP(machine, mask, R[insn->s] - R[insn->t]); break;
+        case 1:  SetLaneNZPUnsigned(machine, mask, R[insn->s], R[insn->t]); break;
+        case 2:  SetLaneNZP(machine, mask, R[insn->s] - imm); break;
+        default: SetLaneNZPUnsigned(machine, mask, R[insn->s], imm); break;
+        }
+        break;
+    case OP_LOGIC:
+        switch (insn->sub) {
+        case 0:  value = R[insn->s] & R[insn->t]; break;
+        case 1:  value = ~R[insn->s]; break;
+        case 2:  value = R[insn->s] | R[insn->t]; break;
+        case 3:  value = R[insn->s] ^ R[insn->t]; break;
+        default: value = R[insn->s] & imm; break;
+        }
+        WriteRegister(machine, mask, insn->d, value);
+        break;
+    case OP_SHIFT:
+        switch (insn->sub) {
+        case 0:  value = R[insn->s] << insn->imm; break;
+        case 1:  value = (Lanes)((SignedLanes)R[insn->s] >> insn->imm); break;
+        case 2:  value = R[insn->s] >> insn->imm; break;
+        default: value = DivideLanes(machine, group, insn, 1); break;
+        }
+        WriteRegister(machine, mask, insn->d, value);
+        break;
+    case OP_LDR:
+    case OP_STR:
+        return MemoryOp(machine, group, insn, pc);
+    case OP_CONST:
+        WriteRegister(machine, mask, insn->d, imm);
+        break;
+    case OP_HICONST:
+        if (insn->sub == 0) {
+            return 0; // ignored, and the PC stays put
+        }
+        WriteRegister(machine, mask, insn->d, (R[insn->d] & Splat(0xFF)) | Splat(insn->imm << 8));
+        break;
+    case OP_JSR:
+        WriteRegister(machine, mask, 7, next); // JSRR reads Rs after R7 is written
+        if (insn->sub == 0) {
+            machine->PC = Select(mask, R[insn->s], machine->PC);
+        } else {
+            machine->PC = Select(mask, Splat((pc & 0x8000) | (insn->imm << 4)), machine->PC);
+        }
+        return 0;
+    case OP_JMP:
+        if (insn->sub == 0) {
+            machine->PC = Select(mask, R[insn->s], machine->PC);
+        } else {
+            machine->PC = Select(mask, Splat(pc + 1 + insn->imm), machine->PC);
+        }
+        return 0;
+    case OP_TRAP:
+        machine->PSR = Select(mask, machine->PSR | Splat(0x8000), machine->PSR);
+        WriteRegister(machine, mask, 7, next);
+        machine->PC = Select(mask, Splat(0x8000 | insn->imm), machine->PC);
+        return 0;
+    case OP_RTI:
+        machine->PC = Select(mask, R[7], machine->PC);
+        machine->PSR = Select(mask, machine->PSR & Splat(0x7FFF), machine->PSR);
+        return 0;
+    default:
+        return 0; // illegal opcodes are ignored, and the PC stays put
+    }
+
+    machine->PC = Select(mask, next, machine->PC);
+    return 0;
+}
+
+
+/*
+ * Lanes of group that may not execute at pc.
+ */
+LANE_INLINE unsigned int InvalidLanes(LockstepMachine* machine, unsigned int group, unsigned short int pc)
+{
+    if ((pc >= 0x2000 && pc < 0x8000) || pc >= 0xA000) {
+        return group;
+    }
+    if (pc >= 0x8000) {
+        return group & BitsOf((Lanes)(machine->PSR < Splat(0x8000)));
+    }
+    return 0;
+}
+
+
+/*
+ * Mark the lanes in lanes as failed.
+ */
+static void Fail(unsigned int lanes, int* status)
+{
+    for (; lanes != 0; lanes &= lanes - 1) {
+        printf("error occurred\n");
+        status[__builtin_ctz(lanes)] = 1;
+    }
+}
+
+
+/*
+ * Add the per lane counts in pending to instrCount and clear them.
+ */
+LANE_INLINE void FlushCounts(LockstepMachine* machine, Lanes* pending)
+{
+    int lane;
+
+    for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        machine->instrCount[lane] += (*pending)[lane];
+    }
+    *pending = Splat(0);
+}
+
+
+/*
+ * Take the lanes in lanes out of running once they are at haltPC or have run
+ * stopCount instructions (counting pending), setting their status. Returns
+ * what is left running.
+ */
+LANE_INLINE unsigned int Retire(LockstepMachine* machine, unsigned int running, unsigned int lanes, Lanes pending,
+                                unsigned short int haltPC, unsigned long long stopCount, int* status)
+{
+    unsigned int halted = lanes & BitsOf((Lanes)(machine->PC == Splat(haltPC)));
+    int lane;
+
+    running &= ~halted;
+    for (; halted != 0; halted &= halted - 1) {
+        status[__builtin_ctz(halted)] = 0;
+    }
+    if (stopCount != ~0ULL) {
+        for (lanes &= running; lanes != 0; lanes &= lanes - 1) {
+            lane = __builtin_ctz(lanes);
+            if (machine->instrCount[lane] + pending[lane] == stopCount) {
+                status[lane] = 2;
+                running &= ~(1U << lane);
+            }
+        }
+    }
+    return running;
+}
+
+
+static LOCKSTEP_CLONES void Run(LockstepMachine* machine, unsigned short int haltPC, unsigned long long stopCount, int* status)
+{
+    Lanes pending = Splat(0);   // instructions run per lane and not yet in instrCount
+    unsigned int steps = 0;
+    unsigned int running = Retire(machine, machine->loaded, machine->loaded, pending, haltPC, stopCount, status);
+    unsigned int group;
+    unsigned int bits;
+    unsigned int bad;
+    unsigned short int pc;
+    unsigned short int word;
+    DecodedInsn* insn;
+    int lane;
+
+    while (running != 0) {
+        // Usually every running lane is at the same PC; otherwise take the
+        // lowest one. Lanes there with a different word there wait as well.
+        pc = machine->PC[__builtin_ctz(running)];
+        group = running & BitsOf((Lanes)(machine->PC == Splat(pc)));
+        if (group != running) {
+            for (bits = running; bits != 0; bits &= bits - 1) {
+                lane = __builtin_ctz(bits);
+                if (machine->PC[lane] < pc) {
+                    pc = machine->PC[lane];
+                }
+            }
+            group = running & BitsOf((Lanes)(machine->PC == Splat(pc)));
+        }
+        word = machine->memory[pc][__builtin_ctz(group)];
+        group &= BitsOf((Lanes)(machine->memory[pc] == Splat(word)));
+
+        insn = &machine->decoded[pc];
+        if (!insn->valid || machine->decodedWord[pc] != word) {
+            DecodeWord(word, insn);
+            machine->decodedWord[pc] = word;
+        }
+
+        bad = InvalidLanes(machine, group, pc);
+        if (group != bad) {
+            bad |= Execute(machine, group & ~bad, insn, pc);
+        }
+        if (bad != 0) {
+            Fail(bad, status);
+            running &= ~bad;
+            group &= ~bad;
+        }
+
+        pending -= MaskOf(group); // a set mask lane is -1
+        if (++steps == 0xFFFF) {  // before a 16 bit count can wrap
+            FlushCounts(machine, &pending);
+            steps = 0;
+        }
+        running = Retire(machine, running, group, pending, haltPC, stopCount, status);
+    }
+    FlushCounts(machine, &pending);
+}
+
+
+/*
+ * Allocate a lockstep machine with no lanes loaded.
+ */
+LockstepMachine* LockstepCreate(void)
+{
+    LockstepMachine* machine = aligned_alloc(sizeof(Lanes), sizeof(LockstepMachine));
+
+    if (machine != NULL) {
+        memset(machine, 0, sizeof(LockstepMachine));
+    }
+    return machine;
+}
+
+
+/*
+ * Free the machine.
+ */
+void LockstepDestroy(LockstepMachine* machine)
+{
+    free(machine);
+}
+
+
+/*
+ * Drop every lane.
+ */
+void LockstepClear(LockstepMachine* machine)
+{
+    machine->loaded = 0;
+}
+
+
+/*
+ * Copy the state of CPU into lane.
+ */
+void LockstepLoadLane(LockstepMachine* machine, int lane, MachineState* CPU)
+{
+    int i;
+
+    for (i = 0; i < 65536; i++) {
+        machine->memory[i][lane] = ReadMemory(CPU, i);
+    }
+    for (i = 0; i < 8; i++) {
+        machine->R[i][lane] = CPU->R[i];
+    }
+    machine->PC[lane] = CPU->PC;
+    machine->PSR[lane] = CPU->PSR;
+    machine->instrCount[lane] = CPU->instrCount;
+    machine->loaded |= 1U << lane;
+}
+
+
+/*
+ * Copy lane back into CPU.
+ */
+void LockstepStoreLane(LockstepMachine* machine, int lane, MachineState* CPU)
+{
+    int i;
+
+    for (i = 0; i < 65536; i++) {
+        if (ReadMemory(CPU, i) != machine->memory[i][lane]) {
+            WriteMemory(CPU, i, machine->memory[i][lane]);
+        }
+    }
+    for (i = 0; i < 8; i++) {
+        CPU->R[i] = machine->R[i][lane];
+    }
+    CPU->PC = machine->PC[lane];
+    CPU->PSR = machine->PSR[lane];
+    CPU->instrCount = machine->instrCount[lane];
+}
+
+
+/*
+ * Run every loaded lane until it halts, fails or reaches stopCount.
+ */
+void LockstepRun(LockstepMachine* machine, unsigned short int haltPC, unsigned long long stopCount, int* status)
+{
+    Run(machine, haltPC, stopCount, status);
+}
@@ -0,0 +1,63 @@
+/*
+ * lockstep.h: Declares the lockstep engine that runs up to 16 machines on one
+ * instruction stream
+ */
+
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include "LC4.h"
+
+#define LOCKSTEP_LANES 16
+
+typedef struct LockstepMachine LockstepMachine;
+
+/*
+ * Allocate a lockstep machine with no lanes loaded. Returns NULL if out of memory.
+ */
+LockstepMachine* LockstepCreate(void);
+
+
+/*
+ * Free the machine.
+ */
+void LockstepDestroy(LockstepMachine* machine);
+
+
+/*
+ * Drop every lane, e.g. before loading the next group of machines.
+ */
+void LockstepClear(LockstepMachine* machine);
+
+
+/*
+ * Copy the registers, PC, PSR, instruction count and memory of CPU into lane.
+ */
+void LockstepLoadLane(LockstepMachine* machine, int lane, MachineState* CPU);
+
+
+/*
+ * Copy lane back into CPU. The control signals and the other trace-only
+ * fields of CPU are left alone.
+ */
+void LockstepStoreLane(LockstepMachine* machine, int lane, MachineState* CPU);
+
+
+/*
+ * Run every loaded lane like RunMachineUntil, without a trace, and set
+ * status[lane] to what RunMachineUntil would have returned for it: 0 when it
+ * reached haltPC, 1 on an error (after printing "error occurred") and 2 when
+ * its instrCount reached stopCount.
+ *
+ * Registers, PC, PSR, memory and instruction count are kept per lane, with
+ * each register (and each memory word) of all lanes side by side in one
+ * 16 x 16 bit vector. Each step runs the instruction at the lowest PC any lane
+ * is at, for all lanes at that PC holding the same word there, as vector
+ * operations masked to those lanes; lanes that branched elsewhere wait and
+ * join back in when the others reach their PC. The vector code is built for
+ * AVX2 as well as the baseline ISA and picked at run time where the
+ * toolchain supports it.
+ */
+void LockstepRun(LockstepMachine* machine, unsigned short int haltPC, unsigned long long stopCount, int* status);
+
+#endif
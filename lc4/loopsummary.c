@@ -0,0 +1,378 @@
+/*
+ * loopsummary.c: Defines the loop summarizing trace writer and its expander
+ *
+ * Both sides keep the last records of the full trace. A loop is looked for
+ * only at a backward branch (a PC not after the previous one): the body is
+ * the records since the last time that PC ran, and it is a loop if the two
+ * latest copies of it ran the same instructions. Each further record is
+ * predicted as twice the record one body back less the record two bodies
+ * back, that is, with the same stride, so neither side keeps per-loop state
+ * beyond the body length.
+ */
+
+#define _GNU_SOURCE
+#include "loopsummary.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Records kept; two bodies must fit
+#define HISTORY (2 * LOOP_MAX_BODY)
+
+// The latest records of the full trace
+typedef struct {
+    TraceRecord records[HISTORY];
+    unsigned long long count;           // records ever added
+} History;
+
+
+static TraceRecord* At(History* history, unsigned long long index)
+{
+    return &history->records[index % HISTORY];
+}
+
+
+/*
+ * Whether a and b are the same instruction with the same control signals.
+ */
+static int SameShape(const TraceRecord* a, const TraceRecord* b)
+{
+    return a->PC == b->PC && a->insn == b->insn && a->regFile_WE == b->regFile_WE && a->regNum == b->regNum &&
+           a->NZP_WE == b->NZP_WE && a->NZPVal == b->NZPVal && a->DATA_WE == b->DATA_WE;
+}
+
+
+/*
+ * Body length of a loop that the record about to be added, at pc, starts
+ * another iteration of, or 0 if there is none.
+ */
+static unsigned int FindLoop(History* history, unsigned short int pc)
+{
+    unsigned long long n = history->count;
+    unsigned int body;
+    unsigned int i;
+
+    if (n == 0 || pc > At(history, n - 1)->PC) {
+        return 0;
+    }
+    for (body = 1; body <= LOOP_MAX_BODY && body <= n; body++) {
+        if (At(history, n - body)->PC == pc) {
+            break;
+        }
+    }
+    if (body > LOOP_MAX_BODY || 2 * (unsigned long long)body > n) {
+        return 0;
+    }
+    for (i = 1; i <= body; i++) {
+        if (!SameShape(At(history, n - i), At(history, n - body - i))) {
+            return 0;
+        }
+    }
+    return body;
+}
+
+
+/*
+ * The record expected next in a loop of body records.
+ */
+static void Predict(History* history, unsigned int body, TraceRecord* rec)
+{
+    TraceRecord* last = At(history, history->count - body);
+    TraceRecord* before = At(history, history->count - 2 * body);
+
+    *rec = *last;
+    rec->regInputVal = 2 * last->regInputVal - before->regInputVal;
+    rec->dmemAddr = 2 * last->dmemAddr - before->dmemAddr;
+    rec->dmemValue = 2 * last->dmemValue - before->dmemValue;
+}
+
+
+static int SameRecord(const TraceRecord* a, const TraceRecord* b)
+{
+    return SameShape(a, b) && a->regInputVal == b->regInputVal && a->dmemAddr == b->dmemAddr &&
+           a->dmemValue == b->dmemValue;
+}
+
+
+/*
+ * Spell the repeat record for body records repeated times into line. The
+ * last iteration ends before record end.
+ */
+static void FormatRepeat(History* history, unsigned int body, unsigned long long times, unsigned long long end,
+                         char* line)
+{
+    unsigned short int regs[8];
+    unsigned int written = 0;
+    TraceRecord* rec;
+    unsigned int i;
+    unsigned int j;
+
+    line += sprintf(line, "repeat %u %llu", body, times);
+    for (i = body; i >= 1; i--) {
+        rec = At(history, end - i);
+        if (rec->regFile_WE) {
+            regs[rec->regNum] = rec->regInputVal;
+            written |= 1 << rec->regNum;
+        }
+    }
+    for (i = 0; i < 8; i++) {
+        if (written & (1 << i)) {
+            line += sprintf(line, " R%u=%04X", i, regs[i]);
+        }
+    }
+    for (i = body; i >= 1; i--) {
+        rec = At(history, end - i);
+        for (j = i - 1; j >= 1 && !(At(history, end - j)->DATA_WE &&
+                                    At(history, end - j)->dmemAddr == rec->dmemAddr); j--) {
+        }
+        if (rec->DATA_WE && j == 0) { // the last store to the word
+            line += sprintf(line, " M[%04X]=%04X", rec->dmemAddr, rec->dmemValue);
+        }
+    }
+    strcpy(line, "\n");
+}
+
+
+/*
+ * Write the full text trace a summary stands for.
+ */
+int ExpandLoopSummary(FILE* input, FILE* output)
+{
+    History* history = calloc(1, sizeof(History));
+    char* line = malloc(LOOP_MAX_LINE + 2);
+    char* expected = malloc(LOOP_MAX_LINE + 2);
+    unsigned long long number = 0;
+    unsigned long long times;
+    unsigned long long i;
+    unsigned int body;
+    TraceRecord rec;
+    size_t length;
+    int failed = 0;
+
+    if (history == NULL || line == NULL || expected == NULL) {
+        printf("error: out of memory\n");
+        failed = 1;
+    }
+    while (!failed && fgets(line, LOOP_MAX_LINE + 2, input) != NULL) {
+        number++;
+        length = strcspn(line, "\n");
+        if (sscanf(line, "repeat %u %llu", &body, &times) == 2) {
+            if (body == 0 || body > LOOP_MAX_BODY || 2 * (unsigned long long)body > history->count) {
+                printf("error: line %llu: the repeated body is not in the trace\n", number);
+                failed = 1;
+                break;
+            }
+            for (i = 0; i < body * times; i++) {
+                Predict(history, body, &rec);
+                *At(history, history->count++) = rec;
+                WriteTextRecord(output, &rec);
+            }
+            FormatRepeat(history, body, times, history->count, expected);
+            if (strcmp(line, expected) != 0) {
+                printf("error: line %llu: the values after the repeat do not match it\n", number);
+                failed = 1;
+            }
+        } else if (ParseTextRecord(line, length, &rec) == 0) {
+            *At(history, history->count++) = rec;
+            WriteTextRecord(output, &rec);
+        } else {
+            printf("error: line %llu is not a trace record\n", number);
+            failed = 1;
+        }
+    }
+    free(history);
+    free(line);
+    free(expected);
+    return failed;
+}
+
+
+#ifdef __GLIBC__
+
+struct LoopSummarizer {
+    FILE* dest;
+    FILE* stream;                       // fopencookie stream taking the binary trace
+    History history;
+
+    unsigned int body;                  // records in the loop being left out, 0 if none
+    unsigned long long start;           // first record left out
+    unsigned long long times;           // whole iterations left out so far
+
+    size_t headerLeft;                  // bytes of the binary header still to skip
+    unsigned char partial[TRACE_RECORD_SIZE]; // a record split between writes
+    size_t partialLength;
+    char line[LOOP_MAX_LINE + 2];
+};
+
+
+/*
+ * End the loop being left out: write its repeat record, then the records of
+ * the iteration it was in the middle of.
+ */
+static void EndLoop(LoopSummarizer* summarizer)
+{
+    History* history = &summarizer->history;
+    unsigned long long end = summarizer->start + summarizer->body * summarizer->times;
+    unsigned long long i;
+
+    if (summarizer->times > 0) {
+        FormatRepeat(history, summarizer->body, summarizer->times, end, summarizer->line);
+        fputs(summarizer->line, summarizer->dest);
+    }
+    for (i = end; i < history->count; i++) {
+        WriteTextRecord(summarizer->dest, At(history, i));
+    }
+    summarizer->body = 0;
+}
+
+
+/*
+ * Summarize the binary record in buf. Records that go on the loop being
+ * left out are only kept; any other ends it, and may start another.
+ */
+static void SummarizeRecord(LoopSummarizer* summarizer, const unsigned char* buf)
+{
+    History* history = &summarizer->history;
+    TraceRecord expected;
+    TraceRecord rec;
+
+    DecodeBinaryRecord(buf, &rec);
+    if (summarizer->body != 0) {
+        Predict(history, summarizer->body, &expected);
+        if (!SameRecord(&rec, &expected)) {
+            EndLoop(summarizer);
+        }
+    }
+    if (summarizer->body == 0) {
+        summarizer->body = FindLoop(history, rec.PC);
+        summarizer->start = history->count;
+        summarizer->times = 0;
+        if (summarizer->body != 0) {
+            Predict(history, summarizer->body, &expected);
+            if (!SameRecord(&rec, &expected)) {
+                summarizer->body = 0;
+            }
+        }
+    }
+
+    *At(history, history->count++) = rec;
+    if (summarizer->body == 0) {
+        WriteTextRecord(summarizer->dest, &rec);
+    } else if ((history->count - summarizer->start) % summarizer->body == 0) {
+        summarizer->times++;
+    }
+}
+
+
+/*
+ * fopencookie write callback: skip the binary header, then summarize each
+ * whole record, keeping a record split between writes for the next one.
+ */
+static ssize_t CookieWrite(void* cookie, const char* data, size_t size)
+{
+    LoopSummarizer* summarizer = cookie;
+    const unsigned char* bytes = (const unsigned char*)data;
+    size_t left = size;
+    size_t n;
+
+    n = summarizer->headerLeft < left ? summarizer->headerLeft : left;
+    summarizer->headerLeft -= n;
+    bytes += n;
+    left -= n;
+
+    if (summarizer->partialLength > 0) {
+        n = TRACE_RECORD_SIZE - summarizer->partialLength;
+        if (n > left) {
+            n = left;
+        }
+        memcpy(summarizer->partial + summarizer->partialLength, bytes, n);
+        summarizer->partialLength += n;
+        bytes += n;
+        left -= n;
+        if (summarizer->partialLength < TRACE_RECORD_SIZE) {
+            return size;
+        }
+        SummarizeRecord(summarizer, summarizer->partial);
+        summarizer->partialLength = 0;
+    }
+    for (; left >= TRACE_RECORD_SIZE; bytes += TRACE_RECORD_SIZE, left -= TRACE_RECORD_SIZE) {
+        SummarizeRecord(summarizer, bytes);
+    }
+    memcpy(summarizer->partial, bytes, left);
+    summarizer->partialLength = left;
+    return size;
+}
+
+
+/*
+ * Open the stream summarizing into dest.
+ */
+LoopSummarizer* LoopSummarizerOpen(FILE* dest)
+{
+    cookie_io_functions_t io = { NULL, CookieWrite, NULL, NULL };
+    LoopSummarizer* summarizer = calloc(1, sizeof(LoopSummarizer));
+
+    if (summarizer == NULL) {
+        printf("error: out of memory\n");
+        return NULL;
+    }
+    summarizer->stream = fopencookie(summarizer, "w", io);
+    if (summarizer->stream == NULL) {
+        printf("error: out of memory\n");
+        free(summarizer);
+        return NULL;
+    }
+    setvbuf(summarizer->stream, NULL, _IOFBF, 1 << 16);
+    summarizer->dest = dest;
+    summarizer->headerLeft = TRACE_HEADER_SIZE;
+    return summarizer;
+}
+
+
+/*
+ * The stream to write the binary trace to.
+ */
+FILE* LoopSummarizerStream(LoopSummarizer* summarizer)
+{
+    return summarizer->stream;
+}
+
+
+/*
+ * Finish the summary and free the summarizer.
+ */
+int LoopSummarizerClose(LoopSummarizer* summarizer)
+{
+    int failed;
+
+    fclose(summarizer->stream);
+    if (summarizer->body != 0) {
+        EndLoop(summarizer);
+    }
+    failed = fflush(summarizer->dest) != 0 || ferror(summarizer->dest);
+    free(summarizer);
+    return failed;
+}
+
+#else
+
+/*
+ * Without fopencookie there is no way to hand out a FILE* that summarizes
+ * what is written to it, so summarized traces are not available.
+ */
+LoopSummarizer* LoopSummarizerOpen(FILE* dest)
+{
+    printf("error: summarized traces are not supported on this host\n");
+    return NULL;
+}
+
+FILE* LoopSummarizerStream(LoopSummarizer* summarizer)
+{
+    return NULL;
+}
+
+int LoopSummarizerClose(LoopSummarizer* summarizer)
+{
+    return 1;
+}
+
+#endif
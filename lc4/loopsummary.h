@@ -0,0 +1,60 @@
+/*
+ * loopsummary.h: Declares the loop summarizing trace writer and its expander
+ */
+
+#ifndef LOOPSUMMARY_H
+#define LOOPSUMMARY_H
+
+#include <stdio.h>
+#include "tracefmt.h"
+
+// Longest loop body, in instructions, that is summarized
+#define LOOP_MAX_BODY 256
+
+// Longest line of a summary: a repeat record lists up to 8 registers and
+// LOOP_MAX_BODY stores
+#define LOOP_MAX_LINE (32 + 8 * 8 + LOOP_MAX_BODY * 14)
+
+typedef struct LoopSummarizer LoopSummarizer;
+
+/*
+ * Start a summarized text trace in dest. Returns NULL if out of memory or if
+ * the host has no way to make the stream.
+ *
+ * The summary is the text trace, except that once the last two iterations
+ * of a loop of up to LOOP_MAX_BODY instructions have run the same
+ * instructions, further iterations that go on the same way are left out.
+ * "The same way" means each record has the fields of the record one
+ * iteration earlier, except regInputVal, dmemAddr and dmemValue, which
+ * change by the same amount they did between the two iterations before.
+ * In their place is one line
+ *   repeat <body> <times> R<n>=<hex> ... M[<hex>]=<hex> ...
+ * saying that the last <body> records went on <times> more times, with the
+ * registers the body writes and the words its last iteration stores as
+ * they were at the end.
+ */
+LoopSummarizer* LoopSummarizerOpen(FILE* dest);
+
+
+/*
+ * The stream the simulator writes the trace to, in the binary format
+ * (WriteTraceHeader, then WriteBinaryRecord).
+ */
+FILE* LoopSummarizerStream(LoopSummarizer* summarizer);
+
+
+/*
+ * Finish the summary and free the summarizer. dest is flushed but not
+ * closed. Returns 0 if every write succeeded.
+ */
+int LoopSummarizerClose(LoopSummarizer* summarizer);
+
+
+/*
+ * Write the full text trace a summary stands for. Returns 0 on success; on a
+ * line that is neither a trace record nor a repeat matching the trace so
+ * far, prints why and returns 1.
+ */
+int ExpandLoopSummary(FILE* input, FILE* output);
+
+#endif
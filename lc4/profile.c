@@ -0,0 +1,293 @@
+/*
+ * profile.c: Defines the execution profiler reports
+ */
+
+#include "profile.h"
+
+typedef struct {
+    unsigned short int start;       // first address of the loop (branch target)
+    unsigned short int end;         // address of the backward branch
+    unsigned long long iterations;  // times the branch was taken
+    unsigned long long instructions;// instructions executed in start..end
+} Loop;
+
+typedef struct {
+    int index;
+    unsigned long long count;
+} Entry;
+
+static const char* const RegionNames[PROFILE_REGIONS] = { "user-code", "user-data", "os-code", "os-data" };
+
+
+/*
+ * Mnemonic for an opcode and sub-opcode pair as DecodedInsn holds them.
+ */
+static const char* OpName(int opcode, int sub)
+{
+    static const char* const branches[8] = { "NOP", "BRp", "BRz", "BRzp", "BRn", "BRnp", "BRnz", "BRnzp" };
+    static const char* const arith[5] = { "ADD", "MUL", "SUB", "DIV", "ADDI" };
+    static const char* const compare[4] = { "CMP", "CMPU", "CMPI", "CMPIU" };
+    static const char* const logic[5] = { "AND", "NOT", "OR", "XOR", "ANDI" };
+    static const char* const shift[4] = { "SLL", "SRA", "SRL", "MOD" };
+
+    switch (opcode) {
+    case OP_BR:      return branches[sub];
+    case OP_ARITH:   return sub < 5 ? arith[sub] : "illegal";
+    case OP_CMP:     return sub < 4 ? compare[sub] : "illegal";
+    case OP_JSR:     return sub ? "JSR" : "JSRR";
+    case OP_LOGIC:   return sub < 5 ? logic[sub] : "illegal";
+    case OP_LDR:     return "LDR";
+    case OP_STR:     return "STR";
+    case OP_RTI:     return "RTI";
+    case OP_CONST:   return "CONST";
+    case OP_SHIFT:   return sub < 4 ? shift[sub] : "illegal";
+    case OP_JMP:     return sub ? "JMP" : "JMPR";
+    case OP_HICONST: return sub ? "HICONST" : "illegal";
+    case OP_TRAP:    return "TRAP";
+    }
+    return "illegal";
+}
+
+
+/*
+ * Decoded instruction at addr, decoding it if the loader or a store left it undecoded.
+ */
+static DecodedInsn* InsnAt(MachineState* CPU, unsigned short int addr)
+{
+    if (!DecodedAt(CPU, addr)->valid) {
+        DecodeInstruction(CPU, addr);
+    }
+    return DecodedAt(CPU, addr);
+}
+
+
+// qsort orders, highest count first and lowest address on ties
+static int CompareEntries(const void* a, const void* b)
+{
+    const Entry* x = a;
+    const Entry* y = b;
+
+    if (x->count != y->count) {
+        return x->count < y->count ? 1 : -1;
+    }
+    return x->index - y->index;
+}
+
+static int CompareLoops(const void* a, const void* b)
+{
+    const Loop* x = a;
+    const Loop* y = b;
+
+    if (x->instructions != y->instructions) {
+        return x->instructions < y->instructions ? 1 : -1;
+    }
+    return x->end - y->end;
+}
+
+
+/*
+ * Allocate an empty profile.
+ */
+Profile* ProfileCreate(void)
+{
+    return calloc(1, sizeof(Profile));
+}
+
+
+/*
+ * Free the profile.
+ */
+void ProfileDestroy(Profile* profile)
+{
+    free(profile);
+}
+
+
+/*
+ * Total number of instructions counted.
+ */
+static unsigned long long ProfileTotal(Profile* profile)
+{
+    unsigned long long total = 0;
+    int i;
+
+    for (i = 0; i < 16 * 8; i++) {
+        total += profile->opcodes[i];
+    }
+    return total;
+}
+
+
+/*
+ * Copy the opcode counts into mix, with every illegal encoding counted under
+ * opcode 0011 so each mnemonic appears once.
+ */
+static void OpcodeMix(Profile* profile, unsigned long long* mix)
+{
+    int i;
+
+    memset(mix, 0, 16 * 8 * sizeof(unsigned long long));
+    for (i = 0; i < 16 * 8; i++) {
+        if (strcmp(OpName(i >> 3, i & 0x7), "illegal") == 0) {
+            mix[3 << 3] += profile->opcodes[i];
+        } else {
+            mix[i] += profile->opcodes[i];
+        }
+    }
+}
+
+
+/*
+ * Percentage of total that count is, 0 when nothing ran.
+ */
+static double Percent(unsigned long long count, unsigned long long total)
+{
+    return total ? 100.0 * count / total : 0.0;
+}
+
+
+/*
+ * Find the loops closed by backward branches and jumps that were taken.
+ * Returns how many were stored in loops, which must hold 65536 entries.
+ */
+static int FindLoops(Profile* profile, MachineState* CPU, Loop* loops)
+{
+    DecodedInsn* insn;
+    unsigned long long iterations;
+    int count = 0;
+    int pc;
+    int a;
+
+    for (pc = 0; pc < 65536; pc++) {
+        if (profile->count[pc] == 0) {
+            continue;
+        }
+        insn = InsnAt(CPU, pc);
+        if (insn->opcode == OP_BR) {
+            iterations = profile->taken[pc];
+        } else if (insn->opcode == OP_JMP && insn->sub == 1) {
+            iterations = profile->count[pc];
+        } else {
+            continue;
+        }
+        if (iterations == 0 || insn->imm >= 0 || pc + 1 + insn->imm < 0) {
+            continue;
+        }
+        loops[count].start = pc + 1 + insn->imm;
+        loops[count].end = pc;
+        loops[count].iterations = iterations;
+        loops[count].instructions = 0;
+        for (a = loops[count].start; a <= pc; a++) {
+            loops[count].instructions += profile->count[a];
+        }
+        count++;
+    }
+    qsort(loops, count, sizeof(Loop), CompareLoops);
+    return count;
+}
+
+
+/*
+ * Write the human readable report.
+ */
+void WriteProfileReport(FILE* output, Profile* profile, MachineState* CPU, int top)
+{
+    Entry* entries = malloc(65536 * sizeof(Entry));
+    Loop* loops = malloc(65536 * sizeof(Loop));
+    unsigned long long total = ProfileTotal(profile);
+    unsigned long long mix[16 * 8];
+    DecodedInsn* insn;
+    int count = 0;
+    int i;
+
+    if (entries == NULL || loops == NULL) {
+        fprintf(output, "error: out of memory\n");
+        free(entries);
+        free(loops);
+        return;
+    }
+
+    fprintf(output, "profile: %llu instructions\n", total);
+
+    fprintf(output, "\nhot spots:\n  address  insn        count       %%\n");
+    for (i = 0; i < 65536; i++) {
+        if (profile->count[i] != 0) {
+            entries[count].index = i;
+            entries[count].count = profile->count[i];
+            count++;
+        }
+    }
+    qsort(entries, count, sizeof(Entry), CompareEntries);
+    for (i = 0; i < count && i < top; i++) {
+        insn = InsnAt(CPU, entries[i].index);
+        fprintf(output, "  %04X     %-8s %12llu  %6.2f", entries[i].index, OpName(insn->opcode, insn->sub),
+                entries[i].count, Percent(entries[i].count, total));
+        if (insn->opcode == OP_BR) {
+            fprintf(output, "  taken %llu, not taken %llu", profile->taken[entries[i].index],
+                    entries[i].count - profile->taken[entries[i].index]);
+        }
+        fprintf(output, "\n");
+    }
+
+    count = FindLoops(profile, CPU, loops);
+    fprintf(output, "\nhot loops:\n  start  end    iterations  instructions       %%\n");
+    for (i = 0; i < count && i < top; i++) {
+        fprintf(output, "  %04X   %04X %12llu  %12llu  %6.2f\n", loops[i].start, loops[i].end,
+                loops[i].iterations, loops[i].instructions, Percent(loops[i].instructions, total));
+    }
+
+    count = 0;
+    OpcodeMix(profile, mix);
+    for (i = 0; i < 16 * 8; i++) {
+        if (mix[i] != 0) {
+            entries[count].index = i;
+            entries[count].count = mix[i];
+            count++;
+        }
+    }
+    qsort(entries, count, sizeof(Entry), CompareEntries);
+    fprintf(output, "\nopcode mix:\n");
+    for (i = 0; i < count; i++) {
+        fprintf(output, "  %-8s %12llu  %6.2f\n", OpName(entries[i].index >> 3, entries[i].index & 0x7),
+                entries[i].count, Percent(entries[i].count, total));
+    }
+
+    fprintf(output, "\nmemory accesses:\n  region            loads        stores\n");
+    for (i = 0; i < PROFILE_REGIONS; i++) {
+        fprintf(output, "  %-10s %12llu  %12llu\n", RegionNames[i], profile->loads[i], profile->stores[i]);
+    }
+
+    free(entries);
+    free(loops);
+}
+
+
+/*
+ * Write the profile in its line oriented form.
+ */
+void WriteProfileData(FILE* output, Profile* profile, MachineState* CPU)
+{
+    unsigned long long mix[16 * 8];
+    int i;
+
+    fprintf(output, "instructions %llu\n", ProfileTotal(profile));
+    OpcodeMix(profile, mix);
+    for (i = 0; i < 16 * 8; i++) {
+        if (mix[i] != 0) {
+            fprintf(output, "op %s %llu\n", OpName(i >> 3, i & 0x7), mix[i]);
+        }
+    }
+    for (i = 0; i < PROFILE_REGIONS; i++) {
+        fprintf(output, "region %s %llu %llu\n", RegionNames[i], profile->loads[i], profile->stores[i]);
+    }
+    for (i = 0; i < 65536; i++) {
+        if (profile->count[i] != 0) {
+            fprintf(output, "pc %04X %llu\n", i, profile->count[i]);
+        }
+    }
+    for (i = 0; i < 65536; i++) {
+        if (profile->count[i] != 0 && InsnAt(CPU, i)->opcode == OP_BR) {
+            fprintf(output, "branch %04X %llu %llu\n", i, profile->taken[i], profile->count[i] - profile->taken[i]);
+        }
+    }
+}
@@ -0,0 +1,97 @@
+/*
+ * profile.h: Declares the execution profiler (built with -DLC4_PROFILE)
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include "LC4.h"
+
+// Address regions loads and stores are counted by
+#define REGION_USER_CODE 0    // x0000 - x1FFF
+#define REGION_USER_DATA 1    // x2000 - x7FFF
+#define REGION_OS_CODE   2    // x8000 - x9FFF
+#define REGION_OS_DATA   3    // xA000 - xFFFF
+#define PROFILE_REGIONS  4
+
+struct Profile {
+    unsigned long long count[65536];    // executions of the instruction at each address
+    unsigned long long taken[65536];    // of those, how many were taken branches
+    unsigned long long opcodes[16 * 8]; // executions per opcode and sub-opcode
+    unsigned long long loads[PROFILE_REGIONS];
+    unsigned long long stores[PROFILE_REGIONS];
+};
+
+
+/*
+ * Region of the address space addr is in.
+ */
+static inline int ProfileRegion(unsigned short int addr)
+{
+    if (addr < 0x2000) {
+        return REGION_USER_CODE;
+    } else if (addr < 0x8000) {
+        return REGION_USER_DATA;
+    } else if (addr < 0xA000) {
+        return REGION_OS_CODE;
+    }
+    return REGION_OS_DATA;
+}
+
+
+/*
+ * Count the instruction at the current PC, which is about to execute.
+ */
+static inline void ProfileInstruction(Profile* profile, MachineState* CPU, DecodedInsn* insn)
+{
+    unsigned short int addr;
+
+    profile->count[CPU->PC]++;
+    profile->opcodes[insn->opcode << 3 | insn->sub]++;
+    if (insn->opcode == OP_BR) {
+        profile->taken[CPU->PC] += (insn->sub & CPU->PSR & 0x7) != 0;
+    } else if (insn->opcode == OP_LDR) {
+        addr = CPU->R[insn->s] + insn->imm;
+        profile->loads[ProfileRegion(addr)]++;
+    } else if (insn->opcode == OP_STR) {
+        addr = CPU->R[insn->s] + insn->imm;
+        profile->stores[ProfileRegion(addr)]++;
+    }
+}
+
+
+/*
+ * Allocate an empty profile. Returns NULL if out of memory.
+ */
+Profile* ProfileCreate(void);
+
+
+/*
+ * Free the profile.
+ */
+void ProfileDestroy(Profile* profile);
+
+
+/*
+ * Write a human readable report: the top most executed addresses, the hottest
+ * loops (backward branches and jumps, ranked by the instructions executed in
+ * their bodies), the opcode mix and loads/stores per region. CPU is the
+ * machine the profile was taken on, used to decode the instructions.
+ */
+void WriteProfileReport(FILE* output, Profile* profile, MachineState* CPU, int top);
+
+
+/*
+ * Write the profile in a line oriented form for scripts, decoding branches
+ * from CPU's memory:
+ *   instructions <total>
+ *   op <mnemonic> <count>
+ *   region <name> <loads> <stores>
+ *   pc <address> <count>
+ *   branch <address> <taken> <not taken>
+ * Addresses are hexadecimal, counts decimal; only nonzero counts are listed.
+ */
+void WriteProfileData(FILE* output, Profile* profile, MachineState* CPU);
+
+#endif
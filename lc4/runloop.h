@@ -0,0 +1,78 @@
+/*
+ * runloop.h: The body of the interpreter loop, included by LC4.c once per
+ * stop condition so that a run to a single halt PC compares the PC while a
+ * run to a set of breakpoints tests a bit, neither paying for the other.
+ * The includer defines AT_STOP() to whether CPU is at a stop; CPU, output
+ * and stopCount are the run's arguments.
+ */
+
+#if defined(LC4_DISPATCH_THREADED) && defined(__GNUC__)
+    // Threaded code: every handler ends in its own indirect jump to the next one
+    static void* const dispatch[16] = {
+        &&op_br, &&op_arith, &&op_cmp, &&op_illegal,
+        &&op_jsr, &&op_logic, &&op_ldr, &&op_str,
+        &&op_rti, &&op_const, &&op_shift, &&op_illegal,
+        &&op_jmp, &&op_hiconst, &&op_illegal, &&op_trap
+    };
+    DecodedInsn* insn;
+
+#define DISPATCH()                               \
+    do {                                         \
+        if (AT_STOP()) {                         \
+            return 0;                            \
+        }                                        \
+        if (CPU->instrCount == stopCount) {      \
+            return 2;                            \
+        }                                        \
+        insn = FetchDecoded(CPU);                \
+        if (InvalidPC(CPU)) {                    \
+            printf("error occurred\n");          \
+            return 1;                            \
+        }                                        \
+        BeforeInstruction(CPU, insn);            \
+        goto *dispatch[insn->opcode];            \
+    } while (0)
+
+#define FAIL()                                   \
+    do {                                         \
+        InstructionFailed(CPU);                  \
+        return 1;                                \
+    } while (0)
+
+#define NEXT()                                   \
+    do {                                         \
+        CPU->instrCount++;                       \
+        DISPATCH();                              \
+    } while (0)
+
+    DISPATCH();
+op_br:      BranchOp(CPU, output);      NEXT();
+op_arith:   if (ArithmeticOp(CPU, output)) FAIL(); NEXT();
+op_cmp:     ComparativeOp(CPU, output); NEXT();
+op_jsr:     JSROp(CPU, output);         NEXT();
+op_logic:   LogicalOp(CPU, output);     NEXT();
+op_ldr:     if (LoadOp(CPU, output)) FAIL();       NEXT();
+op_str:     if (StoreOp(CPU, output)) FAIL();      NEXT();
+op_rti:     RTIOp(CPU, output);         NEXT();
+op_const:   ConstOp(CPU, output);       NEXT();
+op_shift:   if (ShiftModOp(CPU, output)) FAIL();   NEXT();
+op_jmp:     JumpOp(CPU, output);        NEXT();
+op_hiconst: HiConstOp(CPU, output);     NEXT();
+op_trap:    TrapOp(CPU, output);        NEXT();
+op_illegal: NEXT();
+
+#undef FAIL
+#undef NEXT
+#undef DISPATCH
+#else
+    while (!AT_STOP()) {
+        if (CPU->instrCount == stopCount) {
+            return 2;
+        }
+        if (UpdateMachineState(CPU, output) == 1) {
+            return 1;
+        }
+        CPU->instrCount++;
+    }
+    return 0;
+#endif
@@ -0,0 +1,454 @@
+/*
+ * script.c: Defines the runner for PennSim command scripts
+ */
+
+#include "script.h"
+#include "loader.h"
+#ifdef LC4_UNDO
+#include "undo.h"
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#define MAX_LINE   4096
+#define MAX_TOKENS 4
+
+typedef struct {
+    char* name;
+    unsigned short int address;
+} Symbol;
+
+typedef struct {
+    MachineState* CPU;
+    Breakpoints breakpoints;
+    FILE* trace;                // NULL while tracing is off
+#ifdef LC4_UNDO
+    UndoLog* undo;              // of what continue and step ran
+#endif
+
+    Symbol* symbols;
+    int symbolCount;
+    int symbolCapacity;
+
+    const char* filename;       // of the script, for messages
+    int line;
+} Script;
+
+
+/*
+ * Add a symbol, or move it if it is already known. SymbolCallback for the loader.
+ */
+static void AddSymbol(void* context, const char* name, int length, unsigned short int address)
+{
+    Script* script = context;
+    Symbol* symbols;
+    int i;
+
+    for (i = 0; i < script->symbolCount; i++) {
+        if (strncasecmp(script->symbols[i].name, name, length) == 0 && script->symbols[i].name[length] == '\0') {
+            script->symbols[i].address = address;
+            return;
+        }
+    }
+    if (script->symbolCount == script->symbolCapacity) {
+        symbols = realloc(script->symbols, 2 * (script->symbolCapacity + 8) * sizeof(Symbol));
+        if (symbols == NULL) {
+            return;
+        }
+        script->symbols = symbols;
+        script->symbolCapacity = 2 * (script->symbolCapacity + 8);
+    }
+    script->symbols[script->symbolCount].name = strndup(name, length);
+    if (script->symbols[script->symbolCount].name != NULL) {
+        script->symbols[script->symbolCount++].address = address;
+    }
+}
+
+
+/*
+ * Forget every symbol.
+ */
+static void ClearSymbols(Script* script)
+{
+    int i;
+
+    for (i = 0; i < script->symbolCount; i++) {
+        free(script->symbols[i].name);
+    }
+    script->symbolCount = 0;
+}
+
+
+/*
+ * Read a PennSim symbol file, whose entries are lines like
+ *   ;	MAIN              0000
+ * between header lines. Does nothing if the file does not exist.
+ */
+static void ReadSymbolFile(Script* script, const char* filename)
+{
+    FILE* file = fopen(filename, "r");
+    char line[MAX_LINE];
+    char* name;
+    char* address;
+    char* end;
+    unsigned long value;
+
+    if (file == NULL) {
+        return;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        name = strtok(line, "; \t\r\n");
+        address = strtok(NULL, " \t\r\n");
+        if (name == NULL || address == NULL || strtok(NULL, " \t\r\n") != NULL) {
+            continue;
+        }
+        value = strtoul(address, &end, 16);
+        if (*end == '\0' && value <= 0xFFFF) { // header lines have words there
+            AddSymbol(script, name, strlen(name), value);
+        }
+    }
+    fclose(file);
+}
+
+
+/*
+ * Parse xHEX, #decimal, decimal or a symbol. Returns 0 on success.
+ */
+static int ParseValue(Script* script, const char* token, unsigned short int* value)
+{
+    char* end;
+    long number;
+    int i;
+
+    if (token[0] == 'x' || token[0] == 'X') {
+        number = strtol(token + 1, &end, 16);
+        if (end != token + 1 && *end == '\0' && number >= 0 && number <= 0xFFFF) {
+            *value = number;
+            return 0;
+        }
+    } else if (token[0] == '#' || token[0] == '-' || (token[0] >= '0' && token[0] <= '9')) {
+        number = strtol(token + (token[0] == '#'), &end, 10);
+        if (*end == '\0' && number >= -32768 && number <= 0xFFFF) {
+            *value = number;
+            return 0;
+        }
+    }
+    for (i = 0; i < script->symbolCount; i++) {
+        if (strcasecmp(script->symbols[i].name, token) == 0) {
+            *value = script->symbols[i].address;
+            return 0;
+        }
+    }
+    printf("error: %s:%d: %s is not a number or a known symbol\n", script->filename, script->line, token);
+    return 1;
+}
+
+
+/*
+ * ld: load file.obj and its symbols, then file.sym if it exists.
+ */
+static int LoadCommand(Script* script, const char* name)
+{
+    char filename[FILENAME_MAX];
+    size_t length = strlen(name);
+
+    if (length > 4 && strcmp(name + length - 4, ".obj") == 0) {
+        length -= 4;
+    }
+    snprintf(filename, sizeof(filename), "%.*s.obj", (int)length, name);
+    if (ReadObjectFileWithSymbols(filename, script->CPU, AddSymbol, script) != 0) {
+        printf("error: %s:%d: cannot load %s\n", script->filename, script->line, filename);
+        return 1;
+    }
+    snprintf(filename, sizeof(filename), "%.*s.sym", (int)length, name);
+    ReadSymbolFile(script, filename);
+    return 0;
+}
+
+
+/*
+ * break set|clear|list.
+ */
+static int BreakCommand(Script* script, char** tokens, int count)
+{
+    unsigned short int addr;
+    int i;
+
+    if (count == 2 && strcmp(tokens[1], "list") == 0) {
+        for (i = 0; i < 65536; i++) {
+            if (IsBreakpoint(&script->breakpoints, i)) {
+                printf("breakpoint x%04X\n", i);
+            }
+        }
+        return 0;
+    }
+    if (count != 3 || (strcmp(tokens[1], "set") != 0 && strcmp(tokens[1], "clear") != 0)) {
+        printf("error: %s:%d: usage: break set|clear <location> or break list\n", script->filename, script->line);
+        return 1;
+    }
+    if (ParseValue(script, tokens[2], &addr) != 0) {
+        return 1;
+    }
+    if (strcmp(tokens[1], "set") == 0) {
+        SetBreakpoint(&script->breakpoints, addr);
+    } else {
+        ClearBreakpoint(&script->breakpoints, addr);
+    }
+    return 0;
+}
+
+
+/*
+ * trace on <file> | trace off.
+ */
+static int TraceCommand(Script* script, char** tokens, int count)
+{
+    if (count == 3 && strcmp(tokens[1], "on") == 0) {
+        if (script->trace != NULL) {
+            fclose(script->trace);
+        }
+        script->trace = fopen(tokens[2], "w");
+        if (script->trace == NULL) {
+            printf("error: %s:%d: cannot open %s\n", script->filename, script->line, tokens[2]);
+            return 1;
+        }
+        script->CPU->traceFormat = TRACE_TEXT;
+        return 0;
+    }
+    if (count == 2 && strcmp(tokens[1], "off") == 0) {
+        if (script->trace != NULL) {
+            fclose(script->trace);
+            script->trace = NULL;
+        }
+        return 0;
+    }
+    printf("error: %s:%d: usage: trace on <file> or trace off\n", script->filename, script->line);
+    return 1;
+}
+
+
+/*
+ * set <register> <value>.
+ */
+static int SetCommand(Script* script, char** tokens, int count)
+{
+    MachineState* CPU = script->CPU;
+    unsigned short int value;
+
+    if (count != 3) {
+        printf("error: %s:%d: usage: set <register> <value>\n", script->filename, script->line);
+        return 1;
+    }
+    if (ParseValue(script, tokens[2], &value) != 0) {
+        return 1;
+    }
+    if (strcasecmp(tokens[1], "PC") == 0) {
+        CPU->PC = value;
+    } else if (strcasecmp(tokens[1], "PSR") == 0) {
+        CPU->PSR = value;
+    } else if ((tokens[1][0] == 'R' || tokens[1][0] == 'r') && tokens[1][1] >= '0' && tokens[1][1] <= '7' &&
+               tokens[1][2] == '\0') {
+        CPU->R[tokens[1][1] - '0'] = value;
+    } else {
+        printf("error: %s:%d: unknown register %s\n", script->filename, script->line, tokens[1]);
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * print: the registers, PC and PSR.
+ */
+static void PrintCommand(Script* script)
+{
+    MachineState* CPU = script->CPU;
+    int i;
+
+    printf("PC x%04X PSR x%04X", CPU->PC, CPU->PSR);
+    for (i = 0; i < 8; i++) {
+        printf(" R%d x%04X", i, CPU->R[i]);
+    }
+    printf("\n");
+}
+
+
+/*
+ * Forget what can be undone, after the machine was changed other than by
+ * running it.
+ */
+static void MachineChanged(Script* script)
+{
+#ifdef LC4_UNDO
+    script->CPU->undo = script->undo; // Reset detaches it
+    UndoLogClear(script->undo);
+#endif
+}
+
+
+#ifdef LC4_UNDO
+/*
+ * reverse-step: undo the last instruction that ran.
+ */
+static int ReverseStepCommand(Script* script)
+{
+    if (UndoInstruction(script->undo, script->CPU) != 0) {
+        printf("error: %s:%d: nothing to undo\n", script->filename, script->line);
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * reverse-continue: undo instructions until the PC is at a breakpoint, or as
+ * far back as the log goes.
+ */
+static void ReverseContinueCommand(Script* script)
+{
+    while (UndoInstruction(script->undo, script->CPU) == 0 &&
+           !IsBreakpoint(&script->breakpoints, script->CPU->PC)) {
+    }
+}
+#endif
+
+
+/*
+ * Run one instruction. Returns 1 if an error occurred.
+ */
+static int Step(Script* script)
+{
+    if (UpdateMachineState(script->CPU, script->trace) == 1) {
+        return 1;
+    }
+    script->CPU->instrCount++;
+    return 0;
+}
+
+
+/*
+ * continue: like PennSim, leave a breakpoint the PC is already at before
+ * running to the next one.
+ */
+static void ContinueCommand(Script* script)
+{
+    if (IsBreakpoint(&script->breakpoints, script->CPU->PC) && Step(script) != 0) {
+        return;
+    }
+    RunToBreakpoint(script->CPU, script->trace, &script->breakpoints, ~0ULL);
+}
+
+
+/*
+ * Run the command in tokens. Returns 0 on success.
+ */
+static int RunCommand(Script* script, char** tokens, int count)
+{
+    char filename[FILENAME_MAX];
+
+    if (strcmp(tokens[0], "reset") == 0 && count == 1) {
+        ReleaseMemory(script->CPU);
+        Reset(script->CPU);
+        ClearSymbols(script);
+        MachineChanged(script);
+    } else if (strcmp(tokens[0], "clear") == 0 && count == 1) {
+        // only clears the PennSim console
+    } else if (strcmp(tokens[0], "as") == 0 && count == 3) {
+        snprintf(filename, sizeof(filename), "%s.obj", tokens[1]);
+        if (access(filename, R_OK) != 0) {
+            printf("error: %s:%d: cannot assemble %s here and %s does not exist\n", script->filename, script->line,
+                   tokens[2], filename);
+            return 1;
+        }
+    } else if (strcmp(tokens[0], "ld") == 0 && count == 2) {
+        MachineChanged(script);
+        return LoadCommand(script, tokens[1]);
+    } else if (strcmp(tokens[0], "break") == 0) {
+        return BreakCommand(script, tokens, count);
+    } else if (strcmp(tokens[0], "trace") == 0) {
+        return TraceCommand(script, tokens, count);
+    } else if (strcmp(tokens[0], "set") == 0) {
+        MachineChanged(script);
+        return SetCommand(script, tokens, count);
+    } else if (strcmp(tokens[0], "print") == 0 && count == 1) {
+        PrintCommand(script);
+    } else if (strcmp(tokens[0], "continue") == 0 && count == 1) {
+        ContinueCommand(script);
+    } else if (strcmp(tokens[0], "step") == 0 && count == 1) {
+        Step(script);
+#ifdef LC4_UNDO
+    } else if (strcmp(tokens[0], "reverse-step") == 0 && count == 1) {
+        return ReverseStepCommand(script);
+    } else if (strcmp(tokens[0], "reverse-continue") == 0 && count == 1) {
+        ReverseContinueCommand(script);
+#endif
+    } else {
+        printf("error: %s:%d: unknown command %s\n", script->filename, script->line, tokens[0]);
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Run the PennSim script in filename on CPU.
+ */
+int RunScript(const char* filename, MachineState* CPU)
+{
+    FILE* file = fopen(filename, "r");
+    char line[MAX_LINE];
+    char* tokens[MAX_TOKENS + 1];
+    int count;
+    int failed = 0;
+    Script script;
+
+    if (file == NULL) {
+        printf("error: cannot open %s\n", filename);
+        return 1;
+    }
+    memset(&script, 0, sizeof(script));
+    script.CPU = CPU;
+    script.filename = filename;
+    ClearBreakpoints(&script.breakpoints);
+#ifdef LC4_UNDO
+    script.undo = UndoLogCreate(UNDO_RECORDS);
+    if (script.undo == NULL) {
+        printf("error: out of memory\n");
+        fclose(file);
+        return 1;
+    }
+    CPU->undo = script.undo;
+#endif
+
+    while (!failed && fgets(line, sizeof(line), file) != NULL) {
+        script.line++;
+        count = 0;
+        tokens[0] = strtok(line, " \t\r\n");
+        while (tokens[count] != NULL && count < MAX_TOKENS) {
+            tokens[++count] = strtok(NULL, " \t\r\n");
+        }
+        if (count == 0 || tokens[0][0] == '#' || tokens[0][0] == ';') {
+            continue;
+        }
+        if (tokens[count] != NULL) {
+            printf("error: %s:%d: too many arguments\n", filename, script.line);
+            failed = 1;
+            break;
+        }
+        failed = RunCommand(&script, tokens, count);
+    }
+
+    fclose(file);
+    if (script.trace != NULL) {
+        fclose(script.trace);
+    }
+    ClearSymbols(&script);
+    free(script.symbols);
+#ifdef LC4_UNDO
+    CPU->undo = NULL;
+    UndoLogDestroy(script.undo);
+#endif
+    return failed;
+}
@@ -0,0 +1,38 @@
+/*
+ * script.h: Declares the runner for PennSim command scripts
+ */
+
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include "LC4.h"
+
+/*
+ * Run the PennSim script in filename on CPU, one command per line:
+ *   reset                   reset the machine and forget the symbols
+ *   clear                   clear the console (does nothing here)
+ *   as <name> <source>      assemble; only checks that <name>.obj exists
+ *   ld <file>               load <file>.obj and the symbols in it and in
+ *                           <file>.sym, if there is one
+ *   break set <location>    set a breakpoint
+ *   break clear <location>  remove a breakpoint
+ *   break list              print the breakpoints
+ *   trace on <file>         write a text trace of what runs to file
+ *   trace off               stop writing the trace
+ *   continue                run until a breakpoint or an error
+ *   step                    run one instruction
+ *   set <register> <value>  set R0-R7, PC or PSR
+ *   print                   print R0-R7, PC and PSR
+ * Built with -DLC4_UNDO (trace-debug) the script also records the last
+ * UNDO_RECORDS instructions continue and step run, and can take them back:
+ *   reverse-step            undo the last instruction
+ *   reverse-continue        undo until a breakpoint or the oldest record
+ * Loading, resetting or setting a register forgets the records.
+ * A location or value is xHEX, #decimal, a decimal number or a symbol.
+ * Empty lines and lines starting with '#' or ';' are skipped. CPU must have
+ * been Reset. Returns 0 if every command ran, 1 at the first one that did
+ * not, after printing why; an error while running ends the run, not the script.
+ */
+int RunScript(const char* filename, MachineState* CPU);
+
+#endif
@@ -0,0 +1,174 @@
+/*
+ * snapshot.c: Defines checkpoint/restore of the machine state
+ */
+
+#include "snapshot.h"
+#include "summary.h"
+
+// Unchanged words between two runs are stored anyway if that is no bigger than a run header
+#define RUN_HEADER_WORDS 2
+
+static void PutShort(unsigned char* p, unsigned short int value)
+{
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+static unsigned short int GetShort(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static void PutLong(unsigned char* p, unsigned long long value)
+{
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        p[i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+static unsigned long long GetLong(const unsigned char* p)
+{
+    unsigned long long value = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+
+/*
+ * Write CPU to output, storing only memory that differs from image.
+ */
+int WriteSnapshot(FILE* output, MachineState* CPU, const unsigned short int* image)
+{
+    unsigned char header[SNAPSHOT_HEADER_SIZE];
+    unsigned char run[4];
+    unsigned char word[2];
+    unsigned short int* memory = malloc(65536 * sizeof(unsigned short int));
+    int start;
+    int end;
+    int gap;
+    int i;
+
+    if (memory == NULL) {
+        return 1;
+    }
+    DumpMemory(CPU, memory);
+
+    memcpy(header, SNAPSHOT_MAGIC, 8);
+    PutShort(header + 8, SNAPSHOT_VERSION);
+    PutShort(header + 10, CPU->PC);
+    PutShort(header + 12, CPU->PSR);
+    for (i = 0; i < 8; i++) {
+        PutShort(header + 14 + 2 * i, CPU->R[i]);
+    }
+    PutShort(header + 30, CPU->regInputVal);
+    PutShort(header + 32, CPU->NZPVal);
+    PutShort(header + 34, CPU->dmemAddr);
+    PutShort(header + 36, CPU->dmemValue);
+    header[38] = CPU->rsMux_CTL;
+    header[39] = CPU->rtMux_CTL;
+    header[40] = CPU->rdMux_CTL;
+    header[41] = CPU->regFile_WE;
+    header[42] = CPU->NZP_WE;
+    header[43] = CPU->DATA_WE;
+    PutLong(header + 44, CPU->instrCount);
+    PutLong(header + 52, HashMemory(image));
+    fwrite(header, 1, sizeof(header), output);
+
+    for (start = 0; start < 65536; start = end) {
+        if (memory[start] == image[start]) {
+            end = start + 1;
+            continue;
+        }
+        // Extend the run over short stretches of unchanged words
+        end = start + 1;
+        for (;;) {
+            while (end < 65536 && end - start < 0xFFFF && memory[end] != image[end]) {
+                end++;
+            }
+            for (gap = 0; end + gap < 65536 && gap <= RUN_HEADER_WORDS && memory[end + gap] == image[end + gap]; gap++) {
+            }
+            if (end + gap >= 65536 || gap > RUN_HEADER_WORDS || end + gap - start >= 0xFFFF) {
+                break;
+            }
+            end += gap;
+        }
+        PutShort(run, start);
+        PutShort(run + 2, end - start);
+        fwrite(run, 1, sizeof(run), output);
+        for (i = start; i < end; i++) {
+            PutShort(word, memory[i]);
+            fwrite(word, 1, sizeof(word), output);
+        }
+    }
+    memset(run, 0, sizeof(run));
+    fwrite(run, 1, sizeof(run), output);
+    free(memory);
+    return ferror(output) ? 1 : 0;
+}
+
+
+/*
+ * Restore CPU from a snapshot taken against image.
+ */
+int ReadSnapshot(FILE* input, MachineState* CPU, const unsigned short int* image)
+{
+    unsigned char header[SNAPSHOT_HEADER_SIZE];
+    unsigned char run[4];
+    unsigned char word[2];
+    unsigned short int start;
+    unsigned short int length;
+    int i;
+
+    if (fread(header, 1, sizeof(header), input) != sizeof(header)) {
+        return 1;
+    }
+    if (memcmp(header, SNAPSHOT_MAGIC, 8) != 0 || GetShort(header + 8) != SNAPSHOT_VERSION) {
+        return 1;
+    }
+    if (GetLong(header + 52) != HashMemory(image)) { // taken against other object files
+        return 1;
+    }
+
+    CPU->PC = GetShort(header + 10);
+    CPU->PSR = GetShort(header + 12);
+    for (i = 0; i < 8; i++) {
+        CPU->R[i] = GetShort(header + 14 + 2 * i);
+    }
+    CPU->regInputVal = GetShort(header + 30);
+    CPU->NZPVal = GetShort(header + 32);
+    CPU->dmemAddr = GetShort(header + 34);
+    CPU->dmemValue = GetShort(header + 36);
+    CPU->rsMux_CTL = header[38];
+    CPU->rtMux_CTL = header[39];
+    CPU->rdMux_CTL = header[40];
+    CPU->regFile_WE = header[41];
+    CPU->NZP_WE = header[42];
+    CPU->DATA_WE = header[43];
+    CPU->instrCount = GetLong(header + 44);
+
+    for (;;) {
+        if (fread(run, 1, sizeof(run), input) != sizeof(run)) {
+            return 1;
+        }
+        start = GetShort(run);
+        length = GetShort(run + 2);
+        if (length == 0) {
+            return 0;
+        }
+        if (start + length > 65536) {
+            return 1;
+        }
+        for (i = 0; i < length; i++) {
+            if (fread(word, 1, sizeof(word), input) != sizeof(word)) {
+                return 1;
+            }
+            WriteMemory(CPU, start + i, GetShort(word));
+        }
+    }
+}
@@ -0,0 +1,37 @@
+/*
+ * snapshot.h: Declares checkpoint/restore of the machine state
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdio.h>
+#include "LC4.h"
+
+// Snapshot file layout, all little endian:
+//   60 byte header: magic, version, PC, PSR, R0-R7, regInputVal, NZPVal,
+//   dmemAddr, dmemValue, the six control signals, instrCount and a hash of
+//   the loaded image
+//   then runs of memory that differ from the image: start, length, words,
+//   ended by a run of length 0
+#define SNAPSHOT_MAGIC       "LC4SNAPS"
+#define SNAPSHOT_VERSION     1
+#define SNAPSHOT_HEADER_SIZE 60
+
+/*
+ * Write CPU to output. image is memory as it was right after loading the
+ * object files; only the words that differ from it are stored.
+ * Returns 0 on success.
+ */
+int WriteSnapshot(FILE* output, MachineState* CPU, const unsigned short int* image);
+
+
+/*
+ * Restore CPU from a snapshot. CPU must hold the same loaded image the
+ * snapshot was taken against, as after loading the same object files; a
+ * snapshot of a different image is rejected. The trace format is left alone.
+ * Returns 0 on success.
+ */
+int ReadSnapshot(FILE* input, MachineState* CPU, const unsigned short int* image);
+
+#endif
@@ -0,0 +1,79 @@
+/*
+ * summary.c: Defines the end-of-run state summary written instead of a trace
+ */
+
+#include "summary.h"
+
+#define WORDS_PER_LINE 16
+
+/*
+ * FNV-1a hash of all of memory.
+ */
+unsigned long long HashMemory(const unsigned short int* memory)
+{
+    unsigned long long hash = 0xCBF29CE484222325ULL;
+    int i;
+
+    for (i = 0; i < 65536; i++) {
+        hash = (hash ^ (memory[i] & 0xFF)) * 0x100000001B3ULL;
+        hash = (hash ^ (memory[i] >> 8)) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+
+/*
+ * Write the final PC, PSR, registers, instruction count, a hash of memory and
+ * a dump of every word that differs from image.
+ */
+void WriteSummary(FILE* output, MachineState* CPU, const unsigned short int* image, int status)
+{
+    unsigned short int* memory = malloc(65536 * sizeof(unsigned short int));
+    int i;
+    int start;
+    int end;
+    int changed = 0;
+    int ranges = 0;
+
+    if (memory == NULL) {
+        fprintf(output, "error: out of memory\n");
+        return;
+    }
+    DumpMemory(CPU, memory);
+
+    fprintf(output, "status %s\n", status == 0 ? "halted" : "error");
+    fprintf(output, "instructions %llu\n", CPU->instrCount);
+    fprintf(output, "PC %04X\n", CPU->PC);
+    fprintf(output, "PSR %04X\n", CPU->PSR);
+    for (i = 0; i < 8; i++) {
+        fprintf(output, "%sR%d %04X", i == 0 ? "" : " ", i, CPU->R[i]);
+    }
+    fprintf(output, "\n");
+    fprintf(output, "memory hash %016llX\n", HashMemory(memory));
+
+    for (i = 0; i < 65536; i++) {
+        if (memory[i] != image[i]) {
+            changed++;
+            if (i == 0 || memory[i - 1] == image[i - 1]) {
+                ranges++;
+            }
+        }
+    }
+    fprintf(output, "memory changed %d words in %d ranges\n", changed, ranges);
+
+    // Each changed range is dumped as lines of up to 16 words led by their address
+    for (start = 0; start < 65536; start = end) {
+        if (memory[start] == image[start]) {
+            end = start + 1;
+            continue;
+        }
+        for (end = start; end < 65536 && memory[end] != image[end]; end++) {
+            if ((end - start) % WORDS_PER_LINE == 0) {
+                fprintf(output, "%s%04X:", end == start ? "" : "\n", end);
+            }
+            fprintf(output, " %04X", memory[end]);
+        }
+        fprintf(output, "\n");
+    }
+    free(memory);
+}
@@ -0,0 +1,24 @@
+/*
+ * summary.h: Declares the end-of-run state summary written instead of a trace
+ */
+
+#ifndef SUMMARY_H
+#define SUMMARY_H
+
+#include <stdio.h>
+#include "LC4.h"
+
+/*
+ * FNV-1a hash of all of memory.
+ */
+unsigned long long HashMemory(const unsigned short int* memory);
+
+
+/*
+ * Write the final PC, PSR, registers, instruction count, a hash of memory and
+ * a dump of every word that differs from image (memory right after loading).
+ * status is the value RunMachine returned.
+ */
+void WriteSummary(FILE* output, MachineState* CPU, const unsigned short int* image, int status);
+
+#endif
@@ -0,0 +1,480 @@
+/*
+ * superblock.c: Defines the portable superblock engine
+ *
+ * A block is the run of instructions from some PC up to and including the next
+ * taken-or-not branch, JMP, JSR, TRAP or RTI. Blocks never cross the 0x2000 or
+ * 0xA000 region boundaries and stop before the halt PC, so every instruction in
+ * a block has the same PC validity as its first one and privilege can only
+ * change at the end of a block. Each instruction becomes a SuperOp: a handler
+ * specialised for the exact operation (ADD, ADDI, CMPU, ...) plus its operands,
+ * so running it needs no decoding or sub-opcode dispatch.
+ */
+
+#include "superblock.h"
+
+#define BLOCK_LIMIT 64
+
+// Handler return values besides 0 (continue) and 1 (error)
+#define STOP_BLOCK 2    // a store dropped cached blocks, leave the current one
+
+typedef struct SuperOp SuperOp;
+
+typedef int (*SuperHandler)(SuperblockCache* cache, MachineState* CPU, const SuperOp* op, FILE* output);
+
+struct SuperOp {
+    SuperHandler run;
+    const char* signals;        // rsMux, rtMux, rdMux, regFile_WE, NZP_WE, DATA_WE
+    unsigned char d;
+    unsigned char s;
+    unsigned char t;
+    unsigned char nzp;          // BR condition mask
+    short int imm;
+    unsigned short int target;  // resolved branch, JMP or JSR target
+};
+
+typedef struct {
+    unsigned short int start;
+    unsigned short int length;
+    unsigned char os;           // block lies in OS memory
+    SuperOp ops[];
+} Superblock;
+
+struct SuperblockCache {
+    unsigned short int haltPC;
+    Superblock* blocks[65536];      // by start PC
+    unsigned char covered[65536];   // number of cached blocks holding each word
+};
+
+
+//////////////// HANDLERS ///////////////////////////
+
+
+static void SetSignals(MachineState* CPU, const char* signals)
+{
+    CPU->rsMux_CTL = signals[0];
+    CPU->rtMux_CTL = signals[1];
+    CPU->rdMux_CTL = signals[2];
+    CPU->regFile_WE = signals[3];
+    CPU->NZP_WE = signals[4];
+    CPU->DATA_WE = signals[5];
+}
+
+static short int UnsignedCompare(unsigned short int a, unsigned short int b)
+{
+    return (a > b) - (a < b);
+}
+
+// Instructions that write Rd and set NZP from it
+#define ALU_HANDLER(name, expr)                                                              \
+    static int name(SuperblockCache* cache, MachineState* CPU, const SuperOp* op, FILE* output) \
+    {                                                                                        \
+        SetSignals(CPU, op->signals);                                                        \
+        CPU->R[op->d] = (expr);                                                              \
+        SetNZP(CPU, CPU->R[op->d]);                                                          \
+        CPU->regInputVal = CPU->R[op->d];                                                    \
+        WriteOut(CPU, output);                                                               \
+        CPU->PC += 1;                                                                        \
+        return 0;                                                                            \
+    }
+
+ALU_HANDLER(AddRun,     CPU->R[op->s] + CPU->R[op->t])
+ALU_HANDLER(MulRun,     CPU->R[op->s] * CPU->R[op->t])
+ALU_HANDLER(SubRun,     CPU->R[op->s] - CPU->R[op->t])
+ALU_HANDLER(DivRun,     CPU->R[op->s] / CPU->R[op->t])
+ALU_HANDLER(AddIRun,    CPU->R[op->s] + op->imm)
+ALU_HANDLER(AndRun,     CPU->R[op->s] & CPU->R[op->t])
+ALU_HANDLER(NotRun,     ~CPU->R[op->s])
+ALU_HANDLER(OrRun,      CPU->R[op->s] | CPU->R[op->t])
+ALU_HANDLER(XorRun,     CPU->R[op->s] ^ CPU->R[op->t])
+ALU_HANDLER(AndIRun,    CPU->R[op->s] & op->imm)
+ALU_HANDLER(SllRun,     CPU->R[op->s] << op->imm)
+ALU_HANDLER(SraRun,     (signed short int)CPU->R[op->s] >> op->imm)
+ALU_HANDLER(SrlRun,     CPU->R[op->s] >> op->imm)
+ALU_HANDLER(ModRun,     CPU->R[op->s] % CPU->R[op->t])
+ALU_HANDLER(ConstRun,   op->imm)
+ALU_HANDLER(HiConstRun, (CPU->R[op->d] & 0xFF) | (op->imm << 8))
+
+// Comparisons only set NZP
+#define CMP_HANDLER(name, expr)                                                              \
+    static int name(SuperblockCache* cache, MachineState* CPU, const SuperOp* op, FILE* output) \
+    {                                                                                        \
+        SetSignals(CPU, op->signals);                                                        \
+        SetNZP(CPU, (expr));                                                                 \
+        WriteOut(CPU, output);                                                               \
+        CPU->PC += 1;                                                                        \
+        return 0;                                                                            \
+    }
+
+CMP_HANDLER(CmpRun,   (signed short)CPU->R[op->s] - (signed short)CPU->R[op->t])
+CMP_HANDLER(CmpURun,  UnsignedCompare(CPU->R[op->s], CPU->R[op->t]))
+CMP_HANDLER(CmpIRun,  CPU->R[op->s] - (unsigned short int)op->imm)
+CMP_HANDLER(CmpIURun, UnsignedCompare(CPU->R[op->s], op->imm))
+
+static int BrRun(SuperblockCache* cache, MachineState* CPU, const SuperOp* op, FILE* output)
+{
+    SetSignals(CPU, op->signals);
+    WriteOut(CPU, output);
+    if (op->nzp & CPU->PSR) {
+        CPU->PC = op->target;
+    } else {
+        CPU->PC += 1;
+    }
+    return 0;
+}
+
+static int JmpRun(SuperblockCache* cache, MachineState* CPU, const SuperOp* op, FILE* output)
+{
+    SetSignals(CPU, op->signals);
+    WriteOut(CPU, output);
+    CPU->PC = op->target;
+    return 0;
+}
+
+static int JmprRun(SuperblockCache* cache, MachineState* CPU, const SuperOp* op, FILE* output)
+{
+    SetSignals(CPU, op->signals);
+    WriteOut(CPU, output);
+    CPU->PC = CPU->R[op->s];
+    return 0;
+}
+
+static int JsrRun(SuperblockCache* cache, MachineState* CPU, const SuperOp* op, FILE* output)
+{
+    SetSignals(CPU, op->signals);
+    CPU->R[7] = CPU->PC + 1;
+    SetNZP(CPU, CPU->R[7]);
+    CPU->regInputVal = CPU->R[7];
+    WriteOut(CPU, output);
+    CPU->PC = op->target;
+    return 0;
+}
+
+static int JsrrRun(SuperblockCache* cache, MachineState* CPU, const SuperOp* op, FILE* output)
+{
+    SetSignals(CPU, op->signals);
+    CPU->R[7] = CPU->PC + 1;
+    SetNZP(CPU, CPU->R[7]);
+    CPU->regInputVal = CPU->R[7];
+    WriteOut(CPU, output);
+    CPU->PC = CPU->R[op->s]; // after R7 is written, as in JSROp
+    return 0;
+}
+
+static int RtiRun(SuperblockCache* cache, MachineState* CPU, const SuperOp* op, FILE* output)
+{
+    SetSignals(CPU, op->signals);
+    WriteOut(CPU, output);
+    CPU->PC = CPU->R[7];
+    CPU->PSR = CPU->PSR & 0x7FFF;
+    return 0;
+}
+
+static int TrapRun(SuperblockCache* cache, MachineState* CPU, const SuperOp* op, FILE* output)
+{
+    SetSignals(CPU, op->signals);
+    CPU->R[7] = CPU->PC + 1;
+    SetNZP(CPU, CPU->R[7]);
+    CPU->regInputVal = CPU->R[7];
+    WriteOut(CPU, output);
+    CPU->PSR = CPU->PSR | 0x8000;
+    CPU->PC = op->target;
+    return 0;
+}
+
+static int LdrRun(SuperblockCache* cache, MachineState* CPU, const SuperOp* op, FILE* output)
+{
+    SetSignals(CPU, op->signals);
+    CPU->dmemAddr = CPU->R[op->s] + op->imm;
+    if (CPU->PSR < 32768 && CPU->dmemAddr >= 0x8000) {
+        printf("error occurred\n");
+        return 1;
+    }
+    CPU->R[op->d] = ReadMemory(CPU, CPU->dmemAddr);
+    SetNZP(CPU, CPU->R[op->d]);
+    WriteOut(CPU, output);
+    CPU->PC += 1;
+    return 0;
+}
+
+static void DropBlock(SuperblockCache* cache, unsigned short int start);
+
+static int StrRun(SuperblockCache* cache, MachineState* CPU, const SuperOp* op, FILE* output)
+{
+    unsigned short int addr;
+    int first;
+    int i;
+
+    SetSignals(CPU, op->signals);
+    addr = CPU->R[op->s] + op->imm;
+    CPU->dmemAddr = addr;
+    if (CPU->PSR < 32768 && addr >= 0x8000) {
+        printf("error occurred\n");
+        return 1;
+    }
+    WriteMemory(CPU, addr, CPU->R[op->d]);
+    CPU->dmemValue = CPU->R[op->d];
+    WriteOut(CPU, output);
+    CPU->PC += 1;
+
+    if (cache->covered[addr] == 0) {
+        return 0;
+    }
+    // Self-modifying store: drop every block holding addr, possibly this one
+    first = addr >= BLOCK_LIMIT - 1 ? addr - (BLOCK_LIMIT - 1) : 0;
+    for (i = first; i <= addr; i++) {
+        if (cache->blocks[i] != NULL && i + cache->blocks[i]->length > addr) {
+            DropBlock(cache, i);
+        }
+    }
+    return STOP_BLOCK;
+}
+
+/*
+ * Opcodes 0011, 1011 and 1110 and HICONST with bit 8 clear change nothing, not even the PC.
+ */
+static int IllegalRun(SuperblockCache* cache, MachineState* CPU, const SuperOp* op, FILE* output)
+{
+    return 0;
+}
+
+
+//////////////// BLOCK CONSTRUCTION ///////////////////////////
+
+
+static const SuperHandler ArithRuns[5] = { AddRun, MulRun, SubRun, DivRun, AddIRun };
+static const SuperHandler LogicRuns[5] = { AndRun, NotRun, OrRun, XorRun, AndIRun };
+static const SuperHandler ShiftRuns[4] = { SllRun, SraRun, SrlRun, ModRun };
+static const SuperHandler CmpRuns[4] = { CmpRun, CmpURun, CmpIRun, CmpIURun };
+
+/*
+ * Fill op for the instruction insn at pc. Returns 1 if it ends the block.
+ */
+static int BindOp(SuperOp* op, DecodedInsn* insn, unsigned short int pc)
+{
+    op->d = insn->d;
+    op->s = insn->s;
+    op->t = insn->t;
+    op->nzp = 0;
+    op->imm = insn->imm;
+    op->target = 0;
+    op->signals = "000110";
+
+    switch (insn->opcode) {
+    case OP_BR:
+        op->run = BrRun;
+        op->signals = "000000";
+        op->nzp = insn->sub;
+        op->target = pc + 1 + insn->imm;
+        return insn->sub != 0; // NOP never branches
+    case OP_ARITH:
+        op->run = ArithRuns[insn->sub];
+        return 0;
+    case OP_CMP:
+        op->run = CmpRuns[insn->sub];
+        op->signals = "100010";
+        return 0;
+    case OP_LOGIC:
+        op->run = LogicRuns[insn->sub];
+        return 0;
+    case OP_SHIFT:
+        op->run = ShiftRuns[insn->sub];
+        return 0;
+    case OP_CONST:
+        op->run = ConstRun;
+        return 0;
+    case OP_HICONST:
+        if (insn->sub == 0) {
+            op->run = IllegalRun;
+            return 1;
+        }
+        op->run = HiConstRun;
+        return 0;
+    case OP_LDR:
+        op->run = LdrRun;
+        return 0;
+    case OP_STR:
+        op->run = StrRun;
+        op->signals = "010001";
+        return 0;
+    case OP_JMP:
+        op->signals = "000000";
+        if (insn->sub == 0) {
+            op->run = JmprRun;
+        } else {
+            op->run = JmpRun;
+            op->target = pc + 1 + insn->imm;
+        }
+        return 1;
+    case OP_JSR:
+        op->signals = "001110";
+        if (insn->sub == 0) {
+            op->run = JsrrRun;
+        } else {
+            op->run = JsrRun;
+            op->target = (pc & 0x8000) | (insn->imm << 4);
+        }
+        return 1;
+    case OP_TRAP:
+        op->run = TrapRun;
+        op->signals = "001110";
+        op->target = 0x8000 | insn->imm;
+        return 1;
+    case OP_RTI:
+        op->run = RtiRun;
+        op->signals = "100000";
+        return 1;
+    }
+    op->run = IllegalRun;
+    return 1;
+}
+
+/*
+ * Returns 1 if pc is in a region some privilege level may execute.
+ */
+static int ExecutableRegion(unsigned short int pc)
+{
+    return pc < 0x2000 || (pc >= 0x8000 && pc < 0xA000);
+}
+
+/*
+ * Build and cache the block starting at the current PC, which must be valid.
+ * Returns NULL if out of memory.
+ */
+static Superblock* BuildBlock(SuperblockCache* cache, MachineState* CPU)
+{
+    SuperOp ops[BLOCK_LIMIT];
+    unsigned short int start = CPU->PC;
+    unsigned short int pc = start;
+    Superblock* block;
+    int n = 0;
+    int i;
+
+    for (;;) {
+        if (!DecodedAt(CPU, pc)->valid) {
+            DecodeInstruction(CPU, pc);
+        }
+        n++;
+        if (BindOp(&ops[n - 1], DecodedAt(CPU, pc), pc)) {
+            break;
+        }
+        pc++;
+        if (n == BLOCK_LIMIT || pc == cache->haltPC || !ExecutableRegion(pc)) {
+            break;
+        }
+    }
+
+    block = malloc(sizeof(Superblock) + n * sizeof(SuperOp));
+    if (block == NULL) {
+        return NULL;
+    }
+    block->start = start;
+    block->length = n;
+    block->os = start >= 0x8000;
+    memcpy(block->ops, ops, n * sizeof(SuperOp));
+
+    cache->blocks[start] = block;
+    for (i = 0; i < n; i++) {
+        cache->covered[(unsigned short int)(start + i)]++;
+    }
+    return block;
+}
+
+static void DropBlock(SuperblockCache* cache, unsigned short int start)
+{
+    Superblock* block = cache->blocks[start];
+    int i;
+
+    for (i = 0; i < block->length; i++) {
+        cache->covered[(unsigned short int)(start + i)]--;
+    }
+    cache->blocks[start] = NULL;
+    free(block);
+}
+
+
+//////////////// PUBLIC INTERFACE ///////////////////////////
+
+
+/*
+ * Allocate an empty block cache.
+ */
+SuperblockCache* SuperblockCreate(void)
+{
+    return calloc(1, sizeof(SuperblockCache));
+}
+
+
+/*
+ * Free the cache and every block in it.
+ */
+void SuperblockDestroy(SuperblockCache* cache)
+{
+    SuperblockFlush(cache);
+    free(cache);
+}
+
+
+/*
+ * Drop every block.
+ */
+void SuperblockFlush(SuperblockCache* cache)
+{
+    int i;
+
+    for (i = 0; i < 65536; i++) {
+        if (cache->blocks[i] != NULL) {
+            DropBlock(cache, i);
+        }
+    }
+}
+
+
+/*
+ * Execute instructions until the PC reaches haltPC.
+ */
+int SuperblockRun(SuperblockCache* cache, MachineState* CPU, FILE* output, unsigned short int haltPC)
+{
+    Superblock* block;
+    const SuperOp* op;
+    int status;
+    int i;
+
+    if (cache->haltPC != haltPC) { // blocks are cut at the halt PC they were built for
+        SuperblockFlush(cache);
+        cache->haltPC = haltPC;
+    }
+
+    while (CPU->PC != haltPC) {
+        block = cache->blocks[CPU->PC];
+        if (block == NULL) {
+            if (!ExecutableRegion(CPU->PC) || (CPU->PSR < 0x8000 && CPU->PC >= 0x8000)) {
+                printf("error occurred\n");
+                return 1;
+            }
+            block = BuildBlock(cache, CPU);
+            if (block == NULL) {
+                return RunMachine(CPU, output, haltPC);
+            }
+        } else if (block->os && CPU->PSR < 0x8000) { // the only PC check for the whole block
+            printf("error occurred\n");
+            return 1;
+        }
+
+        // instrCount is kept current per op, since trace sampling reads it
+        status = 0;
+        for (i = 0, op = block->ops; i < block->length; i++, op++) {
+            status = op->run(cache, CPU, op, output);
+            if (status != 0) {
+                break;
+            }
+            CPU->instrCount++;
+        }
+        if (status == 1) {
+            return 1;
+        }
+        if (status == STOP_BLOCK) {
+            CPU->instrCount++;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,41 @@
+/*
+ * superblock.h: Declares the portable superblock engine
+ */
+
+#ifndef SUPERBLOCK_H
+#define SUPERBLOCK_H
+
+#include "LC4.h"
+
+typedef struct SuperblockCache SuperblockCache;
+
+/*
+ * Allocate an empty block cache. Returns NULL if out of memory.
+ */
+SuperblockCache* SuperblockCreate(void);
+
+
+/*
+ * Free the cache and every block in it.
+ */
+void SuperblockDestroy(SuperblockCache* cache);
+
+
+/*
+ * Drop every block, e.g. after memory was changed outside of SuperblockRun.
+ */
+void SuperblockFlush(SuperblockCache* cache);
+
+
+/*
+ * Execute instructions until the PC reaches haltPC, like RunMachine. Straight-line
+ * runs of instructions are converted once into arrays of handlers with their
+ * operands already resolved and run back to back, with the PC range check done
+ * once per block instead of once per instruction. Blocks are cached by start PC
+ * and dropped when a store writes into them. The trace written to output (if
+ * not NULL) and the machine state match RunMachine exactly.
+ * Returns 1 if an error occurred.
+ */
+int SuperblockRun(SuperblockCache* cache, MachineState* CPU, FILE* output, unsigned short int haltPC);
+
+#endif
@@ -3,37 +3,436 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include "loader.h"
+#include "tracewriter.h"
+#include "tracecompress.h"
+#include "loopsummary.h"
+#include "summary.h"
+#include "jit.h"
+#include "superblock.h"
+#include "snapshot.h"
+#include "imagecache.h"
+#include "verify.h"
+#include "script.h"
+#include "devices.h"
+#ifdef LC4_PROFILE
+#include "profile.h"
+
+#define PROFILE_TOP 20 // lines in each table of the report
+#endif
+
+#define VERIFY_CHUNK 4096 // instructions between checks for a divergence
+
+/*
+ * RunMachineUntil the halt routine, through the device bus if there is one.
+ */
+static int RunUntil(MachineState* CPU, FILE* output, DeviceBus* devices, unsigned long long stopCount)
+{
+    if (devices != NULL) {
+        return RunWithDevices(devices, CPU, output, 0x80FF, stopCount);
+    }
+    return RunMachineUntil(CPU, output, 0x80FF, stopCount);
+}
+
+
+/*
+ * Parse <first>:<second> in base. Returns 0 on success.
+ */
+static int ParsePair(const char* arg, int base, unsigned long long* first, unsigned long long* second)
+{
+    char* end;
+
+    *first = strtoull(arg, &end, base);
+    if (end == arg || *end != ':') {
+        return 1;
+    }
+    arg = end + 1;
+    *second = strtoull(arg, &end, base);
+    return end == arg || *end != '\0';
+}
+
+
+/*
+ * Save CPU to <name>.<instruction count>.snap. Returns 0 on success.
+ */
+static int SaveCheckpoint(MachineState* CPU, const char* name, const unsigned short int* image)
+{
+    char filename[FILENAME_MAX];
+    FILE* file;
+    int failed;
+
+    snprintf(filename, sizeof(filename), "%s.%llu.snap", name, CPU->instrCount);
+    file = fopen(filename, "wb");
+    if (file == NULL) {
+        printf("error: cannot open %s\n", filename);
+        return 1;
+    }
+    failed = WriteSnapshot(file, CPU, image);
+    if (fclose(file) != 0 || failed) {
+        printf("error: cannot write %s\n", filename);
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Restore CPU from the snapshot in filename. Returns 0 on success.
+ */
+static int LoadCheckpoint(MachineState* CPU, const char* filename, const unsigned short int* image)
+{
+    FILE* file = fopen(filename, "rb");
+    int failed;
+
+    if (file == NULL) {
+        printf("error: cannot open %s\n", filename);
+        return 1;
+    }
+    failed = ReadSnapshot(file, CPU, image);
+    fclose(file);
+    if (failed) {
+        printf("error: %s is not a snapshot of these object files\n", filename);
+    }
+    return failed;
+}
 
-// Global variable defining the current state of the machine
-MachineState* CPU;
 
 int main(int argc, char** argv) {
-    int i;
     FILE *output;
     MachineState state;
-    CPU = &state;
+    MachineState* CPU = &state;
     int test;
+    int first = 1; // index of the output file argument
+    int async = 0;
+    int compress = 0;
+    int summarize = 0;
+    int traceOff = 0;
+    int useJit = 0;
+    int useSuperblocks = 0;
+    unsigned long long checkpointEvery = 0;
+    unsigned long long nextCheckpoint;
+    int verify = 0;
+    int failed = 0;
+    char *resume = NULL;
+    char *imageCache = NULL;
+    char *script = NULL;
+    char *keyboardFile = NULL;
+    char *displayFile = NULL;
+    FILE *keyboard = NULL;
+    FILE *display = NULL;
+    DeviceBus *devices = NULL;
+    TraceFilter filter;
+    unsigned long long start, end;
+    int window = 0;
+    unsigned long long windowStart = 0;
+    unsigned long long windowLength = 0;
+    int status;
+    unsigned short int *image = NULL;
+    FILE *file;
+    TraceWriter *writer = NULL;
+    TraceCompressor *compressor = NULL;
+    LoopSummarizer *summarizer = NULL;
+    TraceVerifier *verifier = NULL;
+    JitState *jit = NULL;
+    SuperblockCache *superblocks = NULL;
+#ifdef LC4_PROFILE
+    char *profileFile = NULL;
+    Profile *profile = NULL;
+#endif
     Reset(CPU);
+    memset(&filter, 0, sizeof(filter));
+
+    while (first < argc && argv[first][0] == '-') { // options come before the output file
+        if (strcmp(argv[first], "-b") == 0) { // binary trace, see tracedump
+            CPU->traceFormat = TRACE_BINARY;
+        } else if (strcmp(argv[first], "-z") == 0) { // compressed binary trace, see tracedump
+            CPU->traceFormat = TRACE_BINARY;
+            compress = 1;
+        } else if (strcmp(argv[first], "--summarize-loops") == 0) { // text trace with repeated loop iterations folded, see traceexpand
+            summarize = 1;
+        } else if (strcmp(argv[first], "-a") == 0) { // write the trace from a separate thread
+            async = 1;
+        } else if (strcmp(argv[first], "--no-trace") == 0) { // only write a summary at halt
+            traceOff = 1;
+        } else if (strcmp(argv[first], "--jit") == 0) { // translate to native code, needs --no-trace
+            useJit = 1;
+        } else if (strcmp(argv[first], "--superblock") == 0) { // run cached straight-line blocks of pre-bound handlers
+            useSuperblocks = 1;
+        } else if (strcmp(argv[first], "--checkpoint") == 0 && first + 1 < argc) { // snapshot every N instructions
+            checkpointEvery = strtoull(argv[++first], NULL, 10);
+        } else if (strcmp(argv[first], "--resume") == 0 && first + 1 < argc) { // start from a snapshot
+            resume = argv[++first];
+        } else if (strcmp(argv[first], "--image-cache") == 0 && first + 1 < argc) { // reuse preprocessed memory images kept in a directory
+            imageCache = argv[++first];
+        } else if (strcmp(argv[first], "--verify") == 0) { // compare with the trace in the output file instead of writing it
+            verify = 1;
+        } else if (strcmp(argv[first], "--script") == 0 && first + 1 < argc) { // run PennSim commands, which name their own files
+            script = argv[++first];
+        } else if (strcmp(argv[first], "--keyboard") == 0 && first + 1 < argc) { // map the devices, reading keys from a file
+            keyboardFile = argv[++first];
+        } else if (strcmp(argv[first], "--display") == 0 && first + 1 < argc) { // map the devices, printing to a file
+            displayFile = argv[++first];
+        } else if (strcmp(argv[first], "--trace-pc") == 0 && first + 1 < argc) { // only trace PCs in start:end (hex), may be repeated
+            if (ParsePair(argv[++first], 16, &start, &end) != 0 || start > end || end > 0xFFFF) {
+                printf("invalid arguments\n");
+                return -1;
+            }
+            for (; start <= end; start++) {
+                filter.pcs[start >> 6] |= 1ULL << (start & 63);
+            }
+            filter.tests |= TRACE_FILTER_PC;
+        } else if (strcmp(argv[first], "--trace-user") == 0) { // only trace what runs in user mode
+            filter.tests |= TRACE_FILTER_USER;
+        } else if (strcmp(argv[first], "--trace-os") == 0) { // only trace what runs in OS mode
+            filter.tests |= TRACE_FILTER_OS;
+        } else if (strcmp(argv[first], "--trace-writes") == 0) { // only trace stores
+            filter.tests |= TRACE_FILTER_WRITES;
+        } else if (strcmp(argv[first], "--trace-every") == 0 && first + 1 < argc) { // only trace every Nth instruction
+            filter.every = strtoull(argv[++first], NULL, 10);
+            if (filter.every == 0) {
+                printf("invalid arguments\n");
+                return -1;
+            }
+            filter.tests |= TRACE_FILTER_EVERY;
+        } else if (strcmp(argv[first], "--trace-window") == 0 && first + 1 < argc) { // only trace instructions K to K+M-1
+            if (ParsePair(argv[++first], 10, &windowStart, &windowLength) != 0) {
+                printf("invalid arguments\n");
+                return -1;
+            }
+            window = 1;
+#ifdef LC4_PROFILE
+        } else if (strcmp(argv[first], "--profile") == 0 && first + 1 < argc) { // count what runs, report at halt
+            profileFile = argv[++first];
+#endif
+        } else {
+            printf("invalid arguments\n");
+            return -1;
+        }
+        first++;
+    }
     
-    if (argc < 3) { // if there isn't at least 3 arguments
+#ifdef LC4_PROFILE
+    // Only the interpreter counts instructions
+    if (profileFile != NULL && (useJit || useSuperblocks)) {
+        printf("invalid arguments\n");
+        return -1;
+    }
+#endif
+
+    // A script names its own files and runs the interpreter itself, so no other option applies
+    if (script != NULL) {
+        if (argc != first || filter.tests || window || CPU->traceFormat != TRACE_TEXT || compress || summarize || async ||
+            traceOff || useJit || useSuperblocks || verify || checkpointEvery || resume != NULL || imageCache != NULL ||
+            keyboardFile != NULL || displayFile != NULL) {
+            printf("invalid arguments\n");
+            return -1;
+        }
+#ifdef LC4_PROFILE
+        if (profileFile != NULL) {
+            printf("invalid arguments\n");
+            return -1;
+        }
+#endif
+        return RunScript(script, CPU);
+    }
+
+    // Checkpoints need the interpreter, which can stop after any instruction
+    if (argc - first < 2 || (useJit && !traceOff) || (checkpointEvery && (useJit || useSuperblocks))) { // if there isn't an output file and at least one object file
 	  printf("invalid arguments\n");
       return -1;
     }
+    // Devices need the interpreter, and their state is not part of a snapshot
+    if ((keyboardFile != NULL || displayFile != NULL) && (useJit || useSuperblocks || checkpointEvery || resume != NULL)) {
+        printf("invalid arguments\n");
+        return -1;
+    }
+    // Filters thin out a trace that is written; a window needs runs that can stop anywhere
+    if ((filter.tests || window) && (traceOff || verify || ((filter.tests & TRACE_FILTER_USER) && (filter.tests & TRACE_FILTER_OS)))) {
+        printf("invalid arguments\n");
+        return -1;
+    }
+    if (window && (useSuperblocks || checkpointEvery || resume != NULL)) {
+        printf("invalid arguments\n");
+        return -1;
+    }
+    if (filter.tests) {
+        filter.next = windowStart; // sampling counts from the start of the window
+        CPU->traceFilter = &filter;
+    }
+    // The summarizer takes the binary trace and writes text
+    if (summarize && (CPU->traceFormat == TRACE_BINARY || verify)) {
+        printf("invalid arguments\n");
+        return -1;
+    }
+    if (summarize) {
+        CPU->traceFormat = TRACE_BINARY;
+    }
+    // Verifying runs the interpreter in steps, checking for a divergence after each
+    if (verify && (compress || traceOff || async || useSuperblocks || checkpointEvery || resume != NULL)) {
+        printf("invalid arguments\n");
+        return -1;
+    }
+
+    if (verify) {
+        verifier = VerifierOpen(argv[first], &CPU->traceFormat); // the golden trace decides the format
+        if (verifier == NULL) {
+            return -1;
+        }
+        file = NULL;
+        output = VerifierStream(verifier);
+    } else {
+        file = fopen(argv[first], CPU->traceFormat == TRACE_BINARY && !traceOff && !summarize ? "wb" : "w");
+        if (file == NULL) {
+            printf("error: cannot open %s\n", argv[first]);
+            return -1;
+        }
+        output = traceOff ? NULL : file;
+    }
+    if (compress && !traceOff) {
+        compressor = TraceCompressorOpen(file);
+        if (compressor == NULL) {
+            return -1;
+        }
+        output = TraceCompressorStream(compressor);
+    }
+    if (summarize && !traceOff) {
+        summarizer = LoopSummarizerOpen(file);
+        if (summarizer == NULL) {
+            return -1;
+        }
+        output = LoopSummarizerStream(summarizer);
+    }
+    if (async && !traceOff) { // with -z or --summarize-loops this runs on the writer thread
+        writer = TraceWriterOpen(output, 1 << 20, 4);
+        if (writer != NULL) {
+            output = TraceWriterStream(writer);
+        }
+    }
+    if (CPU->traceFormat == TRACE_BINARY && !traceOff) {
+        WriteTraceHeader(output);
+    }
+    test = LoadObjectFiles(argv + first + 1, argc - first - 1, CPU, imageCache); // read each file in argument
+    if (test != 0) {
+        return -1;
+    }
 
-    output = fopen(argv[1], "w");
-    for (i = 2; i < argc; i++) { // read each file in argument
-        test = ReadObjectFile(argv[i], CPU);
-        if (test == -1) {
+    if (traceOff || checkpointEvery || resume != NULL) { // keep the loaded image for the summary and snapshots
+        image = malloc(65536 * sizeof(unsigned short int));
+        if (image == NULL) {
+            printf("error: out of memory\n");
             return -1;
         }
+        DumpMemory(CPU, image);
+    }
+    if (resume != NULL && LoadCheckpoint(CPU, resume, image) != 0) {
+        return -1;
     }
 
-    while (CPU->PC != 0x80FF) {
-        if (UpdateMachineState(CPU, output) == 1) {
-            break;
+#ifdef LC4_PROFILE
+    if (profileFile != NULL) {
+        profile = ProfileCreate();
+        if (profile == NULL) {
+            printf("error: out of memory\n");
+            return -1;
         }
+        CPU->profile = profile;
     }
+#endif
 
-    return 0;
+    if (keyboardFile != NULL || displayFile != NULL) { // the display defaults to stdout
+        keyboard = keyboardFile != NULL ? fopen(keyboardFile, "rb") : NULL;
+        display = displayFile != NULL ? fopen(displayFile, "wb") : stdout;
+        if ((keyboardFile != NULL && keyboard == NULL) || display == NULL) {
+            printf("error: cannot open %s\n", keyboard == NULL && keyboardFile != NULL ? keyboardFile : displayFile);
+            return -1;
+        }
+        devices = DeviceBusCreate();
+        if (devices == NULL || AddStandardDevices(devices, CPU, keyboard, display) != 0) {
+            printf("error: cannot set up the devices\n");
+            return -1;
+        }
+    }
+
+    if (useJit) {
+        jit = JitCreate(); // NULL when the host can't run translated code
+    }
+    if (useSuperblocks) {
+        superblocks = SuperblockCreate();
+    }
+    if (jit != NULL) {
+        status = JitRun(jit, CPU, 0x80FF);
+        JitDestroy(jit);
+    } else if (superblocks != NULL) {
+        status = SuperblockRun(superblocks, CPU, output, 0x80FF);
+        SuperblockDestroy(superblocks);
+    } else if (verifier != NULL) {
+        nextCheckpoint = VERIFY_CHUNK;
+        while ((status = RunUntil(CPU, output, devices, nextCheckpoint)) == 2 && !VerifierDiverged(verifier)) {
+            nextCheckpoint += VERIFY_CHUNK;
+        }
+    } else if (checkpointEvery) {
+        nextCheckpoint = (CPU->instrCount / checkpointEvery + 1) * checkpointEvery;
+        while ((status = RunMachineUntil(CPU, output, 0x80FF, nextCheckpoint)) == 2) {
+            if (SaveCheckpoint(CPU, argv[first], image) != 0) {
+                return -1;
+            }
+            nextCheckpoint += checkpointEvery;
+        }
+    } else if (window) { // only trace inside the window, with no filtering cost outside it
+        status = RunUntil(CPU, NULL, devices, windowStart);
+        if (status == 2) {
+            status = RunUntil(CPU, output, devices, windowStart + windowLength);
+        }
+        if (status == 2) {
+            status = RunUntil(CPU, NULL, devices, ~0ULL);
+        }
+    } else {
+        status = RunUntil(CPU, output, devices, ~0ULL);
+    }
+    if (devices != NULL) {
+        DeviceBusDestroy(devices);
+        if (keyboard != NULL) {
+            fclose(keyboard);
+        }
+        if (display != stdout) {
+            fclose(display);
+        }
+    }
+
+    if (writer != NULL && TraceWriterClose(writer) != 0) {
+        printf("error: cannot write %s\n", argv[first]);
+        failed = -1;
+    }
+    if (summarizer != NULL && LoopSummarizerClose(summarizer) != 0) {
+        printf("error: cannot write %s\n", argv[first]);
+        failed = -1;
+    }
+    if (compressor != NULL && TraceCompressorClose(compressor) != 0) {
+        printf("error: cannot write %s\n", argv[first]);
+        failed = -1;
+    }
+    if (traceOff) {
+        WriteSummary(file, CPU, image, status);
+    }
+    if (verifier != NULL) {
+        failed = VerifierClose(verifier);
+    } else {
+        fclose(file);
+    }
+#ifdef LC4_PROFILE
+    if (profile != NULL) {
+        WriteProfileReport(stdout, profile, CPU, PROFILE_TOP);
+        file = fopen(profileFile, "w");
+        if (file == NULL) {
+            printf("error: cannot open %s\n", profileFile);
+        } else {
+            WriteProfileData(file, profile, CPU);
+            fclose(file);
+        }
+        ProfileDestroy(profile);
+    }
+#endif
+    free(image);
+    return failed;
 }
\ No newline at end of file
@@ -0,0 +1,598 @@
+/*
+ * tracecompress.c: Defines the compressed trace format and its streaming
+ * compressor and block reader
+ *
+ * Each record is predicted from the one before it and from the last record
+ * at the same PC:
+ *   PC      the PC that followed the previous record's PC last time, or the
+ *           next address the first time
+ *   insn    the word last seen at this PC
+ *   shape   the WE flags, register number and NZP value last seen at this PC
+ *   values  regInputVal, dmemAddr and dmemValue go on by the stride they
+ *           changed by between the last two times at this PC
+ * A run of records that all match their predictions is a 0 tag byte and a
+ * varint count. Any other record is a tag byte with a bit for each field
+ * that missed, followed by those fields: the instruction word as 2 bytes,
+ * the shape as a varint, and the PC and values as zigzag varints of their
+ * difference from the prediction.
+ */
+
+#define _GNU_SOURCE
+#include "tracecompress.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Tag bits for the fields a record has that were not predicted
+#define MISS_PC    0x01
+#define MISS_INSN  0x02
+#define MISS_SHAPE 0x04
+#define MISS_VALUE 0x08
+#define MISS_ADDR  0x10
+#define MISS_DATA  0x20
+
+// Longest encoding of a record: the tag, the word, a 2 byte shape and 4
+// varints of at most 3 bytes
+#define MAX_RECORD_BYTES 17
+
+// Room for a block's payload; a run takes fewer bytes than the records in it
+#define MAX_PAYLOAD (TRACEZ_BLOCK * MAX_RECORD_BYTES)
+
+// What was last seen at one PC
+typedef struct {
+    unsigned int block;                 // entries of earlier blocks read as all zero
+    unsigned short int next;            // PC that followed, less this PC + 1
+    unsigned short int insn;
+    unsigned short int shape;
+    unsigned short int value;
+    unsigned short int valueStride;
+    unsigned short int addr;
+    unsigned short int addrStride;
+    unsigned short int data;
+    unsigned short int dataStride;
+} PCModel;
+
+// State the compressor and the reader keep identically within a block
+typedef struct {
+    PCModel pcs[65536];
+    unsigned int block;
+    unsigned short int prevPC;
+} Model;
+
+
+/*
+ * Forget everything, so that the next block is decoded on its own.
+ */
+static void StartBlock(Model* model)
+{
+    model->block++;
+    model->prevPC = 0xFFFF; // the first PC is predicted to be 0
+}
+
+
+/*
+ * The entry for pc, cleared if it was last written in an earlier block.
+ */
+static PCModel* Entry(Model* model, unsigned short int pc)
+{
+    PCModel* entry = &model->pcs[pc];
+
+    if (entry->block != model->block) {
+        memset(entry, 0, sizeof(PCModel));
+        entry->block = model->block;
+    }
+    return entry;
+}
+
+
+/*
+ * The predicted PC of the next record.
+ */
+static unsigned short int PredictPC(Model* model)
+{
+    return model->prevPC + 1 + Entry(model, model->prevPC)->next;
+}
+
+
+/*
+ * WE flags, register number and NZP value of rec in one number.
+ */
+static unsigned short int Shape(const TraceRecord* rec)
+{
+    return rec->regFile_WE | rec->NZP_WE << 1 | rec->DATA_WE << 2 | (rec->regNum & 7) << 3 | rec->NZPVal << 6;
+}
+
+
+static void SetShape(TraceRecord* rec, unsigned short int shape)
+{
+    rec->regFile_WE = shape & 1;
+    rec->NZP_WE = (shape >> 1) & 1;
+    rec->DATA_WE = (shape >> 2) & 1;
+    rec->regNum = (shape >> 3) & 7;
+    rec->NZPVal = shape >> 6;
+}
+
+
+/*
+ * Update the model with rec, the record that followed prevPC.
+ */
+static void Learn(Model* model, const TraceRecord* rec)
+{
+    PCModel* entry;
+
+    Entry(model, model->prevPC)->next = rec->PC - model->prevPC - 1;
+    entry = Entry(model, rec->PC);
+    entry->insn = rec->insn;
+    entry->shape = Shape(rec);
+    entry->valueStride = rec->regInputVal - entry->value;
+    entry->value = rec->regInputVal;
+    entry->addrStride = rec->dmemAddr - entry->addr;
+    entry->addr = rec->dmemAddr;
+    entry->dataStride = rec->dmemValue - entry->data;
+    entry->data = rec->dmemValue;
+    model->prevPC = rec->PC;
+}
+
+
+static void PutLong(unsigned char* p, unsigned int value)
+{
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = (value >> 24) & 0xFF;
+}
+
+
+static unsigned int GetLong(const unsigned char* p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+
+/*
+ * Append value as a varint, 7 bits a byte, low bits first.
+ */
+static unsigned char* PutVarint(unsigned char* p, unsigned int value)
+{
+    while (value >= 0x80) {
+        *p++ = value | 0x80;
+        value >>= 7;
+    }
+    *p++ = value;
+    return p;
+}
+
+
+/*
+ * Append the 16 bit difference actual - predicted as a zigzag varint, so
+ * that small differences either way take one byte.
+ */
+static unsigned char* PutDifference(unsigned char* p, unsigned short int actual, unsigned short int predicted)
+{
+    short int difference = actual - predicted;
+
+    return PutVarint(p, (unsigned short int)((difference << 1) ^ (difference >> 15)));
+}
+
+
+/*
+ * Read a varint at *p, before end. Returns 1 if it runs past end.
+ */
+static int GetVarint(const unsigned char** p, const unsigned char* end, unsigned int* value)
+{
+    int shift = 0;
+
+    *value = 0;
+    do {
+        if (*p == end || shift > 28) {
+            return 1;
+        }
+        *value |= (unsigned int)(**p & 0x7F) << shift;
+        shift += 7;
+    } while (*(*p)++ & 0x80);
+    return 0;
+}
+
+
+/*
+ * Read a difference written by PutDifference and add it to predicted.
+ */
+static int GetDifference(const unsigned char** p, const unsigned char* end, unsigned short int* value)
+{
+    unsigned int zigzag;
+
+    if (GetVarint(p, end, &zigzag) != 0) {
+        return 1;
+    }
+    *value += (zigzag >> 1) ^ -(zigzag & 1);
+    return 0;
+}
+
+
+/*
+ * Read and check a compressed trace header.
+ */
+int ReadCompressedHeader(FILE* input)
+{
+    unsigned char header[TRACEZ_HEADER_SIZE];
+
+    if (fread(header, 1, sizeof(header), input) != sizeof(header)) {
+        return 1;
+    }
+    if (memcmp(header, TRACEZ_MAGIC, 8) != 0) {
+        return 1;
+    }
+    if ((header[8] | header[9] << 8) != TRACEZ_VERSION || GetLong(header + 12) != TRACEZ_BLOCK) {
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Read a block header. Returns 1 on success, 0 at end of file or if it is
+ * not a block header.
+ */
+static int ReadBlockHeader(FILE* input, unsigned int* length, unsigned int* count)
+{
+    unsigned char header[TRACEZ_BLOCK_HEADER_SIZE];
+
+    if (fread(header, 1, sizeof(header), input) != sizeof(header)) {
+        return 0;
+    }
+    *length = GetLong(header);
+    *count = GetLong(header + 4);
+    return *length <= MAX_PAYLOAD && *count <= TRACEZ_BLOCK;
+}
+
+
+/*
+ * Skip the next block.
+ */
+int SkipCompressedBlock(FILE* input, unsigned int* count)
+{
+    unsigned int length;
+
+    if (!ReadBlockHeader(input, &length, count)) {
+        return 0;
+    }
+    return fseek(input, length, SEEK_CUR) == 0;
+}
+
+
+/*
+ * Decode count records from the payload between p and end.
+ */
+static int DecodePayload(Model* model, const unsigned char* p, const unsigned char* end, TraceRecord* records,
+                         unsigned int count)
+{
+    TraceRecord* rec = records;
+    PCModel* entry;
+    unsigned int run = 0;
+    unsigned int shape;
+    unsigned char tag = 0;
+
+    StartBlock(model);
+    while (rec < records + count) {
+        if (run == 0) {
+            if (p == end) {
+                return 1;
+            }
+            tag = *p++;
+            if (tag == 0 && (GetVarint(&p, end, &run) != 0 || run == 0 || run > count - (rec - records))) {
+                return 1;
+            }
+        }
+
+        rec->PC = PredictPC(model);
+        if ((tag & MISS_PC) && GetDifference(&p, end, &rec->PC) != 0) {
+            return 1;
+        }
+        entry = Entry(model, rec->PC);
+        rec->insn = entry->insn;
+        if (tag & MISS_INSN) {
+            if (end - p < 2) {
+                return 1;
+            }
+            rec->insn = p[0] | p[1] << 8;
+            p += 2;
+        }
+        SetShape(rec, entry->shape);
+        if (tag & MISS_SHAPE) {
+            if (GetVarint(&p, end, &shape) != 0) {
+                return 1;
+            }
+            SetShape(rec, shape);
+        }
+        rec->regInputVal = entry->value + entry->valueStride;
+        rec->dmemAddr = entry->addr + entry->addrStride;
+        rec->dmemValue = entry->data + entry->dataStride;
+        if (((tag & MISS_VALUE) && GetDifference(&p, end, &rec->regInputVal) != 0) ||
+            ((tag & MISS_ADDR) && GetDifference(&p, end, &rec->dmemAddr) != 0) ||
+            ((tag & MISS_DATA) && GetDifference(&p, end, &rec->dmemValue) != 0)) {
+            return 1;
+        }
+
+        Learn(model, rec);
+        if (tag == 0) {
+            run--;
+        }
+        rec++;
+    }
+    return p != end;
+}
+
+
+/*
+ * Decode the next block into records.
+ */
+int ReadCompressedBlock(FILE* input, TraceRecord* records, unsigned int* count)
+{
+    unsigned int length;
+    unsigned char* payload;
+    Model* model;
+    int failed;
+
+    if (!ReadBlockHeader(input, &length, count)) {
+        return feof(input) ? 0 : -1;
+    }
+    payload = malloc(length > 0 ? length : 1);
+    model = calloc(1, sizeof(Model));
+    if (payload == NULL || model == NULL) {
+        free(payload);
+        free(model);
+        return -1;
+    }
+    failed = fread(payload, 1, length, input) != length ||
+             DecodePayload(model, payload, payload + length, records, *count) != 0;
+    free(payload);
+    free(model);
+    return failed ? -1 : 1;
+}
+
+
+#ifdef __GLIBC__
+
+struct TraceCompressor {
+    FILE* dest;
+    FILE* stream;                       // fopencookie stream taking the binary trace
+    Model model;
+
+    unsigned char* payload;             // of the block being compressed
+    unsigned char* end;                 // of the bytes written to payload
+    unsigned int count;                 // records in the block
+    unsigned int run;                   // predicted records not yet written
+
+    size_t headerLeft;                  // bytes of the binary header still to skip
+    unsigned char partial[TRACE_RECORD_SIZE]; // a record split between writes
+    size_t partialLength;
+    int failed;
+};
+
+
+/*
+ * Write out the pending run of predicted records.
+ */
+static void FlushRun(TraceCompressor* compressor)
+{
+    if (compressor->run > 0) {
+        *compressor->end++ = 0;
+        compressor->end = PutVarint(compressor->end, compressor->run);
+        compressor->run = 0;
+    }
+}
+
+
+/*
+ * Write the block to dest and start the next one.
+ */
+static void WriteBlock(TraceCompressor* compressor)
+{
+    unsigned char header[TRACEZ_BLOCK_HEADER_SIZE];
+    size_t length;
+
+    FlushRun(compressor);
+    length = compressor->end - compressor->payload;
+    PutLong(header, length);
+    PutLong(header + 4, compressor->count);
+    if (fwrite(header, 1, sizeof(header), compressor->dest) != sizeof(header) ||
+        fwrite(compressor->payload, 1, length, compressor->dest) != length) {
+        compressor->failed = 1;
+    }
+    compressor->end = compressor->payload;
+    compressor->count = 0;
+    StartBlock(&compressor->model);
+}
+
+
+/*
+ * Compress the binary record in buf.
+ */
+static void CompressRecord(TraceCompressor* compressor, const unsigned char* buf)
+{
+    Model* model = &compressor->model;
+    TraceRecord rec;
+    PCModel* entry;
+    unsigned short int pc;
+    unsigned short int shape;
+    unsigned char* p;
+    unsigned char tag = 0;
+
+    DecodeBinaryRecord(buf, &rec);
+    pc = PredictPC(model);
+    entry = Entry(model, rec.PC);
+    shape = Shape(&rec);
+    tag |= rec.PC != pc ? MISS_PC : 0;
+    tag |= rec.insn != entry->insn ? MISS_INSN : 0;
+    tag |= shape != entry->shape ? MISS_SHAPE : 0;
+    tag |= rec.regInputVal != (unsigned short int)(entry->value + entry->valueStride) ? MISS_VALUE : 0;
+    tag |= rec.dmemAddr != (unsigned short int)(entry->addr + entry->addrStride) ? MISS_ADDR : 0;
+    tag |= rec.dmemValue != (unsigned short int)(entry->data + entry->dataStride) ? MISS_DATA : 0;
+
+    if (tag == 0) {
+        compressor->run++;
+    } else {
+        FlushRun(compressor);
+        p = compressor->end;
+        *p++ = tag;
+        if (tag & MISS_PC) {
+            p = PutDifference(p, rec.PC, pc);
+        }
+        if (tag & MISS_INSN) {
+            *p++ = rec.insn & 0xFF;
+            *p++ = rec.insn >> 8;
+        }
+        if (tag & MISS_SHAPE) {
+            p = PutVarint(p, shape);
+        }
+        if (tag & MISS_VALUE) {
+            p = PutDifference(p, rec.regInputVal, entry->value + entry->valueStride);
+        }
+        if (tag & MISS_ADDR) {
+            p = PutDifference(p, rec.dmemAddr, entry->addr + entry->addrStride);
+        }
+        if (tag & MISS_DATA) {
+            p = PutDifference(p, rec.dmemValue, entry->data + entry->dataStride);
+        }
+        compressor->end = p;
+    }
+    Learn(model, &rec);
+
+    if (++compressor->count == TRACEZ_BLOCK) {
+        WriteBlock(compressor);
+    }
+}
+
+
+/*
+ * fopencookie write callback: skip the binary header, then compress each
+ * whole record, keeping a record split between writes for the next one.
+ */
+static ssize_t CookieWrite(void* cookie, const char* data, size_t size)
+{
+    TraceCompressor* compressor = cookie;
+    const unsigned char* bytes = (const unsigned char*)data;
+    size_t left = size;
+    size_t n;
+
+    n = compressor->headerLeft < left ? compressor->headerLeft : left;
+    compressor->headerLeft -= n;
+    bytes += n;
+    left -= n;
+
+    if (compressor->partialLength > 0) {
+        n = TRACE_RECORD_SIZE - compressor->partialLength;
+        if (n > left) {
+            n = left;
+        }
+        memcpy(compressor->partial + compressor->partialLength, bytes, n);
+        compressor->partialLength += n;
+        bytes += n;
+        left -= n;
+        if (compressor->partialLength < TRACE_RECORD_SIZE) {
+            return size;
+        }
+        CompressRecord(compressor, compressor->partial);
+        compressor->partialLength = 0;
+    }
+    for (; left >= TRACE_RECORD_SIZE; bytes += TRACE_RECORD_SIZE, left -= TRACE_RECORD_SIZE) {
+        CompressRecord(compressor, bytes);
+    }
+    memcpy(compressor->partial, bytes, left);
+    compressor->partialLength = left;
+    return size;
+}
+
+
+/*
+ * Write the file header and open the stream.
+ */
+TraceCompressor* TraceCompressorOpen(FILE* dest)
+{
+    cookie_io_functions_t io = { NULL, CookieWrite, NULL, NULL };
+    TraceCompressor* compressor = calloc(1, sizeof(TraceCompressor));
+    unsigned char header[TRACEZ_HEADER_SIZE];
+
+    if (compressor == NULL) {
+        printf("error: out of memory\n");
+        return NULL;
+    }
+    compressor->payload = malloc(MAX_PAYLOAD);
+    compressor->stream = fopencookie(compressor, "w", io);
+    if (compressor->payload == NULL || compressor->stream == NULL) {
+        printf("error: out of memory\n");
+        if (compressor->stream != NULL) {
+            fclose(compressor->stream);
+        }
+        free(compressor->payload);
+        free(compressor);
+        return NULL;
+    }
+    setvbuf(compressor->stream, NULL, _IOFBF, 1 << 16);
+    compressor->dest = dest;
+    compressor->end = compressor->payload;
+    compressor->headerLeft = TRACE_HEADER_SIZE;
+    StartBlock(&compressor->model);
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, TRACEZ_MAGIC, 8);
+    header[8] = TRACEZ_VERSION;
+    PutLong(header + 12, TRACEZ_BLOCK);
+    if (fwrite(header, 1, sizeof(header), dest) != sizeof(header)) {
+        compressor->failed = 1;
+    }
+    return compressor;
+}
+
+
+/*
+ * The stream to write the binary trace to.
+ */
+FILE* TraceCompressorStream(TraceCompressor* compressor)
+{
+    return compressor->stream;
+}
+
+
+/*
+ * Write the last partial block and free the compressor.
+ */
+int TraceCompressorClose(TraceCompressor* compressor)
+{
+    int failed;
+
+    fclose(compressor->stream);
+    if (compressor->count > 0) {
+        WriteBlock(compressor);
+    }
+    if (fflush(compressor->dest) != 0) {
+        compressor->failed = 1;
+    }
+    failed = compressor->failed;
+    free(compressor->payload);
+    free(compressor);
+    return failed;
+}
+
+#else
+
+/*
+ * Without fopencookie there is no way to hand out a FILE* that compresses
+ * what is written to it, so compressed traces are not available.
+ */
+TraceCompressor* TraceCompressorOpen(FILE* dest)
+{
+    printf("error: compressed traces are not supported on this host\n");
+    return NULL;
+}
+
+FILE* TraceCompressorStream(TraceCompressor* compressor)
+{
+    return NULL;
+}
+
+int TraceCompressorClose(TraceCompressor* compressor)
+{
+    return 1;
+}
+
+#endif
@@ -0,0 +1,68 @@
+/*
+ * tracecompress.h: Declares the compressed trace format and its streaming
+ * compressor and block reader
+ */
+
+#ifndef TRACECOMPRESS_H
+#define TRACECOMPRESS_H
+
+#include <stdio.h>
+#include "tracefmt.h"
+
+// Compressed trace file layout, all little endian: a 16 byte header (magic,
+// version, records per block), then blocks of an 8 byte header (payload
+// bytes, records) and the payload. Every block is decoded on its own, so a
+// reader can skip to any block by its header alone.
+#define TRACEZ_MAGIC       "LC4TRACZ"
+#define TRACEZ_VERSION     1
+#define TRACEZ_HEADER_SIZE 16
+#define TRACEZ_BLOCK_HEADER_SIZE 8
+
+// Records per block
+#define TRACEZ_BLOCK 65536
+
+typedef struct TraceCompressor TraceCompressor;
+
+/*
+ * Start a compressed trace in dest. Returns NULL if out of memory or if the
+ * host has no way to make the stream.
+ */
+TraceCompressor* TraceCompressorOpen(FILE* dest);
+
+
+/*
+ * The stream the simulator writes the trace to, in the binary format
+ * (WriteTraceHeader, then WriteBinaryRecord). Records are compressed as
+ * they arrive and written to dest a block at a time.
+ */
+FILE* TraceCompressorStream(TraceCompressor* compressor);
+
+
+/*
+ * Write the last partial block and free the compressor. dest is flushed but
+ * not closed. Returns 0 if every write succeeded.
+ */
+int TraceCompressorClose(TraceCompressor* compressor);
+
+
+/*
+ * Read and check a compressed trace header. Returns 0 if it is valid.
+ */
+int ReadCompressedHeader(FILE* input);
+
+
+/*
+ * Skip the next block, setting count to its number of records. Returns 1 on
+ * success, 0 at end of file.
+ */
+int SkipCompressedBlock(FILE* input, unsigned int* count);
+
+
+/*
+ * Decode the next block into records, which must have room for TRACEZ_BLOCK,
+ * setting count to its number of records. Returns 1 on success, 0 at end of
+ * file and -1 if the block is damaged.
+ */
+int ReadCompressedBlock(FILE* input, TraceRecord* records, unsigned int* count);
+
+#endif
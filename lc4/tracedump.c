@@ -0,0 +1,99 @@
+/*
+ * tracedump.c: converts a binary or compressed trace back into the text format written by trace
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tracefmt.h"
+#include "tracecompress.h"
+
+/*
+ * Write the records of a compressed trace from record first on. Whole blocks
+ * before it are skipped by their headers without being decoded.
+ */
+static int DumpCompressed(FILE* input, FILE* output, unsigned long long first)
+{
+    TraceRecord* records = malloc(TRACEZ_BLOCK * sizeof(TraceRecord));
+    unsigned int count;
+    unsigned int i;
+    long start;
+    int status;
+
+    if (records == NULL) {
+        printf("error: out of memory\n");
+        return -1;
+    }
+    for (;;) {
+        start = ftell(input);
+        if (!SkipCompressedBlock(input, &count) || first < count) {
+            break;
+        }
+        first -= count;
+    }
+    fseek(input, start, SEEK_SET);
+
+    while ((status = ReadCompressedBlock(input, records, &count)) == 1) {
+        for (i = first; i < count; i++) {
+            WriteTextRecord(output, &records[i]);
+        }
+        first = 0;
+    }
+    free(records);
+    if (status != 0) {
+        printf("error: the compressed trace is damaged\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+int main(int argc, char** argv) {
+    FILE *input;
+    FILE *output = stdout;
+    TraceRecord rec;
+    unsigned long long first = 0; // record to start from
+    int arg = 1;
+    int failed = 0;
+
+    if (argc > 2 && strcmp(argv[1], "-s") == 0) {
+        first = strtoull(argv[2], NULL, 10);
+        arg = 3;
+    }
+    if (argc - arg < 1 || argc - arg > 2) {
+        printf("usage: tracedump [-s first] trace.bin [output.txt]\n");
+        return -1;
+    }
+
+    input = fopen(argv[arg], "rb");
+    if (input == NULL) {
+        printf("error: cannot open %s\n", argv[arg]);
+        return -1;
+    }
+
+    if (argc - arg == 2) {
+        output = fopen(argv[arg + 1], "w");
+        if (output == NULL) {
+            printf("error: cannot open %s\n", argv[arg + 1]);
+            return -1;
+        }
+    }
+
+    if (ReadCompressedHeader(input) == 0) {
+        failed = DumpCompressed(input, output, first);
+    } else {
+        rewind(input);
+        if (ReadTraceHeader(input) != 0) {
+            printf("error: %s is not a binary trace\n", argv[arg]);
+            return -1;
+        }
+        fseek(input, first * TRACE_RECORD_SIZE, SEEK_CUR);
+        while (ReadBinaryRecord(input, &rec)) {
+            WriteTextRecord(output, &rec);
+        }
+    }
+
+    fclose(input);
+    fclose(output);
+    return failed;
+}
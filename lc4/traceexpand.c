@@ -0,0 +1,37 @@
+/*
+ * traceexpand.c: rebuilds the full text trace from one written by trace --summarize-loops
+ */
+
+#include <stdio.h>
+#include "loopsummary.h"
+
+int main(int argc, char** argv) {
+    FILE *input;
+    FILE *output = stdout;
+    int failed;
+
+    if (argc < 2 || argc > 3) {
+        printf("usage: traceexpand summary.txt [output.txt]\n");
+        return -1;
+    }
+
+    input = fopen(argv[1], "r");
+    if (input == NULL) {
+        printf("error: cannot open %s\n", argv[1]);
+        return -1;
+    }
+
+    if (argc == 3) {
+        output = fopen(argv[2], "w");
+        if (output == NULL) {
+            printf("error: cannot open %s\n", argv[2]);
+            return -1;
+        }
+    }
+
+    failed = ExpandLoopSummary(input, output);
+
+    fclose(input);
+    fclose(output);
+    return failed ? -1 : 0;
+}
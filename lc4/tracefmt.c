@@ -0,0 +1,279 @@
+/*
+ * tracefmt.c: Defines the text and binary trace formats
+ */
+
+#include "tracefmt.h"
+#include <string.h>
+
+// Column offsets of the fields in "PPPP BBBBBBBBBBBBBBBB W R VVVV W N W AAAA VVVV\n"
+#define COL_PC       0
+#define COL_INSN     5
+#define COL_REG_WE   22
+#define COL_REG_NUM  24
+#define COL_REG_VAL  26
+#define COL_NZP_WE   31
+#define COL_NZP_VAL  33
+#define COL_DATA_WE  35
+#define COL_DMEM_ADR 37
+#define COL_DMEM_VAL 42
+#define LINE_LENGTH  (TRACE_LINE_LENGTH - 1)
+
+#ifdef LC4_REFERENCE_TEXT_TRACE
+
+/*
+ * Write a record in the PennSim text format (reference fprintf version).
+ */
+void WriteTextRecord(FILE* output, const TraceRecord* rec)
+{
+    int i;
+
+    fprintf(output, "%04X ", rec->PC);
+
+    for (i = 15; i >= 0; i--) {
+        fprintf(output, "%d", (rec->insn >> i) & 1);
+    }
+
+    fprintf(output, " %d %d %04X ", rec->regFile_WE, rec->regNum, rec->regInputVal);
+    fprintf(output, "%d %d ", rec->NZP_WE, rec->NZPVal);
+    fprintf(output, "%d %04X %04X", rec->DATA_WE, rec->dmemAddr, rec->dmemValue);
+
+    fprintf(output, "\n");
+}
+
+#else
+
+// Binary and hex spellings of every nibble
+static const char BinaryNibble[16][4] = {
+    {'0','0','0','0'}, {'0','0','0','1'}, {'0','0','1','0'}, {'0','0','1','1'},
+    {'0','1','0','0'}, {'0','1','0','1'}, {'0','1','1','0'}, {'0','1','1','1'},
+    {'1','0','0','0'}, {'1','0','0','1'}, {'1','0','1','0'}, {'1','0','1','1'},
+    {'1','1','0','0'}, {'1','1','0','1'}, {'1','1','1','0'}, {'1','1','1','1'}
+};
+static const char HexNibble[16] = "0123456789ABCDEF";
+
+/*
+ * Spell value as 4 hex digits at p.
+ */
+static void PutHex(char* p, unsigned short int value)
+{
+    p[0] = HexNibble[(value >> 12) & 0xF];
+    p[1] = HexNibble[(value >> 8) & 0xF];
+    p[2] = HexNibble[(value >> 4) & 0xF];
+    p[3] = HexNibble[value & 0xF];
+}
+
+/*
+ * Spell value as 16 binary digits at p.
+ */
+static void PutBinary(char* p, unsigned short int value)
+{
+    memcpy(p, BinaryNibble[(value >> 12) & 0xF], 4);
+    memcpy(p + 4, BinaryNibble[(value >> 8) & 0xF], 4);
+    memcpy(p + 8, BinaryNibble[(value >> 4) & 0xF], 4);
+    memcpy(p + 12, BinaryNibble[value & 0xF], 4);
+}
+
+/*
+ * Write a record in the PennSim text format. Every field has a fixed width,
+ * so the line is filled in place and written with one fwrite.
+ */
+void WriteTextRecord(FILE* output, const TraceRecord* rec)
+{
+    char line[LINE_LENGTH + 1];
+
+    memset(line, ' ', sizeof(line));
+    PutHex(line + COL_PC, rec->PC);
+    PutBinary(line + COL_INSN, rec->insn);
+    line[COL_REG_WE] = '0' + rec->regFile_WE;
+    line[COL_REG_NUM] = '0' + rec->regNum;
+    PutHex(line + COL_REG_VAL, rec->regInputVal);
+    line[COL_NZP_WE] = '0' + rec->NZP_WE;
+    line[COL_NZP_VAL] = '0' + rec->NZPVal;
+    line[COL_DATA_WE] = '0' + rec->DATA_WE;
+    PutHex(line + COL_DMEM_ADR, rec->dmemAddr);
+    PutHex(line + COL_DMEM_VAL, rec->dmemValue);
+    line[LINE_LENGTH] = '\n';
+
+    fwrite(line, 1, sizeof(line), output);
+}
+
+#endif
+
+
+/*
+ * Store a 16 bit value little endian.
+ */
+static void PutShort(unsigned char* p, unsigned short int value)
+{
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+
+/*
+ * Load a little endian 16 bit value.
+ */
+static unsigned short int GetShort(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+
+/*
+ * Write the header that starts a binary trace file.
+ */
+void WriteTraceHeader(FILE* output)
+{
+    unsigned char header[TRACE_HEADER_SIZE];
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, TRACE_MAGIC, 8);
+    PutShort(header + 8, TRACE_VERSION);
+    PutShort(header + 10, TRACE_RECORD_SIZE);
+    fwrite(header, 1, sizeof(header), output);
+}
+
+
+/*
+ * Read and check a binary trace header. Returns 0 if it is valid.
+ */
+int ReadTraceHeader(FILE* input)
+{
+    unsigned char header[TRACE_HEADER_SIZE];
+
+    if (fread(header, 1, sizeof(header), input) != sizeof(header)) {
+        return 1;
+    }
+    if (memcmp(header, TRACE_MAGIC, 8) != 0) {
+        return 1;
+    }
+    if (GetShort(header + 8) != TRACE_VERSION || GetShort(header + 10) != TRACE_RECORD_SIZE) {
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Write a record in the binary format:
+ *   0 PC, 2 instruction, 4 WE flags, 5 register number, 6 regInputVal,
+ *   8 NZP, 9 reserved, 10 dmemAddr, 12 dmemValue, 14 reserved
+ */
+void WriteBinaryRecord(FILE* output, const TraceRecord* rec)
+{
+    unsigned char buf[TRACE_RECORD_SIZE];
+
+    PutShort(buf, rec->PC);
+    PutShort(buf + 2, rec->insn);
+    buf[4] = (rec->regFile_WE ? TRACE_REG_WE : 0) | (rec->NZP_WE ? TRACE_NZP_WE : 0) | (rec->DATA_WE ? TRACE_DATA_WE : 0);
+    buf[5] = rec->regNum;
+    PutShort(buf + 6, rec->regInputVal);
+    buf[8] = rec->NZPVal;
+    buf[9] = 0;
+    PutShort(buf + 10, rec->dmemAddr);
+    PutShort(buf + 12, rec->dmemValue);
+    PutShort(buf + 14, 0);
+    fwrite(buf, 1, sizeof(buf), output);
+}
+
+
+/*
+ * Read the next binary record. Returns 1 on success, 0 at end of file.
+ */
+int ReadBinaryRecord(FILE* input, TraceRecord* rec)
+{
+    unsigned char buf[TRACE_RECORD_SIZE];
+
+    if (fread(buf, 1, sizeof(buf), input) != sizeof(buf)) {
+        return 0;
+    }
+    DecodeBinaryRecord(buf, rec);
+    return 1;
+}
+
+
+/*
+ * Unpack the binary record in buf.
+ */
+void DecodeBinaryRecord(const unsigned char* buf, TraceRecord* rec)
+{
+    rec->PC = GetShort(buf);
+    rec->insn = GetShort(buf + 2);
+    rec->regFile_WE = (buf[4] & TRACE_REG_WE) != 0;
+    rec->NZP_WE = (buf[4] & TRACE_NZP_WE) != 0;
+    rec->DATA_WE = (buf[4] & TRACE_DATA_WE) != 0;
+    rec->regNum = buf[5];
+    rec->regInputVal = GetShort(buf + 6);
+    rec->NZPVal = buf[8];
+    rec->dmemAddr = GetShort(buf + 10);
+    rec->dmemValue = GetShort(buf + 12);
+}
+
+
+/*
+ * Parse count hex digits at p into value. Returns 0 if they are all hex digits.
+ */
+static int ParseHex(const char* p, int count, unsigned short int* value)
+{
+    int i;
+
+    *value = 0;
+    for (i = 0; i < count; i++) {
+        if (p[i] >= '0' && p[i] <= '9') {
+            *value = (*value << 4) | (p[i] - '0');
+        } else if (p[i] >= 'A' && p[i] <= 'F') {
+            *value = (*value << 4) | (p[i] - 'A' + 10);
+        } else if (p[i] >= 'a' && p[i] <= 'f') {
+            *value = (*value << 4) | (p[i] - 'a' + 10);
+        } else {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Parse one line of a text trace.
+ */
+int ParseTextRecord(const char* line, size_t length, TraceRecord* rec)
+{
+    unsigned short int value;
+    int i;
+
+    if (length < LINE_LENGTH) {
+        return 1;
+    }
+    rec->insn = 0;
+    for (i = 0; i < 16; i++) {
+        if (line[COL_INSN + i] != '0' && line[COL_INSN + i] != '1') {
+            return 1;
+        }
+        rec->insn = (rec->insn << 1) | (line[COL_INSN + i] - '0');
+    }
+    if (ParseHex(line + COL_PC, 4, &rec->PC) || ParseHex(line + COL_REG_VAL, 4, &rec->regInputVal) ||
+        ParseHex(line + COL_DMEM_ADR, 4, &rec->dmemAddr) || ParseHex(line + COL_DMEM_VAL, 4, &rec->dmemValue)) {
+        return 1;
+    }
+    if (ParseHex(line + COL_REG_WE, 1, &value) || value > 1) {
+        return 1;
+    }
+    rec->regFile_WE = value;
+    if (ParseHex(line + COL_REG_NUM, 1, &value) || value > 7) {
+        return 1;
+    }
+    rec->regNum = value;
+    if (ParseHex(line + COL_NZP_WE, 1, &value) || value > 1) {
+        return 1;
+    }
+    rec->NZP_WE = value;
+    if (ParseHex(line + COL_NZP_VAL, 1, &value) || value > 7) {
+        return 1;
+    }
+    rec->NZPVal = value;
+    if (ParseHex(line + COL_DATA_WE, 1, &value) || value > 1) {
+        return 1;
+    }
+    rec->DATA_WE = value;
+    return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * tracefmt.h: Declares the trace record and the text/binary trace formats
+ */
+
+#ifndef TRACEFMT_H
+#define TRACEFMT_H
+
+#include <stdio.h>
+
+// Trace formats selectable through MachineState.traceFormat
+#define TRACE_TEXT   0
+#define TRACE_BINARY 1
+
+// Binary trace file layout: a 16 byte header followed by 16 byte records, all little endian
+#define TRACE_MAGIC       "LC4TRACE"
+#define TRACE_VERSION     1
+#define TRACE_HEADER_SIZE 16
+#define TRACE_RECORD_SIZE 16
+
+// Length of a text trace line, including the newline
+#define TRACE_LINE_LENGTH 47
+
+// Flag bits of a binary record
+#define TRACE_REG_WE  0x1
+#define TRACE_NZP_WE  0x2
+#define TRACE_DATA_WE 0x4
+
+/*
+ * One line of the trace, holding exactly the values that are printed.
+ * Fields that are not printed for an instruction are 0.
+ */
+typedef struct {
+    unsigned short int PC;
+    unsigned short int insn;
+    unsigned char regFile_WE;
+    unsigned char regNum;
+    unsigned short int regInputVal;
+    unsigned char NZP_WE;
+    unsigned char NZPVal;
+    unsigned char DATA_WE;
+    unsigned short int dmemAddr;
+    unsigned short int dmemValue;
+} TraceRecord;
+
+
+/*
+ * Write a record in the PennSim text format. Build with -DLC4_REFERENCE_TEXT_TRACE
+ * to use the original fprintf formatter instead of the table-driven one.
+ */
+void WriteTextRecord(FILE* output, const TraceRecord* rec);
+
+
+/*
+ * Write the header that starts a binary trace file.
+ */
+void WriteTraceHeader(FILE* output);
+
+
+/*
+ * Read and check a binary trace header. Returns 0 if it is valid.
+ */
+int ReadTraceHeader(FILE* input);
+
+
+/*
+ * Write a record in the binary format.
+ */
+void WriteBinaryRecord(FILE* output, const TraceRecord* rec);
+
+
+/*
+ * Read the next binary record. Returns 1 on success, 0 at end of file.
+ */
+int ReadBinaryRecord(FILE* input, TraceRecord* rec);
+
+
+/*
+ * Unpack the TRACE_RECORD_SIZE byte binary record in buf.
+ */
+void DecodeBinaryRecord(const unsigned char* buf, TraceRecord* rec);
+
+
+/*
+ * Parse one line of a text trace (length characters, not counting the
+ * newline). Returns 0 if it is a well formed record.
+ */
+int ParseTextRecord(const char* line, size_t length, TraceRecord* rec);
+
+#endif
@@ -0,0 +1,248 @@
+/*
+ * tracewriter.c: Defines the asynchronous trace writer
+ */
+
+#define _GNU_SOURCE
+#include "tracewriter.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __GLIBC__
+
+#include <pthread.h>
+
+struct TraceWriter {
+    FILE* dest;
+    FILE* stream;             // fopencookie stream feeding the ring
+
+    char** buffers;
+    size_t* lengths;          // bytes used in each buffer
+    size_t bufferSize;
+    int bufferCount;
+
+    int fill;                 // buffer the simulator is filling (simulator thread only)
+    int head;                 // oldest buffer queued for the writer thread
+    int queued;               // number of full buffers waiting to be written
+    int closing;
+    int failed;
+
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;  // signalled when a buffer is queued or on close
+    pthread_cond_t notFull;   // signalled when the writer thread frees a buffer
+    pthread_t thread;
+};
+
+
+/*
+ * Writer thread: write queued buffers to dest in order until closed.
+ */
+static void* WriterMain(void* arg)
+{
+    TraceWriter* writer = arg;
+    int index;
+
+    pthread_mutex_lock(&writer->lock);
+    for (;;) {
+        while (writer->queued == 0 && !writer->closing) {
+            pthread_cond_wait(&writer->notEmpty, &writer->lock);
+        }
+        if (writer->queued == 0) {
+            break;
+        }
+        index = writer->head;
+        pthread_mutex_unlock(&writer->lock);
+
+        if (fwrite(writer->buffers[index], 1, writer->lengths[index], writer->dest) != writer->lengths[index]) {
+            writer->failed = 1;
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        writer->lengths[index] = 0;
+        writer->head = (writer->head + 1) % writer->bufferCount;
+        writer->queued--;
+        pthread_cond_signal(&writer->notFull);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+
+/*
+ * Hand the buffer being filled to the writer thread, then wait until the
+ * next one is free (backpressure when the disk falls behind).
+ */
+static void QueueBuffer(TraceWriter* writer)
+{
+    pthread_mutex_lock(&writer->lock);
+    writer->queued++;
+    writer->fill = (writer->fill + 1) % writer->bufferCount;
+    pthread_cond_signal(&writer->notEmpty);
+    while (writer->queued == writer->bufferCount) {
+        pthread_cond_wait(&writer->notFull, &writer->lock);
+    }
+    pthread_mutex_unlock(&writer->lock);
+}
+
+
+/*
+ * fopencookie write callback: copy into the ring, queueing buffers as they fill.
+ * Only the simulator thread touches the buffer being filled, so no lock is
+ * needed until it is queued.
+ */
+static ssize_t CookieWrite(void* cookie, const char* data, size_t size)
+{
+    TraceWriter* writer = cookie;
+    size_t left = size;
+    size_t n;
+    int fill;
+
+    while (left > 0) {
+        fill = writer->fill;
+        n = writer->bufferSize - writer->lengths[fill];
+        if (n > left) {
+            n = left;
+        }
+        memcpy(writer->buffers[fill] + writer->lengths[fill], data, n);
+        writer->lengths[fill] += n;
+        data += n;
+        left -= n;
+        if (writer->lengths[fill] == writer->bufferSize) {
+            QueueBuffer(writer);
+        }
+    }
+    return size;
+}
+
+
+/*
+ * Start a writer thread that drains a ring of bufferCount buffers of bufferSize
+ * bytes into dest. Returns NULL if the writer could not be started.
+ */
+TraceWriter* TraceWriterOpen(FILE* dest, size_t bufferSize, int bufferCount)
+{
+    cookie_io_functions_t io = { NULL, CookieWrite, NULL, NULL };
+    TraceWriter* writer;
+    int i;
+
+    if (bufferCount < 2 || bufferSize == 0) {
+        return NULL;
+    }
+
+    writer = calloc(1, sizeof(TraceWriter));
+    if (writer == NULL) {
+        return NULL;
+    }
+    writer->dest = dest;
+    writer->bufferSize = bufferSize;
+    writer->bufferCount = bufferCount;
+    writer->buffers = calloc(bufferCount, sizeof(char*));
+    writer->lengths = calloc(bufferCount, sizeof(size_t));
+    if (writer->buffers == NULL || writer->lengths == NULL) {
+        free(writer->buffers);
+        free(writer->lengths);
+        free(writer);
+        return NULL;
+    }
+    for (i = 0; i < bufferCount; i++) {
+        writer->buffers[i] = malloc(bufferSize);
+        if (writer->buffers[i] == NULL) {
+            while (i-- > 0) {
+                free(writer->buffers[i]);
+            }
+            free(writer->buffers);
+            free(writer->lengths);
+            free(writer);
+            return NULL;
+        }
+    }
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->notEmpty, NULL);
+    pthread_cond_init(&writer->notFull, NULL);
+
+    // The ring is the buffer, so stdio passes every write straight through
+    writer->stream = fopencookie(writer, "w", io);
+    if (writer->stream != NULL) {
+        setvbuf(writer->stream, NULL, _IONBF, 0);
+    }
+    if (writer->stream == NULL || pthread_create(&writer->thread, NULL, WriterMain, writer) != 0) {
+        if (writer->stream != NULL) {
+            fclose(writer->stream);
+        }
+        for (i = 0; i < bufferCount; i++) {
+            free(writer->buffers[i]);
+        }
+        free(writer->buffers);
+        free(writer->lengths);
+        free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+
+/*
+ * The stream the simulator writes the trace to.
+ */
+FILE* TraceWriterStream(TraceWriter* writer)
+{
+    return writer->stream;
+}
+
+
+/*
+ * Queue the partly filled buffer, wait for the writer thread to drain
+ * everything, and free the writer. Returns 0 if every write succeeded.
+ */
+int TraceWriterClose(TraceWriter* writer)
+{
+    int i;
+    int failed;
+
+    fclose(writer->stream);
+
+    pthread_mutex_lock(&writer->lock);
+    if (writer->lengths[writer->fill] > 0) {
+        writer->queued++;
+    }
+    writer->closing = 1;
+    pthread_cond_signal(&writer->notEmpty);
+    pthread_mutex_unlock(&writer->lock);
+
+    pthread_join(writer->thread, NULL);
+    failed = writer->failed || fflush(writer->dest) != 0;
+
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->notEmpty);
+    pthread_cond_destroy(&writer->notFull);
+    for (i = 0; i < writer->bufferCount; i++) {
+        free(writer->buffers[i]);
+    }
+    free(writer->buffers);
+    free(writer->lengths);
+    free(writer);
+    return failed;
+}
+
+#else
+
+/*
+ * Without fopencookie there is no way to hand out a FILE* backed by the
+ * ring, so callers fall back to writing the trace synchronously.
+ */
+TraceWriter* TraceWriterOpen(FILE* dest, size_t bufferSize, int bufferCount)
+{
+    return NULL;
+}
+
+FILE* TraceWriterStream(TraceWriter* writer)
+{
+    return NULL;
+}
+
+int TraceWriterClose(TraceWriter* writer)
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,34 @@
+/*
+ * tracewriter.h: Declares the asynchronous trace writer
+ */
+
+#ifndef TRACEWRITER_H
+#define TRACEWRITER_H
+
+#include <stdio.h>
+
+typedef struct TraceWriter TraceWriter;
+
+/*
+ * Start a writer thread that drains a ring of bufferCount buffers of bufferSize
+ * bytes into dest. Returns NULL if the writer could not be started.
+ */
+TraceWriter* TraceWriterOpen(FILE* dest, size_t bufferSize, int bufferCount);
+
+
+/*
+ * The stream the simulator writes the trace to. Writes are copied into the
+ * current buffer; a full buffer is handed to the writer thread, and the
+ * simulator waits only when every buffer is still queued.
+ */
+FILE* TraceWriterStream(TraceWriter* writer);
+
+
+/*
+ * Queue the partly filled buffer, wait for the writer thread to drain
+ * everything, and free the writer. dest is flushed but not closed.
+ * Returns 0 if every write succeeded.
+ */
+int TraceWriterClose(TraceWriter* writer);
+
+#endif
@@ -0,0 +1,72 @@
+/*
+ * undo.c: Defines the undo log used to run programs backwards
+ */
+
+#include "undo.h"
+
+
+/*
+ * Allocate an empty log of capacity records, rounded up to a power of 2.
+ */
+UndoLog* UndoLogCreate(unsigned long long capacity)
+{
+    UndoLog* log = calloc(1, sizeof(UndoLog));
+    unsigned long long size = 1;
+
+    if (log == NULL) {
+        return NULL;
+    }
+    while (size < capacity) {
+        size *= 2;
+    }
+    log->records = malloc(size * sizeof(UndoRecord));
+    if (log->records == NULL) {
+        free(log);
+        return NULL;
+    }
+    log->mask = size - 1;
+    return log;
+}
+
+
+/*
+ * Free the log.
+ */
+void UndoLogDestroy(UndoLog* log)
+{
+    free(log->records);
+    free(log);
+}
+
+
+/*
+ * Forget every record.
+ */
+void UndoLogClear(UndoLog* log)
+{
+    log->count = 0;
+}
+
+
+/*
+ * Undo the newest recorded instruction.
+ */
+int UndoInstruction(UndoLog* log, MachineState* CPU)
+{
+    UndoRecord* record;
+
+    if (log->count == 0) {
+        return 1;
+    }
+    record = &log->records[--log->next & log->mask];
+    log->count--;
+
+    if (record->store) {
+        WriteMemory(CPU, record->addr, record->memValue);
+    }
+    CPU->R[record->reg] = record->regValue;
+    CPU->PSR = record->PSR;
+    CPU->PC = record->PC;
+    CPU->instrCount = record->instrCount;
+    return 0;
+}
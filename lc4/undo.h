@@ -0,0 +1,98 @@
+/*
+ * undo.h: Declares the undo log used to run programs backwards (built with
+ * -DLC4_UNDO)
+ */
+
+#ifndef UNDO_H
+#define UNDO_H
+
+#include "LC4.h"
+
+// Instructions the script runner keeps records of
+#define UNDO_RECORDS (1 << 20)
+
+// What one instruction changed, as it was before the instruction ran. Every
+// instruction writes at most one register and one memory word besides the
+// PC and PSR.
+typedef struct {
+    unsigned long long instrCount;
+    unsigned short int PC;
+    unsigned short int PSR;
+    unsigned short int regValue;        // R[reg]
+    unsigned short int addr;            // word a store overwrote, if store
+    unsigned short int memValue;
+    unsigned char reg;
+    unsigned char store;
+} UndoRecord;
+
+// Ring buffer of the records of the latest instructions; older ones are
+// overwritten
+struct UndoLog {
+    UndoRecord* records;
+    unsigned long long mask;            // capacity - 1, a power of 2
+    unsigned long long next;            // records written, the newest at next - 1
+    unsigned long long count;           // records that can still be undone
+};
+
+
+/*
+ * Record the instruction at the current PC, which is about to execute.
+ * Stores to devices are not recorded, since they cannot be taken back.
+ */
+static inline void RecordUndo(UndoLog* log, MachineState* CPU, DecodedInsn* insn)
+{
+    UndoRecord* record = &log->records[log->next++ & log->mask];
+
+    record->instrCount = CPU->instrCount;
+    record->PC = CPU->PC;
+    record->PSR = CPU->PSR;
+    record->reg = insn->opcode == OP_JSR || insn->opcode == OP_TRAP ? 7 : insn->d;
+    record->regValue = CPU->R[record->reg];
+    record->addr = CPU->R[insn->s] + insn->imm;
+    record->store = insn->opcode == OP_STR && record->addr < CPU->deviceBase;
+    if (record->store) {
+        record->memValue = ReadMemory(CPU, record->addr);
+    }
+    if (log->count <= log->mask) {
+        log->count++;
+    }
+}
+
+
+/*
+ * Drop the newest record, of an instruction that failed without running.
+ */
+static inline void DropUndo(UndoLog* log)
+{
+    log->next--;
+    log->count--;
+}
+
+
+/*
+ * Allocate an empty log of capacity records, rounded up to a power of 2.
+ * Returns NULL if out of memory.
+ */
+UndoLog* UndoLogCreate(unsigned long long capacity);
+
+
+/*
+ * Free the log.
+ */
+void UndoLogDestroy(UndoLog* log);
+
+
+/*
+ * Forget every record, for when the machine is changed other than by running it.
+ */
+void UndoLogClear(UndoLog* log);
+
+
+/*
+ * Put CPU back the way it was before the newest recorded instruction,
+ * including its instruction count, and drop the record. O(1). Returns 1 if
+ * there is nothing left to undo.
+ */
+int UndoInstruction(UndoLog* log, MachineState* CPU);
+
+#endif
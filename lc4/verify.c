@@ -0,0 +1,305 @@
+/*
+ * verify.c: Defines the streaming comparison of a trace against a golden trace
+ */
+
+#define _GNU_SOURCE
+#include "verify.h"
+#include "loader.h"
+#include <string.h>
+
+#ifdef __GLIBC__
+
+// Fields of a record in trace order, and whether they are printed in hex
+static const char* const FieldNames[10] = {
+    "PC", "insn", "regFile_WE", "regNum", "regInputVal", "NZP_WE", "NZPVal", "DATA_WE", "dmemAddr", "dmemValue"
+};
+static const int FieldHex[10] = { 1, 1, 0, 0, 1, 0, 0, 0, 1, 1 };
+
+struct TraceVerifier {
+    const unsigned char* golden;    // the mapped golden trace
+    size_t size;
+    unsigned char format;
+    size_t headerSize;              // bytes before the first record
+    size_t recordSize;              // bytes per record, including the newline of a text line
+    FILE* stream;                   // fopencookie stream comparing against golden
+
+    size_t pos;                     // bytes of the trace that matched so far
+    int diverged;
+    size_t offset;                  // first byte that differs, once diverged
+    size_t recordStart;             // offset of the record holding it
+    unsigned char mine[TRACE_LINE_LENGTH]; // that record as this run wrote it
+    size_t mineLength;
+};
+
+
+/*
+ * Offset of the record (or header) holding the byte at offset.
+ */
+static size_t RecordStart(TraceVerifier* verifier, size_t offset)
+{
+    if (offset < verifier->headerSize) {
+        return 0;
+    }
+    return offset - (offset - verifier->headerSize) % verifier->recordSize;
+}
+
+
+/*
+ * Size of the record (or header) starting at start.
+ */
+static size_t RecordSize(TraceVerifier* verifier, size_t start)
+{
+    return start < verifier->headerSize ? verifier->headerSize : verifier->recordSize;
+}
+
+
+/*
+ * fopencookie write callback: compare with the golden trace. After the first
+ * difference only the rest of that record is kept, for the report.
+ */
+static ssize_t CookieWrite(void* cookie, const char* data, size_t size)
+{
+    TraceVerifier* verifier = cookie;
+    const unsigned char* bytes = (const unsigned char*)data;
+    size_t left = size;
+    size_t n;
+    size_t i;
+
+    if (!verifier->diverged) {
+        n = verifier->size - verifier->pos;
+        if (n > size) {
+            n = size;
+        }
+        if (n == size && memcmp(bytes, verifier->golden + verifier->pos, n) == 0) { // the common case
+            verifier->pos += size;
+            return size;
+        }
+        for (i = 0; i < n && bytes[i] == verifier->golden[verifier->pos + i]; i++) {
+        }
+        verifier->diverged = 1;
+        verifier->offset = verifier->pos + i;
+        verifier->recordStart = RecordStart(verifier, verifier->offset);
+        verifier->mineLength = verifier->offset - verifier->recordStart;
+        memcpy(verifier->mine, verifier->golden + verifier->recordStart, verifier->mineLength);
+        verifier->pos += i;
+        bytes += i;
+        left -= i;
+    }
+
+    n = RecordSize(verifier, verifier->recordStart) - verifier->mineLength;
+    if (n > left) {
+        n = left;
+    }
+    memcpy(verifier->mine + verifier->mineLength, bytes, n);
+    verifier->mineLength += n;
+    return size;
+}
+
+
+/*
+ * Map the golden trace and open the stream comparing against it.
+ */
+TraceVerifier* VerifierOpen(const char* filename, unsigned char* format)
+{
+    cookie_io_functions_t io = { NULL, CookieWrite, NULL, NULL };
+    TraceVerifier* verifier = calloc(1, sizeof(TraceVerifier));
+
+    if (verifier == NULL) {
+        printf("error: out of memory\n");
+        return NULL;
+    }
+    verifier->golden = MapFile(filename, &verifier->size);
+    if (verifier->golden == NULL) {
+        printf("error: cannot open %s\n", filename);
+        free(verifier);
+        return NULL;
+    }
+    if (verifier->size >= TRACE_HEADER_SIZE && memcmp(verifier->golden, TRACE_MAGIC, 8) == 0) {
+        verifier->format = TRACE_BINARY;
+        verifier->headerSize = TRACE_HEADER_SIZE;
+        verifier->recordSize = TRACE_RECORD_SIZE;
+    } else {
+        verifier->format = TRACE_TEXT;
+        verifier->headerSize = 0;
+        verifier->recordSize = TRACE_LINE_LENGTH;
+    }
+    *format = verifier->format;
+
+    verifier->stream = fopencookie(verifier, "w", io);
+    if (verifier->stream == NULL) {
+        printf("error: out of memory\n");
+        UnmapFile(verifier->golden, verifier->size);
+        free(verifier);
+        return NULL;
+    }
+    return verifier;
+}
+
+
+/*
+ * The stream to write the trace to.
+ */
+FILE* VerifierStream(TraceVerifier* verifier)
+{
+    return verifier->stream;
+}
+
+
+/*
+ * Flush the stream and report whether the trace has diverged.
+ */
+int VerifierDiverged(TraceVerifier* verifier)
+{
+    fflush(verifier->stream);
+    return verifier->diverged;
+}
+
+
+/*
+ * Parse the record of length bytes at p. Returns 0 on success.
+ */
+static int ParseRecord(TraceVerifier* verifier, const unsigned char* p, size_t length, TraceRecord* rec)
+{
+    const unsigned char* end;
+
+    if (verifier->format == TRACE_BINARY) {
+        if (length < TRACE_RECORD_SIZE) {
+            return 1;
+        }
+        DecodeBinaryRecord(p, rec);
+        return 0;
+    }
+    end = memchr(p, '\n', length);
+    return ParseTextRecord((const char*)p, end != NULL ? (size_t)(end - p) : length, rec);
+}
+
+
+/*
+ * The fields of rec in trace order.
+ */
+static void RecordFields(const TraceRecord* rec, unsigned int* fields)
+{
+    fields[0] = rec->PC;
+    fields[1] = rec->insn;
+    fields[2] = rec->regFile_WE;
+    fields[3] = rec->regNum;
+    fields[4] = rec->regInputVal;
+    fields[5] = rec->NZP_WE;
+    fields[6] = rec->NZPVal;
+    fields[7] = rec->DATA_WE;
+    fields[8] = rec->dmemAddr;
+    fields[9] = rec->dmemValue;
+}
+
+
+/*
+ * Print where and how the trace first differs from the golden one.
+ */
+static void ReportDivergence(TraceVerifier* verifier)
+{
+    unsigned long long number = (verifier->recordStart - verifier->headerSize) / verifier->recordSize + 1;
+    size_t goldenLength = verifier->size - verifier->recordStart;
+    TraceRecord expected;
+    TraceRecord actual;
+    unsigned int expectedFields[10];
+    unsigned int actualFields[10];
+    int haveExpected;
+    int haveActual;
+    int i;
+
+    if (verifier->recordStart < verifier->headerSize) {
+        printf("verify: the trace header differs from the golden trace\n");
+        return;
+    }
+    if (goldenLength > verifier->recordSize) {
+        goldenLength = verifier->recordSize;
+    }
+    haveExpected = verifier->offset < verifier->size &&
+        ParseRecord(verifier, verifier->golden + verifier->recordStart, goldenLength, &expected) == 0;
+    haveActual = ParseRecord(verifier, verifier->mine, verifier->mineLength, &actual) == 0;
+
+    if (verifier->offset >= verifier->size) {
+        printf("verify: the golden trace ends after record %llu but the run went on", number - 1);
+        if (haveActual) {
+            printf(" at PC %04X", actual.PC);
+        }
+        printf("\n");
+        return;
+    }
+    if (!haveExpected || !haveActual) {
+        printf("verify: record %llu differs at byte %llu and cannot be parsed\n", number,
+               (unsigned long long)(verifier->offset - verifier->recordStart));
+        return;
+    }
+
+    RecordFields(&expected, expectedFields);
+    RecordFields(&actual, actualFields);
+    for (i = 0; i < 10; i++) {
+        if (expectedFields[i] != actualFields[i]) {
+            printf(FieldHex[i] ? "verify: record %llu, PC %04X: %s is %04X in the golden trace but %04X here\n"
+                               : "verify: record %llu, PC %04X: %s is %u in the golden trace but %u here\n",
+                   number, expected.PC, FieldNames[i], expectedFields[i], actualFields[i]);
+            return;
+        }
+    }
+    printf("verify: record %llu, PC %04X: same values, formatted differently\n", number, expected.PC);
+}
+
+
+/*
+ * Finish the comparison, report and free the verifier.
+ */
+int VerifierClose(TraceVerifier* verifier)
+{
+    TraceRecord rec;
+    size_t records;
+    int failed = 1;
+
+    fclose(verifier->stream);
+    records = verifier->pos < verifier->headerSize ? 0 : (verifier->pos - verifier->headerSize) / verifier->recordSize;
+    if (verifier->diverged) {
+        ReportDivergence(verifier);
+    } else if (verifier->pos < verifier->size) {
+        printf("verify: the run ended after record %llu but the golden trace goes on", (unsigned long long)records);
+        if (verifier->pos >= verifier->headerSize &&
+            ParseRecord(verifier, verifier->golden + verifier->pos, verifier->size - verifier->pos, &rec) == 0) {
+            printf(" at PC %04X", rec.PC);
+        }
+        printf("\n");
+    } else {
+        printf("verify: %llu records match\n", (unsigned long long)records);
+        failed = 0;
+    }
+    UnmapFile(verifier->golden, verifier->size);
+    free(verifier);
+    return failed;
+}
+
+#else
+
+/*
+ * Without fopencookie there is no way to hand out a FILE* that compares
+ * instead of writing, so verifying is not available.
+ */
+TraceVerifier* VerifierOpen(const char* filename, unsigned char* format)
+{
+    printf("error: verifying a trace is not supported on this host\n");
+    return NULL;
+}
+
+FILE* VerifierStream(TraceVerifier* verifier)
+{
+    return NULL;
+}
+
+int VerifierDiverged(TraceVerifier* verifier)
+{
+    return 0;
+}
+
+int VerifierClose(TraceVerifier* verifier)
+{
+    return 1;
+}
+
+#endif
@@ -0,0 +1,43 @@
+/*
+ * verify.h: Declares the streaming comparison of a trace against a golden trace
+ */
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stdio.h>
+
+typedef struct TraceVerifier TraceVerifier;
+
+/*
+ * Map the golden trace in filename and detect its format: format is set to
+ * TRACE_BINARY if it starts with a binary trace header, otherwise TRACE_TEXT.
+ * Returns NULL if the file cannot be read or, on hosts without fopencookie,
+ * always; the error has been printed.
+ */
+TraceVerifier* VerifierOpen(const char* filename, unsigned char* format);
+
+
+/*
+ * The stream to write the trace to. Everything written is compared with the
+ * golden trace as it arrives and never stored; after the first difference
+ * further writes are ignored.
+ */
+FILE* VerifierStream(TraceVerifier* verifier);
+
+
+/*
+ * Flush the stream. Returns 1 once the trace has diverged from the golden one.
+ */
+int VerifierDiverged(TraceVerifier* verifier);
+
+
+/*
+ * Finish the comparison and free the verifier. Prints the first divergence
+ * (record number, PC, field and both values) or, if there was none, that
+ * the traces match; a golden trace that goes on after the run ended is a
+ * divergence too. Returns 0 if the traces match.
+ */
+int VerifierClose(TraceVerifier* verifier);
+
+#endif